@@ -1,24 +1,54 @@
+#include <chrono>
 #include <iostream>
 #include <map>
+#include <CompiledExpression.hpp>
 #include <Expression.hpp>
+#include <FileParse.hpp>
+#include <PassManager.hpp>
 #include <string>
+#include <vector>
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    // Флаги оптимизации можно указывать в любом месте: --opt-level N (или -O0..-O3), --print-passes
+    std::vector<std::string> args;
+    int opt_level = 0;
+    bool print_passes = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--opt-level")
+        {
+            if (i + 1 >= argc)
+                throw std::runtime_error("Expected optimisation level");
+            opt_level = std::stoi(argv[++i]);
+        }
+        else if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' && std::isdigit(arg[2]))
+            opt_level = arg[2] - '0';
+        else if (arg == "--print-passes")
+            print_passes = true;
+        else
+            args.push_back(arg);
+    }
+
+    if (args.empty())
     {
         throw std::runtime_error("Not enough arguments\n");
         return 1;
     }
-    std::string type = argv[1];
+    std::string type = args[0];
+    auto manager = PassManager<Real>::for_level(opt_level);
+    std::vector<PassStats> stats;
 
     if (type == "--eval")
     {
-        std::string expr_str = argv[2];
+        if (args.size() < 2)
+            throw std::runtime_error("Invalid request");
+        std::string expr_str = args[1];
         std::map<std::string, Real> vars;
-        for (int i = 3; i < argc; ++i)
+        for (size_t i = 2; i < args.size(); ++i)
         {
-            std::string Var = argv[i];
+            std::string Var = args[i];
             int pos = Var.find("=");
             std::string var = Var.substr(0, pos);
             Real val = stold(Var.substr(pos + 1));
@@ -26,17 +56,79 @@ int main(int argc, char *argv[])
                 throw std::runtime_error("2 times one variable");
             vars[var] = val;
         }
-        std::cout << make_expression<Real>(expr_str).eval(vars) << '\n';
+        auto expr = manager.run(make_expression<Real>(expr_str), &stats);
+        std::cout << expr.eval(vars) << '\n';
     }
     else if (type == "--diff")
     {
-        if (argc != 5 || std::string(argv[3]) != "--by")
+        if (args.size() != 4 || args[2] != "--by")
             throw std::runtime_error("Invalid request");
-        std::string expr_str = argv[2];
-        std::cout << make_expression<Real>(expr_str).diff(argv[4]) << '\n';
+        std::string expr_str = args[1];
+        std::cout << manager.run(make_expression<Real>(expr_str).diff(args[3]), &stats) << '\n';
+    }
+    else if (type == "--validate")
+    {
+        // Формулы по одной на строку из stdin: ошибки — в stdout, итог и скорость — в stderr
+        size_t line_no = 0, invalid = 0, bytes = 0;
+        std::string line;
+        auto start = std::chrono::steady_clock::now();
+        while (std::getline(std::cin, line))
+        {
+            ++line_no;
+            bytes += line.size() + 1;
+            auto result = try_parse<Real>(line);
+            if (!result)
+            {
+                ++invalid;
+                std::cout << line_no << ": " << result.error().message() << '\n';
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "valid " << line_no - invalid << ", invalid " << invalid << ", "
+                  << (seconds > 0 ? line_no / seconds : 0) << " lines/s, "
+                  << (seconds > 0 ? bytes / seconds / 1e6 : 0) << " MB/s\n";
+    }
+    else if (type == "--file")
+    {
+        // Формула из файла (или "-" для stdin) любого размера: значение в точке,
+        // с --by var — значение производной. Дерево не обходится рекурсивно
+        if (args.size() < 2)
+            throw std::runtime_error("Invalid request");
+        std::string by;
+        std::map<std::string, Real> vars;
+        for (size_t i = 2; i < args.size(); ++i)
+        {
+            if (args[i] == "--by" && i + 1 < args.size())
+            {
+                by = args[++i];
+                continue;
+            }
+            size_t pos = args[i].find('=');
+            if (pos == std::string::npos || vars.count(args[i].substr(0, pos)))
+                throw std::runtime_error("Invalid request");
+            vars[args[i].substr(0, pos)] = stold(args[i].substr(pos + 1));
+        }
+        auto parsed = args[1] == "-" ? try_parse_fd<Real>(0) : try_parse_file<Real>(args[1]);
+        if (!parsed)
+        {
+            std::cerr << args[1] << ": " << parsed.error().message() << '\n';
+            return 1;
+        }
+        CompiledExpression<Real> compiled(*parsed);
+        if (by.empty())
+            std::cout << compiled.eval(vars) << '\n';
+        else
+        {
+            const auto &names = compiled.variables();
+            auto it = std::find(names.begin(), names.end(), by);
+            std::cout << (it == names.end() ? 0 : compiled.gradient(vars)[it - names.begin()]) << '\n';
+        }
     }
     else
     {
         throw std::runtime_error("Unkown function");
     }
-}
\ No newline at end of file
+
+    if (print_passes)
+        std::cerr << format_pass_stats(stats);
+}
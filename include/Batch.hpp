@@ -0,0 +1,371 @@
+#ifndef Batch_HPP
+#define Batch_HPP
+
+#include "CompiledExpression.hpp"
+
+/*
+=====================
+BATCH EVALUATOR
+=====================
+*/
+
+// Вычисление скомпилированного выражения сразу для многих точек.
+// Строки обрабатываются блоками по block_rows: каждая ячейка ленты хранит
+// значения всего блока подряд, так что внутренние циклы по строкам векторизуются.
+// Входы и градиент хранятся по столбцам: элемент (r, k) лежит в [k * n_rows + r].
+// compiled должен жить дольше объекта.
+// parameters — переменные, постоянные в пределах пакета (их столбцы заполнены одним значением).
+// Ячейки, зависящие только от констант и параметров, вычисляются один раз на пакет
+// и дальше подаются в блоки как константы
+template <Numeric T = Real>
+class BatchEvaluator
+{
+private:
+    const CompiledExpression<T> &compiled;
+    size_t block_rows;
+    std::vector<char> invariant; // по ячейкам ленты: не зависит от строки
+
+    void hoist(const T *inputs, size_t n_rows, T *val) const;
+    void forward_slot(size_t i, T *val, size_t lanes) const;
+    void forward_block(const T *inputs, size_t n_rows, size_t row0, size_t lanes, T *val) const;
+
+public:
+    explicit BatchEvaluator(const CompiledExpression<T> &compiled, size_t block_rows = 256,
+                            const std::set<std::string> &parameters = {});
+
+    size_t getBlockRows() const { return block_rows; }
+    bool is_invariant(int slot) const { return invariant[slot]; }
+
+    void eval(const T *inputs, size_t n_rows, T *out) const;
+    std::vector<T> eval(const std::vector<T> &inputs, size_t n_rows) const;
+
+    // grad — матрица n_rows x variables().size() по столбцам
+    void gradient(const T *inputs, size_t n_rows, T *grad) const;
+    std::vector<T> gradient(const std::vector<T> &inputs, size_t n_rows) const;
+};
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+// y[r] = op(a[r], b[r]) для r < n; операция выбирается один раз на весь блок
+template <Numeric T>
+void lanes_forward(ExprType op, const T *a, const T *b, T *y, size_t n)
+{
+    switch (op)
+    {
+    case ExprType::Add:
+        for (size_t r = 0; r < n; ++r)
+            y[r] = a[r] + b[r];
+        return;
+    case ExprType::Subtract:
+        for (size_t r = 0; r < n; ++r)
+            y[r] = a[r] - b[r];
+        return;
+    case ExprType::Multiply:
+        for (size_t r = 0; r < n; ++r)
+            y[r] = a[r] * b[r];
+        return;
+    case ExprType::Divide:
+        for (size_t r = 0; r < n; ++r)
+            if (b[r] == T(0))
+                throw std::runtime_error("division by 0");
+        for (size_t r = 0; r < n; ++r)
+            y[r] = a[r] / b[r];
+        return;
+    case ExprType::Power:
+        for (size_t r = 0; r < n; ++r)
+            y[r] = std::pow(a[r], b[r]);
+        return;
+    case ExprType::Negate:
+        for (size_t r = 0; r < n; ++r)
+            y[r] = -a[r];
+        return;
+    case ExprType::Sin:
+        for (size_t r = 0; r < n; ++r)
+            y[r] = std::sin(a[r]);
+        return;
+    case ExprType::Cos:
+        for (size_t r = 0; r < n; ++r)
+            y[r] = std::cos(a[r]);
+        return;
+    case ExprType::Exp:
+        for (size_t r = 0; r < n; ++r)
+            y[r] = std::exp(a[r]);
+        return;
+    case ExprType::Ln:
+        for (size_t r = 0; r < n; ++r)
+            y[r] = apply_function(ExprType::Ln, a[r]);
+        return;
+    case ExprType::Sqrt:
+        for (size_t r = 0; r < n; ++r)
+            y[r] = std::sqrt(a[r]);
+        return;
+    default:
+        throw std::runtime_error("Doesn`t exist operation");
+    }
+}
+
+// s[r] = sin(a[r]), c[r] = cos(a[r]) одним проходом
+template <Numeric T>
+void lanes_sincos(const T *a, T *s, T *c, size_t n)
+{
+    for (size_t r = 0; r < n; ++r)
+        sin_cos(a[r], s[r], c[r]);
+}
+
+// Обратный проход для блока: ga += gy * dy/da, gb += gy * dy/db
+template <Numeric T>
+void lanes_reverse(ExprType op, const T *a, const T *b, const T *y, const T *gy, T *ga, T *gb, bool need_b,
+                   size_t n)
+{
+    switch (op)
+    {
+    case ExprType::Add:
+        for (size_t r = 0; r < n; ++r)
+        {
+            ga[r] = ga[r] + gy[r];
+            gb[r] = gb[r] + gy[r];
+        }
+        return;
+    case ExprType::Subtract:
+        for (size_t r = 0; r < n; ++r)
+        {
+            ga[r] = ga[r] + gy[r];
+            gb[r] = gb[r] - gy[r];
+        }
+        return;
+    case ExprType::Multiply:
+        for (size_t r = 0; r < n; ++r)
+        {
+            ga[r] = ga[r] + gy[r] * b[r];
+            gb[r] = gb[r] + gy[r] * a[r];
+        }
+        return;
+    case ExprType::Divide:
+        for (size_t r = 0; r < n; ++r)
+        {
+            T q = gy[r] / b[r];
+            ga[r] = ga[r] + q;
+            gb[r] = gb[r] - q * y[r];
+        }
+        return;
+    case ExprType::Power:
+        for (size_t r = 0; r < n; ++r)
+            if (!(b[r] == T(0)))
+                ga[r] = ga[r] + gy[r] * b[r] * T(std::pow(a[r], b[r] - T(1)));
+        if (need_b)
+            for (size_t r = 0; r < n; ++r)
+                gb[r] = gb[r] + gy[r] * y[r] * apply_function(ExprType::Ln, a[r]);
+        return;
+    case ExprType::Negate:
+        for (size_t r = 0; r < n; ++r)
+            ga[r] = ga[r] - gy[r];
+        return;
+    case ExprType::Sin:
+        for (size_t r = 0; r < n; ++r)
+            ga[r] = ga[r] + gy[r] * T(std::cos(a[r]));
+        return;
+    case ExprType::Cos:
+        for (size_t r = 0; r < n; ++r)
+            ga[r] = ga[r] - gy[r] * T(std::sin(a[r]));
+        return;
+    case ExprType::Exp:
+        for (size_t r = 0; r < n; ++r)
+            ga[r] = ga[r] + gy[r] * y[r];
+        return;
+    case ExprType::Ln:
+        for (size_t r = 0; r < n; ++r)
+            ga[r] = ga[r] + gy[r] / a[r];
+        return;
+    case ExprType::Sqrt:
+        for (size_t r = 0; r < n; ++r)
+            ga[r] = ga[r] + T(0.5) * gy[r] / y[r];
+        return;
+    default:
+        throw std::runtime_error("Doesn`t exist operation");
+    }
+}
+
+template <Numeric T>
+BatchEvaluator<T>::BatchEvaluator(const CompiledExpression<T> &compiled, size_t block_rows,
+                                  const std::set<std::string> &parameters)
+    : compiled(compiled), block_rows(block_rows)
+{
+    if (block_rows == 0)
+        throw std::runtime_error("Block size must be positive");
+
+    // Ячейка неизменна по строкам, если это константа, параметр или операция над такими ячейками
+    const auto &code = compiled.instructions();
+    invariant.resize(code.size());
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        const auto &ins = code[i];
+        if (ins.op == ExprType::Constant)
+            invariant[i] = true;
+        else if (ins.op == ExprType::Variable)
+            invariant[i] = parameters.count(compiled.variables()[ins.lhs]) > 0;
+        else
+            invariant[i] = invariant[ins.lhs] && (!is_binary(ins.op) || invariant[ins.rhs]);
+    }
+}
+
+// Неизменные ячейки считаются по одной строке и размножаются на весь блок;
+// блоки их не перезаписывают, поэтому значения живут до конца пакета
+template <Numeric T>
+void BatchEvaluator<T>::hoist(const T *inputs, size_t n_rows, T *val) const
+{
+    const auto &code = compiled.instructions();
+    const auto &constants = compiled.constant_values();
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        if (!invariant[i])
+            continue;
+        const auto &ins = code[i];
+        T *y = val + i * block_rows;
+        if (ins.op == ExprType::Constant)
+            y[0] = constants[ins.lhs];
+        else if (ins.op == ExprType::Variable)
+        {
+            const T *column = inputs + ins.lhs * n_rows;
+            for (size_t r = 1; r < n_rows; ++r)
+                if (!(column[r] == column[0]))
+                    throw std::runtime_error("Parameter '" + compiled.variables()[ins.lhs] +
+                                             "' changes within the batch");
+            y[0] = column[0];
+        }
+        else
+            forward_slot(i, val, 1);
+        std::fill(y + 1, y + block_rows, y[0]);
+    }
+}
+
+template <Numeric T>
+void BatchEvaluator<T>::forward_block(const T *inputs, size_t n_rows, size_t row0, size_t lanes, T *val) const
+{
+    const auto &code = compiled.instructions();
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        if (invariant[i])
+            continue;
+        const auto &ins = code[i];
+        T *y = val + i * block_rows;
+        if (ins.op == ExprType::Variable)
+            std::copy(inputs + ins.lhs * n_rows + row0, inputs + ins.lhs * n_rows + row0 + lanes, y);
+        else
+            forward_slot(i, val, lanes);
+    }
+}
+
+template <Numeric T>
+void BatchEvaluator<T>::forward_slot(size_t i, T *val, size_t lanes) const
+{
+    const auto &ins = compiled.instructions()[i];
+    int partner = compiled.sincos_partner(i);
+    if (partner < 0)
+    {
+        const T *b = is_binary(ins.op) ? val + ins.rhs * block_rows : nullptr;
+        lanes_forward(ins.op, val + ins.lhs * block_rows, b, val + i * block_rows, lanes);
+    }
+    else if ((size_t)partner > i)
+    {
+        // Пара sin/cos заполняется при первой из двух ячеек
+        size_t s = ins.op == ExprType::Sin ? i : partner;
+        size_t c = ins.op == ExprType::Sin ? partner : i;
+        lanes_sincos(val + ins.lhs * block_rows, val + s * block_rows, val + c * block_rows, lanes);
+    }
+}
+
+template <Numeric T>
+void BatchEvaluator<T>::eval(const T *inputs, size_t n_rows, T *out) const
+{
+    const auto &code = compiled.instructions();
+    int out_slot = compiled.outputs()[0];
+    std::vector<T> val(code.size() * block_rows);
+    if (n_rows > 0)
+        hoist(inputs, n_rows, val.data());
+
+    for (size_t row0 = 0; row0 < n_rows; row0 += block_rows)
+    {
+        size_t lanes = std::min(block_rows, n_rows - row0);
+        forward_block(inputs, n_rows, row0, lanes, val.data());
+        std::copy(val.begin() + out_slot * block_rows, val.begin() + out_slot * block_rows + lanes, out + row0);
+    }
+}
+
+template <Numeric T>
+std::vector<T> BatchEvaluator<T>::eval(const std::vector<T> &inputs, size_t n_rows) const
+{
+    if (inputs.size() != n_rows * compiled.variables().size())
+        throw std::runtime_error("Inputs size doesn`t match rows and variables");
+    std::vector<T> out(n_rows);
+    eval(inputs.data(), n_rows, out.data());
+    return out;
+}
+
+template <Numeric T>
+void BatchEvaluator<T>::gradient(const T *inputs, size_t n_rows, T *grad) const
+{
+    const auto &code = compiled.instructions();
+    const auto &var_slots = compiled.variable_slots();
+    int out_slot = compiled.outputs()[0];
+
+    // Буферы выделяются один раз и переиспользуются всеми блоками
+    std::vector<T> val(code.size() * block_rows), adj(code.size() * block_rows);
+    if (n_rows > 0)
+        hoist(inputs, n_rows, val.data());
+
+    for (size_t row0 = 0; row0 < n_rows; row0 += block_rows)
+    {
+        size_t lanes = std::min(block_rows, n_rows - row0);
+        forward_block(inputs, n_rows, row0, lanes, val.data());
+
+        std::fill(adj.begin(), adj.end(), T(0));
+        std::fill(adj.begin() + out_slot * block_rows, adj.begin() + out_slot * block_rows + lanes, T(1));
+        for (size_t i = code.size(); i-- > 0;)
+        {
+            const auto &ins = code[i];
+            if (!compiled.is_active(i) || ins.op == ExprType::Variable)
+                continue;
+            int partner = compiled.sincos_partner(i);
+            if (partner >= 0)
+            {
+                // sin' = cos и cos' = -sin уже лежат в ячейке пары
+                const T *other = val.data() + partner * block_rows;
+                const T *gy = adj.data() + i * block_rows;
+                T *ga = adj.data() + ins.lhs * block_rows;
+                if (ins.op == ExprType::Sin)
+                    for (size_t r = 0; r < lanes; ++r)
+                        ga[r] = ga[r] + gy[r] * other[r];
+                else
+                    for (size_t r = 0; r < lanes; ++r)
+                        ga[r] = ga[r] - gy[r] * other[r];
+                continue;
+            }
+            bool binary = is_binary(ins.op);
+            T *gb = binary ? adj.data() + ins.rhs * block_rows : nullptr;
+            const T *b = binary ? val.data() + ins.rhs * block_rows : nullptr;
+            lanes_reverse(ins.op, val.data() + ins.lhs * block_rows, b, val.data() + i * block_rows,
+                          adj.data() + i * block_rows, adj.data() + ins.lhs * block_rows, gb,
+                          binary && compiled.is_active(ins.rhs), lanes);
+        }
+
+        for (size_t k = 0; k < var_slots.size(); ++k)
+        {
+            auto column = adj.begin() + var_slots[k] * block_rows;
+            std::copy(column, column + lanes, grad + k * n_rows + row0);
+        }
+    }
+}
+
+template <Numeric T>
+std::vector<T> BatchEvaluator<T>::gradient(const std::vector<T> &inputs, size_t n_rows) const
+{
+    if (inputs.size() != n_rows * compiled.variables().size())
+        throw std::runtime_error("Inputs size doesn`t match rows and variables");
+    std::vector<T> grad(n_rows * compiled.variables().size());
+    gradient(inputs.data(), n_rows, grad.data());
+    return grad;
+}
+
+#endif // Batch_HPP
@@ -0,0 +1,139 @@
+#ifndef BulkParse_HPP
+#define BulkParse_HPP
+
+#include "FileParse.hpp"
+#include "HashCons.hpp"
+#include <atomic>
+#include <exception>
+#include <span>
+#include <thread>
+
+/*
+=====================
+BULK PARSING
+=====================
+*/
+
+// Результат разбора многих формул: results[k] соответствует texts[k].
+// Все выражения собраны в одном context, равные поддеревья разных формул — один узел
+template <Numeric T = Real>
+struct ParsedBatch
+{
+    std::vector<Expected<Expression<T>, ParseError>> results;
+    HashCons<T> context;
+    size_t errors = 0;
+};
+
+// Параллельный разбор независимых формул. Формулы раздаются потокам блоками по
+// chunk_size; каждый поток разбирает их сразу в свою таблицу HashCons, после чего
+// таблицы по очереди сливаются в общую. threads = 0 — по числу ядер
+template <Numeric T = Real>
+ParsedBatch<T> parse_many(std::span<const std::string_view> texts, unsigned threads = 0, size_t chunk_size = 1024);
+
+// То же для файла с формулой на каждой строке; '\r' в конце строки отбрасывается.
+// Файл не открылся — std::runtime_error
+template <Numeric T = Real>
+ParsedBatch<T> parse_lines_file(const std::string &path, unsigned threads = 0, size_t chunk_size = 1024);
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+template <Numeric T>
+ParsedBatch<T> parse_many(std::span<const std::string_view> texts, unsigned threads, size_t chunk_size)
+{
+    using Ptr = std::shared_ptr<Node<T>>;
+    const size_t n = texts.size();
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    const size_t chunks = (n + chunk_size - 1) / chunk_size;
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = (unsigned)std::min<size_t>(threads, std::max<size_t>(chunks, 1));
+
+    std::vector<Ptr> roots(n);
+    std::vector<std::optional<ParseError>> failures(n);
+    std::vector<HashCons<T>> local(threads);
+    std::vector<std::vector<size_t>> taken(threads); // номера блоков, разобранных потоком
+    std::vector<std::exception_ptr> thrown(threads);
+    std::atomic<size_t> next_chunk{0};
+
+    auto work = [&](unsigned t)
+    {
+        try
+        {
+            for (size_t c; (c = next_chunk.fetch_add(1)) < chunks;)
+            {
+                taken[t].push_back(c);
+                for (size_t k = c * chunk_size; k < std::min(n, (c + 1) * chunk_size); ++k)
+                {
+                    Parser<T, TextSource, HashConsBuilder<T>> parser(texts[k], HashConsBuilder<T>(local[t]));
+                    roots[k] = parser.parse();
+                    if (!roots[k])
+                        failures[k] = parser.error();
+                }
+            }
+        }
+        catch (...)
+        {
+            thrown[t] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t)
+        pool.emplace_back(work, t);
+    work(0);
+    for (auto &thread : pool)
+        thread.join();
+    for (auto &error : thrown)
+        if (error)
+            std::rethrow_exception(error);
+
+    // Слияние: узлы каждой локальной таблицы переводятся в общую по одному разу
+    ParsedBatch<T> batch;
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        std::unordered_map<const Node<T> *, Ptr> seen;
+        for (size_t c : taken[t])
+            for (size_t k = c * chunk_size; k < std::min(n, (c + 1) * chunk_size); ++k)
+                if (roots[k])
+                    roots[k] = batch.context.intern(roots[k], seen);
+        local[t] = HashCons<T>();
+    }
+
+    batch.results.reserve(n);
+    for (size_t k = 0; k < n; ++k)
+    {
+        if (roots[k])
+            batch.results.emplace_back(Expression<T>(std::move(roots[k])));
+        else
+        {
+            batch.results.emplace_back(*failures[k]);
+            ++batch.errors;
+        }
+    }
+    return batch;
+}
+
+template <Numeric T>
+ParsedBatch<T> parse_lines_file(const std::string &path, unsigned threads, size_t chunk_size)
+{
+    MappedFile file(path);
+    if (!file.is_open())
+        throw std::runtime_error("Cannot open '" + path + "'");
+
+    std::vector<std::string_view> lines;
+    std::string_view text = file.text();
+    while (!text.empty())
+    {
+        size_t end = std::min(text.find('\n'), text.size());
+        std::string_view line = text.substr(0, end);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        lines.push_back(line);
+        text.remove_prefix(std::min(end + 1, text.size()));
+    }
+    // Узлы не ссылаются на текст, файл можно закрыть сразу после разбора
+    return parse_many<T>(lines, threads, chunk_size);
+}
+
+#endif // BulkParse_HPP
@@ -0,0 +1,295 @@
+#ifndef Checkpoint_HPP
+#define Checkpoint_HPP
+
+#include "CompiledExpression.hpp"
+#include <algorithm>
+#include <unordered_map>
+
+/*
+=====================
+CHECKPOINTED TAPE
+=====================
+*/
+
+struct CheckpointStats
+{
+    size_t tape_size = 0;
+    size_t segments = 0;    // шагов (отрезков ленты) в обратном проходе
+    size_t checkpoints = 0; // одновременно хранимых контрольных точек
+    size_t executed = 0;    // выполнено инструкций прямого хода, включая пересчёт
+    size_t peak_values = 0; // наибольшее число одновременно хранимых значений
+
+    // Во сколько раз прямой ход дороже однократного: 1 — без пересчёта
+    double overhead() const;
+};
+
+// Обратный режим при ограниченной памяти под промежуточные значения.
+// Лента режется на отрезки, которые помещаются в бюджет целиком; на границах
+// отрезков хранится только состояние — значения ячеек, живых через границу.
+// Порядок пересчёта — биномиальный (revolve): s контрольных точек и t повторных
+// проходов обслуживают C(s + t, s) отрезков.
+// compiled должен жить дольше объекта
+template <Numeric T = Real>
+class CheckpointedTape
+{
+private:
+    using State = std::vector<T>; // значения в порядке live[j]
+
+    const CompiledExpression<T> &compiled;
+    size_t segment_len = 1;
+    size_t n_segments = 1;
+    size_t n_checkpoints = 0;
+    size_t sweeps = 1;
+    std::vector<std::vector<int>> live; // live[j] — ячейки до начала отрезка j, нужные после него
+
+    struct Run
+    {
+        const std::vector<T> &x;
+        std::unordered_map<int, T> pending; // сопряжённые ячеек из ещё не пройденных отрезков
+        std::vector<T> local_val, local_adj;
+        std::vector<T> grad;
+        CheckpointStats stats;
+        size_t stored = 0;
+
+        explicit Run(const std::vector<T> &x) : x(x) {}
+    };
+
+    T lookup(int slot, size_t segment, const State &state, const std::vector<T> &local, const Run &run) const;
+    void compute_segment(size_t segment, const State &state, Run &run) const;
+    State advance(size_t from, size_t to, State state, Run &run) const;
+    void reverse_segment(size_t segment, const State &state, Run &run) const;
+    void reverse(size_t lo, size_t hi, const State &state, size_t s, size_t t, Run &run) const;
+
+public:
+    CheckpointedTape(const CompiledExpression<T> &compiled, size_t memory_budget_bytes);
+
+    size_t segments() const { return n_segments; }
+    size_t checkpoints() const { return n_checkpoints; }
+
+    std::vector<T> gradient(const std::map<std::string, T> &bindings, CheckpointStats *stats = nullptr) const;
+};
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+inline double CheckpointStats::overhead() const
+{
+    return tape_size ? (double)executed / tape_size : 0;
+}
+
+// C(s + t, s) с насыщением
+inline size_t binomial_steps(size_t s, size_t t)
+{
+    long double result = 1;
+    for (size_t k = 1; k <= s; ++k)
+        result = result * (t + k) / k;
+    return result > 1e18 ? (size_t)1e18 : (size_t)(result + 0.5);
+}
+
+template <Numeric T>
+CheckpointedTape<T>::CheckpointedTape(const CompiledExpression<T> &compiled, size_t memory_budget_bytes)
+    : compiled(compiled)
+{
+    const auto &code = compiled.instructions();
+    size_t n = code.size();
+    size_t budget = memory_budget_bytes / sizeof(T);
+    if (budget < 8)
+        throw std::runtime_error("Memory budget is too small");
+
+    // Половина бюджета — значения и сопряжённые одного отрезка
+    segment_len = std::max<size_t>(1, std::min(n, budget / 4));
+    n_segments = (n + segment_len - 1) / segment_len;
+
+    // Константы и переменные всегда доступны без хранения, их в состояние не кладём
+    std::vector<size_t> last_use(n, 0);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const auto &ins = code[i];
+        if (ins.op == ExprType::Constant || ins.op == ExprType::Variable)
+            continue;
+        last_use[ins.lhs] = i;
+        if (is_binary(ins.op))
+            last_use[ins.rhs] = i;
+    }
+
+    live.assign(n_segments, {});
+    size_t max_live = 1;
+    for (size_t s = 0; s < n; ++s)
+    {
+        if (code[s].op == ExprType::Constant || code[s].op == ExprType::Variable)
+            continue;
+        for (size_t j = s / segment_len + 1; j < n_segments && j * segment_len <= last_use[s]; ++j)
+            live[j].push_back(s);
+    }
+    for (const auto &set : live)
+        max_live = std::max(max_live, set.size());
+
+    // Вторая половина — контрольные точки и отложенные сопряжённые
+    size_t rest = budget / 2;
+    n_checkpoints = rest > max_live ? (rest - max_live) / max_live : 0;
+    n_checkpoints = std::min(n_checkpoints, n_segments - 1);
+    sweeps = 1;
+    if (n_checkpoints > 0)
+        while (binomial_steps(n_checkpoints, sweeps) < n_segments)
+            ++sweeps;
+    else
+        sweeps = n_segments;
+}
+
+template <Numeric T>
+T CheckpointedTape<T>::lookup(int slot, size_t segment, const State &state, const std::vector<T> &local,
+                              const Run &run) const
+{
+    const auto &ins = compiled.instructions()[slot];
+    if (ins.op == ExprType::Constant)
+        return compiled.constant_values()[ins.lhs];
+    if (ins.op == ExprType::Variable)
+        return run.x[ins.lhs];
+    size_t begin = segment * segment_len;
+    if ((size_t)slot >= begin)
+        return local[slot - begin];
+    const auto &set = live[segment];
+    return state[std::lower_bound(set.begin(), set.end(), slot) - set.begin()];
+}
+
+template <Numeric T>
+void CheckpointedTape<T>::compute_segment(size_t segment, const State &state, Run &run) const
+{
+    const auto &code = compiled.instructions();
+    size_t begin = segment * segment_len;
+    size_t end = std::min(code.size(), begin + segment_len);
+    auto &val = run.local_val;
+    for (size_t i = begin; i < end; ++i)
+    {
+        const auto &ins = code[i];
+        if (ins.op == ExprType::Constant || ins.op == ExprType::Variable)
+            val[i - begin] = lookup(i, segment, state, val, run);
+        else if (is_binary(ins.op))
+            val[i - begin] = apply_binary(ins.op, lookup(ins.lhs, segment, state, val, run),
+                                          lookup(ins.rhs, segment, state, val, run));
+        else
+            val[i - begin] = apply_function(ins.op, lookup(ins.lhs, segment, state, val, run));
+    }
+    run.stats.executed += end - begin;
+}
+
+template <Numeric T>
+typename CheckpointedTape<T>::State CheckpointedTape<T>::advance(size_t from, size_t to, State state, Run &run) const
+{
+    for (size_t j = from; j < to; ++j)
+    {
+        compute_segment(j, state, run);
+        State next(live[j + 1].size());
+        for (size_t k = 0; k < next.size(); ++k)
+            next[k] = lookup(live[j + 1][k], j, state, run.local_val, run);
+        state = std::move(next);
+    }
+    return state;
+}
+
+template <Numeric T>
+void CheckpointedTape<T>::reverse_segment(size_t segment, const State &state, Run &run) const
+{
+    const auto &code = compiled.instructions();
+    size_t begin = segment * segment_len;
+    size_t end = std::min(code.size(), begin + segment_len);
+    compute_segment(segment, state, run);
+
+    auto &adj = run.local_adj;
+    std::fill(adj.begin(), adj.end(), T(0));
+    for (size_t i = begin; i < end; ++i)
+    {
+        auto it = run.pending.find(i);
+        if (it != run.pending.end())
+        {
+            adj[i - begin] = it->second;
+            run.pending.erase(it);
+        }
+    }
+
+    auto add = [&](int slot, T value)
+    {
+        if ((size_t)slot >= begin)
+            adj[slot - begin] = adj[slot - begin] + value;
+        else
+        {
+            auto &p = run.pending[slot];
+            p = p + value;
+        }
+    };
+
+    const auto &val = run.local_val;
+    for (size_t i = end; i-- > begin;)
+    {
+        const auto &ins = code[i];
+        T g = adj[i - begin];
+        if (ins.op == ExprType::Variable)
+        {
+            run.grad[ins.lhs] = g;
+            continue;
+        }
+        if (!compiled.is_active(i) || g == T(0))
+            continue;
+        bool binary = is_binary(ins.op);
+        T a = lookup(ins.lhs, segment, state, val, run);
+        T b = binary ? lookup(ins.rhs, segment, state, val, run) : T(0);
+        T pa, pb;
+        local_partials(ins.op, a, b, val[i - begin], binary && compiled.is_active(ins.rhs), pa, pb);
+        add(ins.lhs, g * pa);
+        if (binary)
+            add(ins.rhs, g * pb);
+    }
+    run.stats.peak_values = std::max(run.stats.peak_values, run.stored + 2 * segment_len + run.pending.size());
+}
+
+template <Numeric T>
+void CheckpointedTape<T>::reverse(size_t lo, size_t hi, const State &state, size_t s, size_t t, Run &run) const
+{
+    size_t l = hi - lo;
+    if (l == 1)
+    {
+        reverse_segment(lo, state, run);
+        return;
+    }
+    if (s == 0 || t == 0)
+    {
+        // Без свободных контрольных точек каждый отрезок пересчитывается от lo
+        for (size_t j = hi; j-- > lo;)
+            reverse_segment(j, advance(lo, j, state, run), run);
+        return;
+    }
+
+    size_t right = binomial_steps(s - 1, t);
+    size_t m = l > right ? l - right : 1;
+    m = std::min(m, l - 1);
+
+    State checkpoint = advance(lo, lo + m, state, run);
+    run.stored += checkpoint.size();
+    reverse(lo + m, hi, checkpoint, s - 1, t, run);
+    run.stored -= checkpoint.size();
+    checkpoint = State();
+    reverse(lo, lo + m, state, s, t - 1, run);
+}
+
+template <Numeric T>
+std::vector<T> CheckpointedTape<T>::gradient(const std::map<std::string, T> &bindings, CheckpointStats *stats) const
+{
+    std::vector<T> x = compiled.bind(bindings);
+    Run run{x};
+    run.local_val.resize(segment_len);
+    run.local_adj.resize(segment_len);
+    run.grad.assign(x.size(), T(0));
+    run.pending[compiled.outputs()[0]] = T(1);
+    run.stats.tape_size = compiled.size();
+    run.stats.segments = n_segments;
+    run.stats.checkpoints = n_checkpoints;
+
+    reverse(0, n_segments, State(), n_checkpoints, sweeps, run);
+
+    if (stats)
+        *stats = run.stats;
+    return run.grad;
+}
+
+#endif // Checkpoint_HPP
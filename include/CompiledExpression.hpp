@@ -0,0 +1,943 @@
+#ifndef CompiledExpression_HPP
+#define CompiledExpression_HPP
+
+#include "Expression.hpp"
+#include <algorithm>
+#include <cmath>
+#include <optional>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*==========*/
+/*Instruction*/
+/*==========*/
+
+// Ячейка ленты: результат op над ячейками lhs и rhs.
+// Для Constant lhs — индекс в constants, для Variable — индекс переменной.
+struct Instruction
+{
+    ExprType op;
+    int lhs;
+    int rhs;
+};
+
+/*
+=====================
+COMPILED EXPRESSION
+=====================
+*/
+
+// Дерево, развёрнутое в линейную ленту в порядке post-order.
+// Каждый узел (и каждая переменная) вычисляется ровно один раз,
+// поэтому на ленте работают и прямой, и обратный проходы.
+template <Numeric T = Real>
+class CompiledExpression
+{
+private:
+    std::vector<Instruction> code;
+    std::vector<T> constants;
+    std::vector<std::string> vars;
+    std::vector<int> var_slots;
+    std::vector<int> out_slots;
+    std::vector<char> active; // зависит ли ячейка хотя бы от одной переменной
+    std::vector<int> partner; // для sin/cos — ячейка cos/sin того же аргумента, иначе -1
+
+    void compile(const std::vector<const Node<T> *> &roots);
+    static std::optional<std::tuple<Real, Real, bool, bool>> constant_key(T value);
+    void partials(size_t i, const std::vector<T> &val, bool need_b, T &pa, T &pb) const;
+
+    void forward(const std::vector<T> &x, std::vector<T> &val) const;
+    void reverse(const std::vector<T> &val, const std::vector<T> &weights, std::vector<T> &adj) const;
+    void tangent_forward(const std::vector<T> &val, const std::vector<T> &v, std::vector<T> &dval) const;
+    void tangent_reverse(const std::vector<T> &val, const std::vector<T> &dval,
+                         const std::vector<T> &adj, std::vector<T> &dadj) const;
+
+public:
+    explicit CompiledExpression(const Expression<T> &expr);
+    // Система выражений на общей ленте; выход k — значение exprs[k]
+    explicit CompiledExpression(const std::vector<Expression<T>> &exprs);
+
+    // Переменные в лексикографическом порядке; в нём же градиент и столбцы гессиана
+    const std::vector<std::string> &variables() const { return vars; }
+    size_t size() const { return code.size(); }
+
+    const std::vector<Instruction> &instructions() const { return code; }
+    const std::vector<T> &constant_values() const { return constants; }
+    const std::vector<int> &outputs() const { return out_slots; }
+    const std::vector<int> &variable_slots() const { return var_slots; }
+    bool is_active(int slot) const { return active[slot]; }
+    int sincos_partner(int slot) const { return partner[slot]; }
+
+    std::vector<T> bind(const std::map<std::string, T> &bindings) const;
+
+    T eval(const std::map<std::string, T> &bindings) const;
+    T eval(const std::vector<T> &x) const;
+    std::vector<T> eval_all(const std::map<std::string, T> &bindings) const;
+
+    std::vector<T> gradient(const std::map<std::string, T> &bindings) const;
+
+    // J·v по всем выходам (прямой режим) и w^T·J по всем переменным (обратный режим)
+    std::vector<T> jvp(const std::map<std::string, T> &bindings, const std::vector<T> &v) const;
+    std::vector<T> vjp(const std::map<std::string, T> &bindings, const std::vector<T> &w) const;
+    // То же для нескольких направлений с одним общим прямым проходом
+    std::vector<std::vector<T>> jvps(const std::map<std::string, T> &bindings,
+                                     const std::vector<std::vector<T>> &directions) const;
+    std::vector<std::vector<T>> vjps(const std::map<std::string, T> &bindings,
+                                     const std::vector<std::vector<T>> &weights) const;
+
+    // Произведение гессиана на вектор v: forward-over-reverse, стоимость порядка одного градиента
+    std::vector<T> hvp(const std::map<std::string, T> &bindings, const std::vector<T> &v) const;
+    // Несколько направлений с общими прямым и обратным проходами
+    std::vector<std::vector<T>> hvps(const std::map<std::string, T> &bindings,
+                                     const std::vector<std::vector<T>> &directions) const;
+
+    std::vector<std::vector<T>> hessian(const std::map<std::string, T> &bindings) const;
+
+    // Коэффициенты Тейлора c_0..c_order по переменной var в точке bindings:
+    // f(var + t) = sum c_j t^j, производная порядка j равна j! * c_j. Работа O(order^2 * size())
+    std::vector<T> taylor(const std::map<std::string, T> &bindings, const std::string &var, int order) const;
+
+    // Лента для оставшихся переменных: привязанные заменяются числами, константные
+    // ячейки сворачиваются, ненужные выбрасываются. Константная часть считается один раз
+    CompiledExpression specialize(const std::map<std::string, T> &bindings) const;
+};
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+// sin и cos одного аргумента за один вызов (sincos из glibc), иначе двумя вызовами
+template <Numeric T>
+void sin_cos(T a, T &s, T &c)
+{
+#if defined(__GLIBC__)
+    if constexpr (std::is_same_v<T, long double>)
+        ::sincosl(a, &s, &c);
+    else if constexpr (std::is_same_v<T, double>)
+        ::sincos(a, &s, &c);
+    else
+#endif
+    {
+        s = std::sin(a);
+        c = std::cos(a);
+    }
+}
+
+// Локальные производные y = op(a, b) по a и b.
+// Для степени производная по показателю нужна только при need_b (иначе ln(a) не считаем)
+template <Numeric T>
+void local_partials(ExprType op, T a, T b, T y, bool need_b, T &pa, T &pb)
+{
+    pa = T(0);
+    pb = T(0);
+    switch (op)
+    {
+    case ExprType::Add:
+        pa = T(1);
+        pb = T(1);
+        return;
+    case ExprType::Subtract:
+        pa = T(1);
+        pb = T(-1);
+        return;
+    case ExprType::Multiply:
+        pa = b;
+        pb = a;
+        return;
+    case ExprType::Divide:
+        pa = T(1) / b;
+        pb = -y / b;
+        return;
+    case ExprType::Power:
+        if (!(b == T(0)))
+            pa = b * T(std::pow(a, b - T(1)));
+        if (need_b)
+            pb = y * apply_function(ExprType::Ln, a);
+        return;
+    case ExprType::Negate:
+        pa = T(-1);
+        return;
+    case ExprType::Sin:
+        pa = std::cos(a);
+        return;
+    case ExprType::Cos:
+        pa = -std::sin(a);
+        return;
+    case ExprType::Exp:
+        pa = y;
+        return;
+    case ExprType::Ln:
+        pa = T(1) / a;
+        return;
+    case ExprType::Sqrt:
+        pa = T(0.5) / y;
+        return;
+    default:
+        throw std::runtime_error("Doesn`t exist operation");
+    }
+}
+
+// Производные по направлению от local_partials: da, db, dy — касательные аргументов и результата
+template <Numeric T>
+void local_partials_tangent(ExprType op, T a, T b, T y, bool need_b, T da, T db, T dy, T &dpa, T &dpb)
+{
+    dpa = T(0);
+    dpb = T(0);
+    switch (op)
+    {
+    case ExprType::Add:
+    case ExprType::Subtract:
+    case ExprType::Negate:
+        return;
+    case ExprType::Multiply:
+        dpa = db;
+        dpb = da;
+        return;
+    case ExprType::Divide:
+        dpa = -db / (b * b);
+        dpb = (y * db / b - dy) / b;
+        return;
+    case ExprType::Power:
+    {
+        if (!(b == T(0)) && !(b == T(1)))
+            dpa = b * (b - T(1)) * T(std::pow(a, b - T(2))) * da;
+        if (need_b)
+        {
+            T ln_a = apply_function(ExprType::Ln, a);
+            dpa = dpa + T(std::pow(a, b - T(1))) * (T(1) + b * ln_a) * db;
+            dpb = dy * ln_a + y * da / a;
+        }
+        return;
+    }
+    case ExprType::Sin:
+    case ExprType::Cos:
+        dpa = -y * da; // (sin)'' = -sin, (cos)'' = -cos
+        return;
+    case ExprType::Exp:
+        dpa = y * da;
+        return;
+    case ExprType::Ln:
+        dpa = -da / (a * a);
+        return;
+    case ExprType::Sqrt:
+        dpa = -T(0.5) * dy / (y * y);
+        return;
+    default:
+        throw std::runtime_error("Doesn`t exist operation");
+    }
+}
+
+template <Numeric T>
+CompiledExpression<T>::CompiledExpression(const Expression<T> &expr)
+{
+    compile({expr.getRoot().get()});
+}
+
+template <Numeric T>
+CompiledExpression<T>::CompiledExpression(const std::vector<Expression<T>> &exprs)
+{
+    std::vector<const Node<T> *> roots;
+    for (const auto &expr : exprs)
+        roots.push_back(expr.getRoot().get());
+    compile(roots);
+}
+
+template <Numeric T>
+void CompiledExpression<T>::compile(const std::vector<const Node<T> *> &roots)
+{
+    std::unordered_map<const Node<T> *, int> slot;
+    std::map<std::string, int> var_index;
+    std::map<std::tuple<Real, Real, bool, bool>, int> const_slot;
+    std::map<std::tuple<int, int, int>, int> op_slot;
+    std::vector<std::pair<const Node<T> *, bool>> stack;
+
+    // Обход без рекурсии: сгенерированные выражения бывают очень глубокими
+    for (const Node<T> *root : roots)
+    {
+        stack.push_back({root, false});
+        while (!stack.empty())
+        {
+            auto [node, expanded] = stack.back();
+            stack.pop_back();
+            if (slot.count(node))
+                continue;
+
+            ExprType type = node->getType();
+            if (!expanded && is_binary(type))
+            {
+                auto bin = static_cast<const BinaryOpNode<T> *>(node);
+                stack.push_back({node, true});
+                stack.push_back({bin->getRight().get(), false});
+                stack.push_back({bin->getLeft().get(), false});
+                continue;
+            }
+            if (!expanded && is_function(type))
+            {
+                stack.push_back({node, true});
+                stack.push_back({static_cast<const FunctionNode<T> *>(node)->getArg().get(), false});
+                continue;
+            }
+
+            Instruction ins{type, -1, -1};
+            T value = T(0);
+            if (type == ExprType::Constant)
+                value = static_cast<const ConstNode<T> *>(node)->getVal();
+            else if (type == ExprType::Variable)
+            {
+                const std::string &name = static_cast<const VarNode<T> *>(node)->getName();
+                if (name == "i")
+                {
+                    ins.op = ExprType::Constant;
+                    value = imaginary_unit<T>();
+                }
+                else
+                {
+                    auto it = var_index.find(name);
+                    if (it != var_index.end())
+                    {
+                        slot[node] = var_slots[it->second];
+                        continue;
+                    }
+                    ins.lhs = var_index[name] = vars.size();
+                    vars.push_back(name);
+                    var_slots.push_back(code.size());
+                }
+            }
+            else if (is_binary(type))
+            {
+                auto bin = static_cast<const BinaryOpNode<T> *>(node);
+                ins.lhs = slot[bin->getLeft().get()];
+                ins.rhs = slot[bin->getRight().get()];
+            }
+            else
+                ins.lhs = slot[static_cast<const FunctionNode<T> *>(node)->getArg().get()];
+
+            // Нумерация значений: равные константы и одна операция над теми же ячейками
+            // получают одну ячейку, даже если в дереве это разные копии (diff копирует поддеревья)
+            if (ins.op == ExprType::Constant)
+            {
+                auto key = constant_key(value);
+                if (key)
+                {
+                    auto [it, inserted] = const_slot.emplace(*key, code.size());
+                    if (!inserted)
+                    {
+                        slot[node] = it->second;
+                        continue;
+                    }
+                }
+                ins.lhs = constants.size();
+                constants.push_back(value);
+            }
+            else if (ins.op != ExprType::Variable)
+            {
+                auto [it, inserted] = op_slot.emplace(std::tuple{(int)ins.op, ins.lhs, ins.rhs}, code.size());
+                if (!inserted)
+                {
+                    slot[node] = it->second;
+                    continue;
+                }
+            }
+
+            slot[node] = code.size();
+            code.push_back(ins);
+        }
+        out_slots.push_back(slot[root]);
+    }
+
+    // Переменные нумеруются в порядке появления, переводим в лексикографический
+    std::vector<int> remap(vars.size());
+    std::vector<int> old_slots = var_slots;
+    int k = 0;
+    for (auto &[name, idx] : var_index)
+    {
+        remap[idx] = k;
+        vars[k] = name;
+        var_slots[k] = old_slots[idx];
+        ++k;
+    }
+    for (auto &ins : code)
+        if (ins.op == ExprType::Variable)
+            ins.lhs = remap[ins.lhs];
+
+    active.assign(code.size(), 0);
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        const auto &ins = code[i];
+        if (ins.op == ExprType::Variable)
+            active[i] = 1;
+        else if (is_binary(ins.op))
+            active[i] = active[ins.lhs] || active[ins.rhs];
+        else if (is_function(ins.op))
+            active[i] = active[ins.lhs];
+    }
+
+    // sin и cos одной ячейки считаются вместе
+    partner.assign(code.size(), -1);
+    std::unordered_map<int, int> sin_of, cos_of;
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        if (code[i].op == ExprType::Sin)
+            sin_of.emplace(code[i].lhs, i);
+        else if (code[i].op == ExprType::Cos)
+            cos_of.emplace(code[i].lhs, i);
+    }
+    for (auto [arg, s] : sin_of)
+    {
+        auto it = cos_of.find(arg);
+        if (it == cos_of.end())
+            continue;
+        partner[s] = it->second;
+        partner[it->second] = s;
+    }
+}
+
+template <Numeric T>
+std::optional<std::tuple<Real, Real, bool, bool>> CompiledExpression<T>::constant_key(T value)
+{
+    // -0 и 0 различаются, NaN не объединяется
+    Real re, im = 0;
+    if constexpr (std::is_same_v<T, Complex>)
+    {
+        re = value.real();
+        im = value.imag();
+    }
+    else
+        re = value;
+    if (std::isnan(re) || std::isnan(im))
+        return std::nullopt;
+    return std::tuple{re, im, std::signbit(re), std::signbit(im)};
+}
+
+template <Numeric T>
+void CompiledExpression<T>::partials(size_t i, const std::vector<T> &val, bool need_b, T &pa, T &pb) const
+{
+    const auto &ins = code[i];
+    if (partner[i] >= 0)
+    {
+        // Производная sin — это уже посчитанный cos той же ячейки, и наоборот
+        pa = ins.op == ExprType::Sin ? val[partner[i]] : -val[partner[i]];
+        pb = T(0);
+        return;
+    }
+    T b = is_binary(ins.op) ? val[ins.rhs] : T(0);
+    local_partials(ins.op, val[ins.lhs], b, val[i], need_b, pa, pb);
+}
+
+template <Numeric T>
+std::vector<T> CompiledExpression<T>::bind(const std::map<std::string, T> &bindings) const
+{
+    std::vector<T> x(vars.size());
+    for (size_t k = 0; k < vars.size(); ++k)
+    {
+        auto it = bindings.find(vars[k]);
+        if (it == bindings.end())
+            throw std::runtime_error("Variable '" + vars[k] + "' is not provided");
+        x[k] = it->second;
+    }
+    return x;
+}
+
+template <Numeric T>
+void CompiledExpression<T>::forward(const std::vector<T> &x, std::vector<T> &val) const
+{
+    val.resize(code.size());
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        const auto &ins = code[i];
+        if (ins.op == ExprType::Constant)
+            val[i] = constants[ins.lhs];
+        else if (ins.op == ExprType::Variable)
+            val[i] = x[ins.lhs];
+        else if (is_binary(ins.op))
+            val[i] = apply_binary(ins.op, val[ins.lhs], val[ins.rhs]);
+        else if (partner[i] < 0)
+            val[i] = apply_function(ins.op, val[ins.lhs]);
+        else if ((size_t)partner[i] > i)
+        {
+            // Пара заполняется при первой из двух ячеек
+            T &s = val[ins.op == ExprType::Sin ? i : partner[i]];
+            T &c = val[ins.op == ExprType::Sin ? partner[i] : i];
+            sin_cos(val[ins.lhs], s, c);
+        }
+    }
+}
+
+template <Numeric T>
+void CompiledExpression<T>::reverse(const std::vector<T> &val, const std::vector<T> &weights,
+                                    std::vector<T> &adj) const
+{
+    adj.assign(code.size(), T(0));
+    for (size_t k = 0; k < out_slots.size(); ++k)
+        adj[out_slots[k]] = adj[out_slots[k]] + weights[k];
+    for (size_t i = code.size(); i-- > 0;)
+    {
+        const auto &ins = code[i];
+        if (!active[i] || adj[i] == T(0) || ins.op == ExprType::Variable)
+            continue;
+        T pa, pb;
+        partials(i, val, is_binary(ins.op) && active[ins.rhs], pa, pb);
+        adj[ins.lhs] = adj[ins.lhs] + adj[i] * pa;
+        if (is_binary(ins.op))
+            adj[ins.rhs] = adj[ins.rhs] + adj[i] * pb;
+    }
+}
+
+template <Numeric T>
+void CompiledExpression<T>::tangent_forward(const std::vector<T> &val, const std::vector<T> &v,
+                                            std::vector<T> &dval) const
+{
+    dval.assign(code.size(), T(0));
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        const auto &ins = code[i];
+        if (ins.op == ExprType::Variable)
+        {
+            dval[i] = v[ins.lhs];
+            continue;
+        }
+        if (!active[i])
+            continue;
+        T da = dval[ins.lhs];
+        T db = is_binary(ins.op) ? dval[ins.rhs] : T(0);
+        if (da == T(0) && db == T(0))
+            continue;
+        T pa, pb;
+        partials(i, val, is_binary(ins.op) && active[ins.rhs], pa, pb);
+        dval[i] = pa * da + pb * db;
+    }
+}
+
+template <Numeric T>
+void CompiledExpression<T>::tangent_reverse(const std::vector<T> &val, const std::vector<T> &dval,
+                                            const std::vector<T> &adj, std::vector<T> &dadj) const
+{
+    dadj.assign(code.size(), T(0));
+    for (size_t i = code.size(); i-- > 0;)
+    {
+        const auto &ins = code[i];
+        if (!active[i] || ins.op == ExprType::Variable)
+            continue;
+        bool binary = is_binary(ins.op);
+        T da = dval[ins.lhs];
+        T db = binary ? dval[ins.rhs] : T(0);
+        bool zero_tangent = da == T(0) && db == T(0);
+        if (dadj[i] == T(0) && (zero_tangent || adj[i] == T(0)))
+            continue;
+
+        T b = binary ? val[ins.rhs] : T(0);
+        bool need_b = binary && active[ins.rhs];
+        T pa, pb, dpa = T(0), dpb = T(0);
+        partials(i, val, need_b, pa, pb);
+        if (!zero_tangent)
+            local_partials_tangent(ins.op, val[ins.lhs], b, val[i], need_b, da, db, dval[i], dpa, dpb);
+
+        dadj[ins.lhs] = dadj[ins.lhs] + dadj[i] * pa + adj[i] * dpa;
+        if (binary)
+            dadj[ins.rhs] = dadj[ins.rhs] + dadj[i] * pb + adj[i] * dpb;
+    }
+}
+
+template <Numeric T>
+T CompiledExpression<T>::eval(const std::vector<T> &x) const
+{
+    std::vector<T> val;
+    forward(x, val);
+    return val[out_slots[0]];
+}
+
+template <Numeric T>
+T CompiledExpression<T>::eval(const std::map<std::string, T> &bindings) const
+{
+    return eval(bind(bindings));
+}
+
+template <Numeric T>
+std::vector<T> CompiledExpression<T>::eval_all(const std::map<std::string, T> &bindings) const
+{
+    std::vector<T> val;
+    forward(bind(bindings), val);
+
+    std::vector<T> result(out_slots.size());
+    for (size_t k = 0; k < out_slots.size(); ++k)
+        result[k] = val[out_slots[k]];
+    return result;
+}
+
+template <Numeric T>
+std::vector<T> CompiledExpression<T>::gradient(const std::map<std::string, T> &bindings) const
+{
+    std::vector<T> w(out_slots.size(), T(0));
+    w[0] = T(1);
+    return vjp(bindings, w);
+}
+
+template <Numeric T>
+std::vector<T> CompiledExpression<T>::jvp(const std::map<std::string, T> &bindings, const std::vector<T> &v) const
+{
+    return jvps(bindings, {v})[0];
+}
+
+template <Numeric T>
+std::vector<T> CompiledExpression<T>::vjp(const std::map<std::string, T> &bindings, const std::vector<T> &w) const
+{
+    return vjps(bindings, {w})[0];
+}
+
+template <Numeric T>
+std::vector<std::vector<T>> CompiledExpression<T>::jvps(const std::map<std::string, T> &bindings,
+                                                        const std::vector<std::vector<T>> &directions) const
+{
+    std::vector<T> val, dval;
+    forward(bind(bindings), val);
+
+    std::vector<std::vector<T>> result;
+    for (const auto &v : directions)
+    {
+        if (v.size() != vars.size())
+            throw std::runtime_error("Direction size doesn`t match number of variables");
+        tangent_forward(val, v, dval);
+
+        std::vector<T> column(out_slots.size());
+        for (size_t k = 0; k < out_slots.size(); ++k)
+            column[k] = dval[out_slots[k]];
+        result.push_back(std::move(column));
+    }
+    return result;
+}
+
+template <Numeric T>
+std::vector<std::vector<T>> CompiledExpression<T>::vjps(const std::map<std::string, T> &bindings,
+                                                        const std::vector<std::vector<T>> &weights) const
+{
+    std::vector<T> val, adj;
+    forward(bind(bindings), val);
+
+    std::vector<std::vector<T>> result;
+    for (const auto &w : weights)
+    {
+        if (w.size() != out_slots.size())
+            throw std::runtime_error("Weights size doesn`t match number of outputs");
+        reverse(val, w, adj);
+
+        std::vector<T> grad(vars.size());
+        for (size_t k = 0; k < vars.size(); ++k)
+            grad[k] = adj[var_slots[k]];
+        result.push_back(std::move(grad));
+    }
+    return result;
+}
+
+template <Numeric T>
+std::vector<T> CompiledExpression<T>::hvp(const std::map<std::string, T> &bindings, const std::vector<T> &v) const
+{
+    return hvps(bindings, {v})[0];
+}
+
+template <Numeric T>
+std::vector<std::vector<T>> CompiledExpression<T>::hvps(const std::map<std::string, T> &bindings,
+                                                        const std::vector<std::vector<T>> &directions) const
+{
+    std::vector<T> val, adj, dval, dadj;
+    std::vector<T> w(out_slots.size(), T(0));
+    w[0] = T(1);
+    forward(bind(bindings), val);
+    reverse(val, w, adj);
+
+    std::vector<std::vector<T>> result;
+    for (const auto &v : directions)
+    {
+        if (v.size() != vars.size())
+            throw std::runtime_error("Direction size doesn`t match number of variables");
+        tangent_forward(val, v, dval);
+        tangent_reverse(val, dval, adj, dadj);
+
+        std::vector<T> column(vars.size());
+        for (size_t k = 0; k < vars.size(); ++k)
+            column[k] = dadj[var_slots[k]];
+        result.push_back(std::move(column));
+    }
+    return result;
+}
+
+template <Numeric T>
+std::vector<std::vector<T>> CompiledExpression<T>::hessian(const std::map<std::string, T> &bindings) const
+{
+    size_t n = vars.size();
+    std::vector<std::vector<T>> H(n, std::vector<T>(n, T(0)));
+    std::vector<T> val, adj, dval, dadj;
+
+    // Значения и сопряжённые не зависят от направления — считаем один раз на все столбцы
+    std::vector<T> w(out_slots.size(), T(0));
+    w[0] = T(1);
+    forward(bind(bindings), val);
+    reverse(val, w, adj);
+
+    std::vector<T> e(n, T(0));
+    for (size_t j = 0; j < n; ++j)
+    {
+        e[j] = T(1);
+        tangent_forward(val, e, dval);
+        tangent_reverse(val, dval, adj, dadj);
+        e[j] = T(0);
+
+        // Берём нижний треугольник и отражаем его, так что H симметрична точно
+        for (size_t i = j; i < n; ++i)
+            H[i][j] = H[j][i] = dadj[var_slots[i]];
+    }
+    return H;
+}
+
+/*==========*/
+/*Taylor*/
+/*==========*/
+
+// Усечённые ряды длины m = order + 1, рекуррентные формулы для каждой операции
+template <Numeric T>
+void taylor_mul(const T *a, const T *b, T *y, int m)
+{
+    for (int k = 0; k < m; ++k)
+    {
+        T sum = T(0);
+        for (int j = 0; j <= k; ++j)
+            sum = sum + a[j] * b[k - j];
+        y[k] = sum;
+    }
+}
+
+template <Numeric T>
+void taylor_div(const T *a, const T *b, T *y, int m)
+{
+    if (b[0] == T(0))
+        throw std::runtime_error("division by 0");
+    for (int k = 0; k < m; ++k)
+    {
+        T sum = a[k];
+        for (int j = 0; j < k; ++j)
+            sum = sum - y[j] * b[k - j];
+        y[k] = sum / b[0];
+    }
+}
+
+template <Numeric T>
+void taylor_exp(const T *a, T *y, int m)
+{
+    y[0] = std::exp(a[0]);
+    for (int k = 1; k < m; ++k)
+    {
+        T sum = T(0);
+        for (int j = 1; j <= k; ++j)
+            sum = sum + T(j) * a[j] * y[k - j];
+        y[k] = sum / T(k);
+    }
+}
+
+template <Numeric T>
+void taylor_ln(const T *a, T *y, int m)
+{
+    y[0] = apply_function(ExprType::Ln, a[0]);
+    for (int k = 1; k < m; ++k)
+    {
+        T sum = T(0);
+        for (int j = 1; j < k; ++j)
+            sum = sum + T(j) * y[j] * a[k - j];
+        y[k] = (a[k] - sum / T(k)) / a[0];
+    }
+}
+
+// y^2 = a: 2 y0 y_k = a_k - sum_{j=1}^{k-1} y_j y_{k-j}
+template <Numeric T>
+void taylor_sqrt(const T *a, T *y, int m)
+{
+    y[0] = std::sqrt(a[0]);
+    for (int k = 1; k < m; ++k)
+    {
+        T sum = T(0);
+        for (int j = 1; j < k; ++j)
+            sum = sum + y[j] * y[k - j];
+        y[k] = (a[k] - sum) / (T(2) * y[0]);
+    }
+}
+
+// sin и cos считаются только парой
+template <Numeric T>
+void taylor_sin_cos(const T *a, T *s, T *c, int m)
+{
+    s[0] = std::sin(a[0]);
+    c[0] = std::cos(a[0]);
+    for (int k = 1; k < m; ++k)
+    {
+        T ss = T(0), cc = T(0);
+        for (int j = 1; j <= k; ++j)
+        {
+            ss = ss + T(j) * a[j] * c[k - j];
+            cc = cc + T(j) * a[j] * s[k - j];
+        }
+        s[k] = ss / T(k);
+        c[k] = -cc / T(k);
+    }
+}
+
+template <Numeric T>
+void taylor_pow(const T *a, const T *b, T *y, int m)
+{
+    bool const_exponent = true;
+    for (int k = 1; k < m; ++k)
+        const_exponent = const_exponent && b[k] == T(0);
+
+    if (!const_exponent)
+    {
+        // a^b = exp(b * ln a)
+        std::vector<T> ln_a(m), prod(m);
+        taylor_ln(a, ln_a.data(), m);
+        taylor_mul(b, ln_a.data(), prod.data(), m);
+        taylor_exp(prod.data(), y, m);
+        return;
+    }
+
+    T p = b[0];
+    Real int_part = 0;
+    if constexpr (std::is_same_v<T, Complex>)
+        int_part = p.imag() == 0 ? p.real() : -1;
+    else
+        int_part = p;
+    if (int_part >= 0 && int_part <= 64 && std::floor(int_part) == int_part)
+    {
+        // Целая степень: возведение ряда в квадрат и умножение, основание может быть нулевым
+        std::vector<T> base(a, a + m), tmp(m);
+        std::fill(y, y + m, T(0));
+        y[0] = T(1);
+        for (long long e = (long long)int_part; e > 0; e >>= 1)
+        {
+            if (e & 1)
+            {
+                taylor_mul(y, base.data(), tmp.data(), m);
+                std::copy(tmp.begin(), tmp.end(), y);
+            }
+            if (e > 1)
+            {
+                taylor_mul(base.data(), base.data(), tmp.data(), m);
+                base = tmp;
+            }
+        }
+        return;
+    }
+
+    if (a[0] == T(0))
+        throw std::runtime_error("Taylor expansion of power at zero base");
+    y[0] = std::pow(a[0], p);
+    for (int k = 1; k < m; ++k)
+    {
+        T sum = T(0);
+        for (int j = 0; j < k; ++j)
+            sum = sum + (T(k - j) * p - T(j)) * a[k - j] * y[j];
+        y[k] = sum / (T(k) * a[0]);
+    }
+}
+
+template <Numeric T>
+std::vector<T> CompiledExpression<T>::taylor(const std::map<std::string, T> &bindings, const std::string &var,
+                                             int order) const
+{
+    if (order < 0)
+        throw std::runtime_error("Taylor order must be non-negative");
+    int m = order + 1;
+    std::vector<T> x = bind(bindings);
+    auto it = std::find(vars.begin(), vars.end(), var);
+    int dvar = it == vars.end() ? -1 : it - vars.begin();
+
+    std::vector<T> series(code.size() * m, T(0));
+    std::vector<T> companion(m);
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        const auto &ins = code[i];
+        T *y = &series[i * m];
+        bool leaf = ins.op == ExprType::Constant || ins.op == ExprType::Variable;
+        const T *a = leaf ? nullptr : &series[ins.lhs * m];
+        const T *b = is_binary(ins.op) ? &series[ins.rhs * m] : nullptr;
+        switch (ins.op)
+        {
+        case ExprType::Constant:
+            y[0] = constants[ins.lhs];
+            break;
+        case ExprType::Variable:
+            y[0] = x[ins.lhs];
+            if (ins.lhs == dvar && m > 1)
+                y[1] = T(1);
+            break;
+        case ExprType::Add:
+            for (int k = 0; k < m; ++k)
+                y[k] = a[k] + b[k];
+            break;
+        case ExprType::Subtract:
+            for (int k = 0; k < m; ++k)
+                y[k] = a[k] - b[k];
+            break;
+        case ExprType::Negate:
+            for (int k = 0; k < m; ++k)
+                y[k] = -a[k];
+            break;
+        case ExprType::Multiply:
+            taylor_mul(a, b, y, m);
+            break;
+        case ExprType::Divide:
+            taylor_div(a, b, y, m);
+            break;
+        case ExprType::Power:
+            taylor_pow(a, b, y, m);
+            break;
+        case ExprType::Sin:
+            taylor_sin_cos(a, y, companion.data(), m);
+            break;
+        case ExprType::Cos:
+            taylor_sin_cos(a, companion.data(), y, m);
+            break;
+        case ExprType::Exp:
+            taylor_exp(a, y, m);
+            break;
+        case ExprType::Ln:
+            taylor_ln(a, y, m);
+            break;
+        case ExprType::Sqrt:
+            taylor_sqrt(a, y, m);
+            break;
+        default:
+            throw std::runtime_error("Doesn`t exist operation");
+        }
+    }
+
+    int out = out_slots[0];
+    return std::vector<T>(series.begin() + out * m, series.begin() + (out + 1) * m);
+}
+
+template <Numeric T>
+CompiledExpression<T> CompiledExpression<T>::specialize(const std::map<std::string, T> &bindings) const
+{
+    // Лента разворачивается обратно в DAG (ячейка -> узел) со свёрткой по ходу
+    std::vector<std::shared_ptr<Node<T>>> nodes(code.size());
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        const auto &ins = code[i];
+        if (ins.op == ExprType::Constant)
+            nodes[i] = make_const<T>(constants[ins.lhs]);
+        else if (ins.op == ExprType::Variable)
+        {
+            auto found = bindings.find(vars[ins.lhs]);
+            nodes[i] = found != bindings.end() ? make_const<T>(found->second)
+                                               : std::make_shared<VarNode<T>>(vars[ins.lhs]);
+        }
+        else if (is_binary(ins.op))
+            nodes[i] = fold_binary(ins.op, nodes[ins.lhs], nodes[ins.rhs]);
+        else
+            nodes[i] = fold_function(ins.op, nodes[ins.lhs]);
+    }
+
+    std::vector<Expression<T>> roots;
+    for (int slot : out_slots)
+        roots.emplace_back(nodes[slot]);
+    return CompiledExpression<T>(roots);
+}
+
+#endif // CompiledExpression_HPP
@@ -0,0 +1,629 @@
+#ifndef EGraph_HPP
+#define EGraph_HPP
+
+#include "HashCons.hpp"
+#include <optional>
+
+/*
+=====================
+E-GRAPH
+=====================
+*/
+
+// Стоимость вычисления одного узла каждого типа
+struct CostModel
+{
+    std::map<ExprType, double> cost = {
+        {ExprType::Constant, 1}, {ExprType::Variable, 1}, {ExprType::Add, 1},  {ExprType::Subtract, 1},
+        {ExprType::Multiply, 2}, {ExprType::Divide, 8},   {ExprType::Power, 40}, {ExprType::Negate, 1},
+        {ExprType::Sin, 20},     {ExprType::Cos, 20},     {ExprType::Ln, 30},  {ExprType::Exp, 20},
+        {ExprType::Sqrt, 10}};
+
+    double operator()(ExprType type) const
+    {
+        auto it = cost.find(type);
+        return it == cost.end() ? 1 : it->second;
+    }
+};
+
+struct EGraphOptions
+{
+    size_t node_limit = 10000; // предел числа e-узлов
+    size_t iter_limit = 8;     // предел числа итераций насыщения
+    CostModel cost;
+    // Exact — только правила, верные везде, где определено исходное выражение;
+    // Fast — ещё exp(ln x) = x, ln x + ln y = ln(xy), x/x = 1, 0*x = 0 и подобные
+    MathPolicy policy = MathPolicy::Exact;
+};
+
+struct EGraphStats
+{
+    size_t iterations = 0;
+    size_t nodes = 0;
+    size_t classes = 0;
+    bool saturated = false; // правила перестали что-либо добавлять
+    double cost_before = 0;
+    double cost_after = 0;
+};
+
+// E-узел: операция над классами эквивалентности
+template <Numeric T>
+struct ENode
+{
+    ExprType op;
+    int a = -1, b = -1;
+    T value = T(0);
+    std::string name;
+
+    bool operator==(const ENode &other) const
+    {
+        return op == other.op && a == other.a && b == other.b && value == other.value && name == other.name;
+    }
+};
+
+// Граф классов эквивалентных выражений. Правила только добавляют равенства,
+// затем из каждого класса извлекается самый дешёвый по CostModel представитель
+template <Numeric T = Real>
+class EGraph
+{
+public:
+    using Ptr = std::shared_ptr<Node<T>>;
+
+    int add(const Ptr &node);
+    int add(ENode<T> node);
+    int merge(int x, int y);
+    int find(int x);
+    void rebuild();
+
+    // Одна итерация всех правил; false, если граф не изменился
+    bool apply_rules(size_t node_limit, MathPolicy policy = MathPolicy::Exact);
+
+    Ptr extract(int root, const CostModel &cost);
+
+    size_t node_count() const { return memo.size(); }
+    size_t class_count() const;
+
+private:
+    struct Hash
+    {
+        size_t operator()(const ENode<T> &node) const;
+    };
+
+    struct EClass
+    {
+        std::vector<ENode<T>> nodes;
+        std::optional<T> constant;
+    };
+
+    std::vector<int> parent;
+    std::vector<EClass> classes;
+    std::unordered_map<ENode<T>, int, Hash> memo;
+    size_t unions = 0;
+
+    ENode<T> canonical(ENode<T> node);
+    std::optional<T> fold(const ENode<T> &node);
+    void set_constant(int id, T value);
+    std::vector<ENode<T>> nodes_of(int id, ExprType op);
+    void apply(int id, const ENode<T> &node, size_t node_limit, MathPolicy policy);
+};
+
+// Насыщение правилами в пределах бюджета и извлечение самого дешёвого эквивалента
+template <Numeric T>
+Expression<T> egraph_optimize(const Expression<T> &expr, const EGraphOptions &options = {},
+                              EGraphStats *stats = nullptr);
+
+// Стоимость дерева по модели (общие узлы считаются при каждом использовании)
+template <Numeric T>
+double tree_cost(const std::shared_ptr<Node<T>> &node, const CostModel &cost);
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+template <Numeric T>
+size_t EGraph<T>::Hash::operator()(const ENode<T> &node) const
+{
+    size_t h = hash_combine(std::hash<int>()((int)node.op), std::hash<int>()(node.a));
+    h = hash_combine(h, std::hash<int>()(node.b));
+    if constexpr (std::is_same_v<T, Complex>)
+        h = hash_combine(h, std::hash<Real>()(node.value.real()) ^ std::hash<Real>()(node.value.imag()));
+    else
+        h = hash_combine(h, std::hash<T>()(node.value));
+    return hash_combine(h, std::hash<std::string>()(node.name));
+}
+
+template <Numeric T>
+int EGraph<T>::find(int x)
+{
+    while (parent[x] != x)
+    {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
+
+template <Numeric T>
+ENode<T> EGraph<T>::canonical(ENode<T> node)
+{
+    if (node.a >= 0)
+        node.a = find(node.a);
+    if (node.b >= 0)
+        node.b = find(node.b);
+    return node;
+}
+
+template <Numeric T>
+size_t EGraph<T>::class_count() const
+{
+    size_t count = 0;
+    for (size_t i = 0; i < parent.size(); ++i)
+        count += parent[i] == (int)i;
+    return count;
+}
+
+// Значение узла, если все его аргументы — известные константы
+template <Numeric T>
+std::optional<T> EGraph<T>::fold(const ENode<T> &node)
+{
+    if (node.op == ExprType::Constant)
+        return node.value;
+    if (node.op == ExprType::Variable)
+        return std::nullopt;
+    auto a = classes[find(node.a)].constant;
+    if (!a)
+        return std::nullopt;
+    try
+    {
+        T value;
+        if (is_binary(node.op))
+        {
+            auto b = classes[find(node.b)].constant;
+            if (!b)
+                return std::nullopt;
+            value = apply_binary(node.op, *a, *b);
+        }
+        else
+            value = apply_function(node.op, *a);
+        if (!(value == value))
+            return std::nullopt;
+        return value;
+    }
+    catch (const std::runtime_error &)
+    {
+        return std::nullopt;
+    }
+}
+
+template <Numeric T>
+void EGraph<T>::set_constant(int id, T value)
+{
+    id = find(id);
+    if (classes[id].constant)
+        return;
+    classes[id].constant = value;
+    merge(id, add(ENode<T>{ExprType::Constant, -1, -1, value, ""}));
+}
+
+template <Numeric T>
+int EGraph<T>::add(ENode<T> node)
+{
+    node = canonical(node);
+    auto it = memo.find(node);
+    if (it != memo.end())
+        return find(it->second);
+
+    int id = parent.size();
+    parent.push_back(id);
+    classes.push_back({{node}, std::nullopt});
+    memo[node] = id;
+    if (auto value = fold(node))
+    {
+        if (node.op == ExprType::Constant)
+            classes[id].constant = value;
+        else
+            set_constant(id, *value);
+    }
+    return find(id);
+}
+
+template <Numeric T>
+int EGraph<T>::add(const Ptr &node)
+{
+    ExprType type = node->getType();
+    if (type == ExprType::Constant)
+        return add(ENode<T>{type, -1, -1, static_cast<const ConstNode<T> *>(node.get())->getVal(), ""});
+    if (type == ExprType::Variable)
+        return add(ENode<T>{type, -1, -1, T(0), static_cast<const VarNode<T> *>(node.get())->getName()});
+    if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        int a = add(bin->getLeft());
+        int b = add(bin->getRight());
+        return add(ENode<T>{type, a, b, T(0), ""});
+    }
+    int a = add(static_cast<const FunctionNode<T> *>(node.get())->getArg());
+    return add(ENode<T>{type, a, -1, T(0), ""});
+}
+
+template <Numeric T>
+int EGraph<T>::merge(int x, int y)
+{
+    x = find(x);
+    y = find(y);
+    if (x == y)
+        return x;
+    if (classes[x].nodes.size() < classes[y].nodes.size())
+        std::swap(x, y);
+    parent[y] = x;
+    ++unions;
+    auto &into = classes[x];
+    auto &from = classes[y];
+    into.nodes.insert(into.nodes.end(), from.nodes.begin(), from.nodes.end());
+    from.nodes.clear();
+    std::optional<T> constant = from.constant;
+    from.constant.reset();
+    if (constant && !into.constant)
+        set_constant(x, *constant);
+    return find(x);
+}
+
+// Восстановление конгруэнтности: узлы с одинаковыми каноническими детьми сливаются
+template <Numeric T>
+void EGraph<T>::rebuild()
+{
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        memo.clear();
+        for (size_t id = 0; id < classes.size(); ++id)
+        {
+            if (find(id) != (int)id)
+                continue;
+            auto &nodes = classes[id].nodes;
+            for (auto &node : nodes)
+                node = canonical(node);
+            std::vector<ENode<T>> unique;
+            for (const auto &node : nodes)
+                if (std::find(unique.begin(), unique.end(), node) == unique.end())
+                    unique.push_back(node);
+            nodes = unique;
+        }
+        for (size_t id = 0; id < classes.size(); ++id)
+        {
+            if (find(id) != (int)id)
+                continue;
+            std::vector<ENode<T>> nodes = classes[id].nodes;
+            for (const auto &node : nodes)
+            {
+                auto it = memo.find(node);
+                if (it != memo.end() && find(it->second) != find(id))
+                {
+                    merge(it->second, id);
+                    changed = true;
+                }
+                else
+                    memo[node] = find(id);
+                if (!classes[find(id)].constant)
+                    if (auto value = fold(node))
+                        set_constant(id, *value);
+            }
+        }
+    }
+}
+
+template <Numeric T>
+std::vector<ENode<T>> EGraph<T>::nodes_of(int id, ExprType op)
+{
+    std::vector<ENode<T>> result;
+    for (const auto &node : classes[find(id)].nodes)
+        if (node.op == op)
+            result.push_back(canonical(node));
+    return result;
+}
+
+template <Numeric T>
+void EGraph<T>::apply(int id, const ENode<T> &n, size_t node_limit, MathPolicy policy)
+{
+    const bool fast = policy == MathPolicy::Fast;
+    auto C = [&](T v) { return add(ENode<T>{ExprType::Constant, -1, -1, v, ""}); };
+    auto B = [&](ExprType op, int x, int y) { return add(ENode<T>{op, x, y, T(0), ""}); };
+    auto F = [&](ExprType op, int x) { return add(ENode<T>{op, x, -1, T(0), ""}); };
+    auto constant = [&](int c) { return classes[find(c)].constant; };
+    auto is_const = [&](int c, T v)
+    {
+        auto k = constant(c);
+        return k && *k == v;
+    };
+    auto same = [&](int x, int y) { return find(x) == find(y); };
+    auto is_integer = [&](int c)
+    {
+        auto k = constant(c);
+        if (!k)
+            return false;
+        if constexpr (std::is_same_v<T, Complex>)
+            return k->imag() == 0 && std::floor(k->real()) == k->real();
+        else
+            return std::floor(*k) == *k;
+    };
+    // Целая константа >= 0: x^m * x^n = x^(m+n) без 0 * inf в нуле
+    auto is_natural = [&](int c)
+    {
+        if (!is_integer(c))
+            return false;
+        if constexpr (std::is_same_v<T, Complex>)
+            return constant(c)->real() >= 0;
+        else
+            return *constant(c) >= 0;
+    };
+    auto is_odd_natural = [&](int c)
+    {
+        if (!is_natural(c))
+            return false;
+        Real v;
+        if constexpr (std::is_same_v<T, Complex>)
+            v = constant(c)->real();
+        else
+            v = *constant(c);
+        return std::fmod(v, 2) == 1;
+    };
+    // Каждое переписывание добавляет не больше нескольких узлов, так что бюджет превышается ненамного
+    auto rewrite = [&](auto build)
+    {
+        if (memo.size() < node_limit)
+            merge(id, build());
+    };
+    int a = n.a, b = n.b;
+
+    switch (n.op)
+    {
+    case ExprType::Add:
+    {
+        rewrite([&] { return B(ExprType::Add, b, a); });
+        if (is_const(a, T(0)))
+            rewrite([&] { return b; });
+        if (is_const(b, T(0)))
+            rewrite([&] { return a; });
+        if (same(a, b))
+            rewrite([&] { return B(ExprType::Multiply, C(T(2)), a); });
+        // (x + y) + b = x + (y + b)
+        for (const auto &x : nodes_of(a, ExprType::Add))
+            rewrite([&] { return B(ExprType::Add, x.a, B(ExprType::Add, x.b, b)); });
+        // c*x + c*y = c*(x + y)
+        for (const auto &x : nodes_of(a, ExprType::Multiply))
+            for (const auto &y : nodes_of(b, ExprType::Multiply))
+                if (same(x.a, y.a))
+                    rewrite([&] { return B(ExprType::Multiply, x.a, B(ExprType::Add, x.b, y.b)); });
+        // ln x + ln y = ln(x * y) — при x, y < 0 правая часть определена, левая нет
+        if (fast)
+            for (const auto &x : nodes_of(a, ExprType::Ln))
+                for (const auto &y : nodes_of(b, ExprType::Ln))
+                    rewrite([&] { return F(ExprType::Ln, B(ExprType::Multiply, x.a, y.a)); });
+        // a + (-1)*y = a - y
+        for (const auto &x : nodes_of(b, ExprType::Multiply))
+            if (is_const(x.a, T(-1)))
+                rewrite([&] { return B(ExprType::Subtract, a, x.b); });
+        // sin(x)^2 + cos(x)^2 = 1
+        for (const auto &x : nodes_of(a, ExprType::Power))
+            if (is_const(x.b, T(2)))
+                for (const auto &s : nodes_of(x.a, ExprType::Sin))
+                    for (const auto &y : nodes_of(b, ExprType::Power))
+                        if (is_const(y.b, T(2)))
+                            for (const auto &c : nodes_of(y.a, ExprType::Cos))
+                                if (same(s.a, c.a))
+                                    rewrite([&] { return C(T(1)); });
+        break;
+    }
+    case ExprType::Subtract:
+        // x - x = 0 неверно для inf и там, где x не определено
+        if (fast && same(a, b))
+            rewrite([&] { return C(T(0)); });
+        if (is_const(b, T(0)))
+            rewrite([&] { return a; });
+        rewrite([&] { return B(ExprType::Add, a, B(ExprType::Multiply, C(T(-1)), b)); });
+        break;
+    case ExprType::Multiply:
+    {
+        rewrite([&] { return B(ExprType::Multiply, b, a); });
+        if (is_const(a, T(1)))
+            rewrite([&] { return b; });
+        if (is_const(b, T(1)))
+            rewrite([&] { return a; });
+        if (fast && (is_const(a, T(0)) || is_const(b, T(0))))
+            rewrite([&] { return C(T(0)); });
+        if (same(a, b))
+            rewrite([&] { return B(ExprType::Power, a, C(T(2))); });
+        // (x * y) * b = x * (y * b)
+        for (const auto &x : nodes_of(a, ExprType::Multiply))
+            rewrite([&] { return B(ExprType::Multiply, x.a, B(ExprType::Multiply, x.b, b)); });
+        // c * (x + y) = c*x + c*y — только для константы c, иначе граф разрастается
+        if (constant(a))
+            for (const auto &y : nodes_of(b, ExprType::Add))
+                rewrite([&] { return B(ExprType::Add, B(ExprType::Multiply, a, y.a), B(ExprType::Multiply, a, y.b)); });
+        // x * x^k = x^(k+1),  x^m * x^n = x^(m+n); при отрицательных степенях в нуле 0 * inf != x^0
+        for (const auto &y : nodes_of(b, ExprType::Power))
+        {
+            if (same(y.a, a) && constant(y.b) && (fast || is_natural(y.b)))
+                rewrite([&] { return B(ExprType::Power, a, C(*constant(y.b) + T(1))); });
+            for (const auto &x : nodes_of(a, ExprType::Power))
+                if (same(x.a, y.a) && (fast || (is_natural(x.b) && is_natural(y.b))))
+                    rewrite([&] { return B(ExprType::Power, x.a, B(ExprType::Add, x.b, y.b)); });
+        }
+        // exp x * exp y = exp(x + y)
+        for (const auto &x : nodes_of(a, ExprType::Exp))
+            for (const auto &y : nodes_of(b, ExprType::Exp))
+                rewrite([&] { return F(ExprType::Exp, B(ExprType::Add, x.a, y.a)); });
+        // sin x * cos x = sin(2x) / 2
+        for (const auto &x : nodes_of(a, ExprType::Sin))
+            for (const auto &y : nodes_of(b, ExprType::Cos))
+                if (same(x.a, y.a))
+                    rewrite([&] { return B(ExprType::Multiply, C(T(0.5)), F(ExprType::Sin, B(ExprType::Multiply, C(T(2)), x.a))); });
+        break;
+    }
+    case ExprType::Divide:
+        if (is_const(b, T(1)))
+            rewrite([&] { return a; });
+        // 0 / x = 0 и x / x = 1 теряют деление на ноль
+        if (fast && is_const(a, T(0)))
+            rewrite([&] { return C(T(0)); });
+        if (fast && same(a, b))
+            rewrite([&] { return C(T(1)); });
+        // exp x / exp y = exp(x - y)
+        for (const auto &x : nodes_of(a, ExprType::Exp))
+            for (const auto &y : nodes_of(b, ExprType::Exp))
+                rewrite([&] { return F(ExprType::Exp, B(ExprType::Subtract, x.a, y.a)); });
+        break;
+    case ExprType::Power:
+        if (is_const(b, T(1)))
+            rewrite([&] { return a; });
+        if (is_const(b, T(0)))
+            rewrite([&] { return C(T(1)); });
+        if (is_const(b, T(2)))
+            rewrite([&] { return B(ExprType::Multiply, a, a); });
+        // (x^m)^n = x^(m*n) для целого n; без Fast и m целое: (x^0.5)^2 при x < 0 — nan, а не x
+        if (is_integer(b))
+            for (const auto &x : nodes_of(a, ExprType::Power))
+                if (fast || is_integer(x.b))
+                    rewrite([&] { return B(ExprType::Power, x.a, B(ExprType::Multiply, x.b, b)); });
+        break;
+    case ExprType::Exp:
+        // exp(ln x) = x только при x > 0
+        if (fast)
+            for (const auto &x : nodes_of(a, ExprType::Ln))
+                rewrite([&] { return x.a; });
+        break;
+    case ExprType::Ln:
+        for (const auto &x : nodes_of(a, ExprType::Exp))
+            rewrite([&] { return x.a; });
+        // ln(x^b) = b*ln(x) для нечётного натурального b: x^b и x одного знака.
+        // Для чётного b при x < 0 левая часть определена, правая нет — правила нет и при Fast
+        for (const auto &x : nodes_of(a, ExprType::Power))
+            if (is_odd_natural(x.b))
+                rewrite([&] { return B(ExprType::Multiply, x.b, F(ExprType::Ln, x.a)); });
+        break;
+    default:
+        break;
+    }
+}
+
+template <Numeric T>
+bool EGraph<T>::apply_rules(size_t node_limit, MathPolicy policy)
+{
+    size_t nodes_before = memo.size(), unions_before = unions;
+    std::vector<std::pair<int, ENode<T>>> snapshot;
+    for (size_t id = 0; id < classes.size(); ++id)
+        if (find(id) == (int)id)
+            for (const auto &node : classes[id].nodes)
+                snapshot.push_back({id, node});
+
+    for (const auto &[id, node] : snapshot)
+    {
+        if (memo.size() >= node_limit)
+            break;
+        apply(find(id), canonical(node), node_limit, policy);
+    }
+    rebuild();
+    return memo.size() != nodes_before || unions != unions_before;
+}
+
+template <Numeric T>
+typename EGraph<T>::Ptr EGraph<T>::extract(int root, const CostModel &cost)
+{
+    const double inf = std::numeric_limits<double>::infinity();
+    std::vector<double> best(classes.size(), inf);
+    std::vector<ENode<T>> choice(classes.size());
+
+    // Стоимости классов уточняются до неподвижной точки (циклы вида x = x * 1 допустимы)
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t id = 0; id < classes.size(); ++id)
+        {
+            if (find(id) != (int)id)
+                continue;
+            for (const auto &raw : classes[id].nodes)
+            {
+                ENode<T> node = canonical(raw);
+                double c = cost(node.op);
+                if (node.a >= 0)
+                    c += best[node.a];
+                if (node.b >= 0)
+                    c += best[node.b];
+                if (c < best[id])
+                {
+                    best[id] = c;
+                    choice[id] = node;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    std::unordered_map<int, Ptr> built;
+    std::function<Ptr(int)> build = [&](int id) -> Ptr
+    {
+        id = find(id);
+        auto it = built.find(id);
+        if (it != built.end())
+            return it->second;
+        const auto &node = choice[id];
+        Ptr result;
+        if (node.op == ExprType::Constant)
+            result = make_const<T>(node.value);
+        else if (node.op == ExprType::Variable)
+            result = std::make_shared<VarNode<T>>(node.name);
+        else if (is_binary(node.op))
+            result = make<T>(node.op, build(node.a), build(node.b));
+        else
+            result = make_function<T>(node.op, build(node.a));
+        built[id] = result;
+        return result;
+    };
+    return build(root);
+}
+
+template <Numeric T>
+double tree_cost(const std::shared_ptr<Node<T>> &node, const CostModel &cost)
+{
+    ExprType type = node->getType();
+    double c = cost(type);
+    if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        c += tree_cost(bin->getLeft(), cost) + tree_cost(bin->getRight(), cost);
+    }
+    else if (is_function(type))
+        c += tree_cost(static_cast<const FunctionNode<T> *>(node.get())->getArg(), cost);
+    return c;
+}
+
+template <Numeric T>
+Expression<T> egraph_optimize(const Expression<T> &expr, const EGraphOptions &options, EGraphStats *stats)
+{
+    EGraph<T> graph;
+    int root = graph.add(expr.getRoot());
+
+    EGraphStats local;
+    local.cost_before = tree_cost(expr.getRoot(), options.cost);
+    while (local.iterations < options.iter_limit && graph.node_count() < options.node_limit)
+    {
+        ++local.iterations;
+        if (!graph.apply_rules(options.node_limit, options.policy))
+        {
+            local.saturated = true;
+            break;
+        }
+    }
+
+    auto best = graph.extract(graph.find(root), options.cost);
+    local.nodes = graph.node_count();
+    local.classes = graph.class_count();
+    local.cost_after = tree_cost(best, options.cost);
+    if (stats)
+        *stats = local;
+    return Expression<T>(best);
+}
+
+#endif // EGraph_HPP
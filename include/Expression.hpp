@@ -1,16 +1,26 @@
 #ifndef Expression_HPP
 #define Expression_HPP
 
+#include <algorithm>
+#include <array>
 #include <memory>
+#include <mutex>
 #include <map>
 #include <stdexcept>
 #include <cmath>
 #include <complex>
+#include <charconv>
 #include <concepts>
 #include <iostream>
 #include <functional>
-#include <stack>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
 #include <type_traits>
+#include <variant>
+#include <vector>
 
 using Real = long double;
 
@@ -55,6 +65,9 @@ public:
     virtual std::shared_ptr<Node<T>> clone() const = 0;
     virtual std::shared_ptr<Node<T>> diff(const std::string &dvar) const = 0;
     virtual ExprType getType() const = 0;
+
+    // Отдаёт детей в out; вызывается только для узла, которым больше никто не владеет
+    virtual void release_children(std::vector<std::shared_ptr<Node<T>>> &) {}
 };
 
 template <Numeric T>
@@ -76,7 +89,7 @@ public:
 
     ExprType getType() const override { return type; }
 
-    T getVal() { return value; }
+    T getVal() const { return value; }
 };
 
 template <Numeric T>
@@ -97,6 +110,8 @@ public:
     std::shared_ptr<Node<T>> diff(const std::string &dvar) const override;
 
     ExprType getType() const override { return type; }
+
+    const std::string &getName() const { return var; }
 };
 
 template <Numeric T>
@@ -108,6 +123,7 @@ private:
 
 public:
     BinaryOpNode(ExprType type, std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r);
+    ~BinaryOpNode() override;
 
     T eval(const std::map<std::string, T> &vars) const override;
 
@@ -118,6 +134,15 @@ public:
     std::shared_ptr<Node<T>> diff(const std::string &dvar) const override;
 
     ExprType getType() const override { return type; }
+
+    const std::shared_ptr<Node<T>> &getLeft() const { return left; }
+    const std::shared_ptr<Node<T>> &getRight() const { return right; }
+
+    void release_children(std::vector<std::shared_ptr<Node<T>>> &out) override
+    {
+        out.push_back(std::move(left));
+        out.push_back(std::move(right));
+    }
 };
 
 template <Numeric T>
@@ -129,6 +154,7 @@ private:
 
 public:
     FunctionNode(ExprType type, std::shared_ptr<Node<T>> arg);
+    ~FunctionNode() override;
 
     T eval(const std::map<std::string, T> &vars) const override;
 
@@ -139,6 +165,10 @@ public:
     std::shared_ptr<Node<T>> diff(const std::string &dvar) const override;
 
     ExprType getType() const override { return type; }
+
+    const std::shared_ptr<Node<T>> &getArg() const { return arg; }
+
+    void release_children(std::vector<std::shared_ptr<Node<T>>> &out) override { out.push_back(std::move(arg)); }
 };
 
 /*
@@ -176,22 +206,94 @@ public:
 
     std::shared_ptr<Node<T>> clone() const;
 
+    // Корень без копирования (clone() копирует всё дерево)
+    const std::shared_ptr<Node<T>> &getRoot() const { return root; }
+
     Expression sin() const;
     Expression cos() const;
     Expression exp() const;
     Expression ln() const;
+    Expression sqrt() const;
 
     Expression diff(const std::string &dvar) const;
+
+    // Частичное вычисление: переменные из bindings заменяются числами,
+    // всё, что после этого стало константой, сворачивается
+    Expression specialize(const std::map<std::string, T> &bindings) const;
 };
 
 template <Numeric T>
 std::ostream &operator<<(std::ostream &out, const Expression<T> &expr);
 
 template <Numeric T>
-bool is_one(std::shared_ptr<Node<T>> node);
+bool is_one(const std::shared_ptr<Node<T>> &node);
+
+template <Numeric T>
+bool is_zero(const std::shared_ptr<Node<T>> &node);
+
+// Имена всех переменных поддерева
+template <Numeric T>
+void collect_variables(const std::shared_ptr<Node<T>> &node, std::set<std::string> &names);
+
+// Число различных узлов: общие узлы (после cse) считаются один раз
+template <Numeric T>
+size_t count_nodes(const std::shared_ptr<Node<T>> &node);
+
+// Замена переменных на поддеревья. Незатронутые поддеревья и общие узлы не копируются
+template <Numeric T>
+std::shared_ptr<Node<T>> substitute(const std::shared_ptr<Node<T>> &node,
+                                    const std::map<std::string, std::shared_ptr<Node<T>>> &repl);
+
+// Узел op(l, r) / op(arg) со свёрткой констант; ошибки вычисления (деление на 0,
+// ln от неположительного) не сворачиваются и возникнут при вычислении. Поэтому
+// 0*u, 0/u и u^0 с неконстантным u остаются узлами: u может бросить
+template <Numeric T>
+std::shared_ptr<Node<T>> fold_binary(ExprType type, std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r);
+template <Numeric T>
+std::shared_ptr<Node<T>> fold_function(ExprType type, std::shared_ptr<Node<T>> arg);
+
+inline bool is_binary(ExprType type);
+
+inline bool is_function(ExprType type);
+
+template <Numeric T>
+T apply_binary(ExprType type, T left_val, T right_val);
+
+template <Numeric T>
+T apply_function(ExprType type, T arg_val);
+
+// Аргументы правила дифференцирования; у функций аргумент лежит в left, right пустой.
+// Производные аргументов считаются лениво, только если правилу они нужны
+template <Numeric T>
+struct DiffContext
+{
+    std::shared_ptr<Node<T>> left, right;
+    const std::string &dvar;
+    mutable std::shared_ptr<Node<T>> left_diff, right_diff;
+
+    const std::shared_ptr<Node<T>> &dleft() const;
+    const std::shared_ptr<Node<T>> &dright() const;
+};
+
+template <Numeric T>
+struct DiffRule
+{
+    ExprType type;
+    bool (*applies)(const DiffContext<T> &ctx);
+    std::shared_ptr<Node<T>> (*emit)(const DiffContext<T> &ctx);
+};
+
+// Таблица правил: для каждой операции частные случаи идут раньше общего правила
+template <Numeric T>
+const std::vector<DiffRule<T>> &diff_rules();
+
+template <Numeric T>
+std::shared_ptr<Node<T>> diff_by_rules(ExprType type, std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r,
+                                       const std::string &dvar);
 
+// То же с готовым контекстом: производные аргументов можно задать заранее
 template <Numeric T>
-bool is_zero(std::shared_ptr<Node<T>> node);
+std::shared_ptr<Node<T>> diff_by_rules(ExprType type, const DiffContext<T> &ctx);
 
 /*==========*/
 /*Realisation*/
@@ -217,7 +319,17 @@ enum class ExprType : char
     Sin, // sin(a)
     Cos, // cos(a)
     Ln,  // ln(a) (натуральный логарифм)
-    Exp  // exp(a) (экспонента)
+    Exp, // exp(a) (экспонента)
+    Sqrt // sqrt(a) (квадратный корень)
+};
+
+// Политика оптимизирующих проходов (strength_reduce, egraph_optimize):
+// Exact — только переписывания, дающие тот же результат до бита;
+// Fast — ещё и те, что меняют округление, область определения или поведение на inf/-0
+enum class MathPolicy
+{
+    Exact,
+    Fast
 };
 
 std::string ExprTypeToString(ExprType type)
@@ -248,11 +360,80 @@ std::string ExprTypeToString(ExprType type)
         return "ln";
     case ExprType::Exp:
         return "exp";
+    case ExprType::Sqrt:
+        return "sqrt";
     default:
         return "Unknown";
     }
 }
 
+bool is_binary(ExprType type)
+{
+    return type == ExprType::Add || type == ExprType::Subtract || type == ExprType::Multiply ||
+           type == ExprType::Divide || type == ExprType::Power;
+}
+
+bool is_function(ExprType type)
+{
+    return type == ExprType::Negate || type == ExprType::Sin || type == ExprType::Cos || type == ExprType::Ln ||
+           type == ExprType::Exp || type == ExprType::Sqrt;
+}
+
+template <Numeric T>
+T apply_binary(ExprType type, T left_val, T right_val)
+{
+    switch (type)
+    {
+    case ExprType::Add:
+        return left_val + right_val;
+    case ExprType::Subtract:
+        return left_val - right_val;
+    case ExprType::Multiply:
+        return left_val * right_val;
+    case ExprType::Divide:{
+        if(right_val == T(0))
+            throw std::runtime_error("division by 0");
+        return left_val / right_val;
+    }
+    case ExprType::Power:
+        return std::pow(left_val, right_val);
+    default:
+        throw std::runtime_error("Doesn`t exist operation");
+    }
+}
+
+template <Numeric T>
+T apply_function(ExprType type, T arg_val)
+{
+    switch (type)
+    {
+    case ExprType::Negate:
+        return -arg_val;
+    case ExprType::Sin:
+        return std::sin(arg_val);
+    case ExprType::Cos:
+        return std::cos(arg_val);
+    case ExprType::Exp:
+        return std::exp(arg_val);
+    case ExprType::Sqrt:
+        return std::sqrt(arg_val);
+    case ExprType::Ln: {
+        if(arg_val == T(0))
+            throw std::runtime_error("ln argument must be not 0");
+        if constexpr (std::is_same_v<T, Complex>)
+        {}
+        else{
+            if(arg_val <= T(0)) {
+                throw std::runtime_error("ln argument must be more 0");
+            }
+        }
+        return std::log(arg_val);   
+    }
+    default:
+        throw std::runtime_error("Fuction doesn`t exist");
+    }
+}
+
 /*=========*/
 /*ConstNode*/
 /*=========*/
@@ -293,11 +474,21 @@ std::shared_ptr<Node<T>> ConstNode<T>::diff(const std::string &dvar) const
 template <Numeric T>
 VarNode<T>::VarNode(std::string s) : var(s), type(ExprType::Variable) {}
 
+// Значение переменной "i"; для вещественных типов — действительная часть мнимой единицы
+template <Numeric T>
+T imaginary_unit()
+{
+    if constexpr (std::is_same_v<T, Complex>)
+        return Complex(0, 1);
+    else
+        return T(0);
+}
+
 template <Numeric T>
 T VarNode<T>::eval(const std::map<std::string, T> &vars) const
 {
     if(var == "i")
-        return T(Complex(0, 1));
+        return imaginary_unit<T>();
     if (vars.find(var) == vars.end())
         throw std::runtime_error("Variable '" + var + "' is not provided");
     return vars.find(var)->second;
@@ -335,7 +526,7 @@ template <Numeric T>
 std::shared_ptr<Node<T>> del_zero(ExprType type, std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r)
 {
     if (is_zero(l))
-        return (((type == ExprType::Subtract ? Expression<T>(-1) : Expression<T>(1))) * Expression(r)).clone();
+        return type == ExprType::Subtract ? del_mult<T>(ExprType::Multiply, std::make_shared<ConstNode<T>>(T(-1)), r) : r;
     if (is_zero<T>(r))
         return l;
     if (l->getType() == ExprType::Constant && r->getType() == ExprType::Constant)
@@ -381,33 +572,46 @@ std::shared_ptr<Node<T>> del_pow(ExprType type, std::shared_ptr<Node<T>> l, std:
     return make<T>(type, l, r);
 }
 
+// Поддерево, которым владеет только этот указатель, освобождается без рекурсии деструкторов:
+// цепочка a + b + c + ... из большого файла иначе переполняет стек
+template <Numeric T>
+void release_subtrees(std::shared_ptr<Node<T>> first, std::shared_ptr<Node<T>> second = nullptr)
+{
+    // Не через initializer_list: его элементы копируются и держат лишнюю ссылку
+    std::vector<std::shared_ptr<Node<T>>> pending;
+    pending.push_back(std::move(first));
+    pending.push_back(std::move(second));
+    while (!pending.empty())
+    {
+        auto node = std::move(pending.back());
+        pending.pop_back();
+        if (node && node.use_count() == 1)
+            node->release_children(pending);
+    }
+}
+
+template <Numeric T>
+bool owns_subtree(const std::shared_ptr<Node<T>> &node)
+{
+    return node && node.use_count() == 1 && (is_binary(node->getType()) || is_function(node->getType()));
+}
+
 template <Numeric T>
 BinaryOpNode<T>::BinaryOpNode(ExprType op, std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r) : type(op), left(l), right(r) {}
 
+template <Numeric T>
+BinaryOpNode<T>::~BinaryOpNode()
+{
+    if (owns_subtree(left) || owns_subtree(right))
+        release_subtrees<T>(std::move(left), std::move(right));
+}
+
 template <Numeric T>
 T BinaryOpNode<T>::eval(const std::map<std::string, T> &vars) const
 {
     T left_val = left->eval(vars);
     T right_val = right->eval(vars);
-
-    switch (type)
-    {
-    case ExprType::Add:
-        return left_val + right_val;
-    case ExprType::Subtract:
-        return left_val - right_val;
-    case ExprType::Multiply:
-        return left_val * right_val;
-    case ExprType::Divide:{
-        if(right_val == T(0))
-            throw std::runtime_error("division by 0");
-        return left_val / right_val;
-    }
-    case ExprType::Power:
-        return std::pow(left_val, right_val);
-    }
-
-    throw std::runtime_error("Doesn`t exist operation");
+    return apply_binary(type, left_val, right_val);
 }
 
 template <Numeric T>
@@ -425,53 +629,7 @@ std::shared_ptr<Node<T>> BinaryOpNode<T>::clone() const
 template <Numeric T>
 std::shared_ptr<Node<T>> BinaryOpNode<T>::diff(const std::string &dvar) const
 {
-    auto left_diff = left->diff(dvar);
-    auto right_diff = right->diff(dvar);
-
-    switch (type)
-    {
-    case ExprType::Add:
-    {
-        return del_zero(ExprType::Add, left_diff->clone(), right_diff->clone());
-    }
-    case ExprType::Subtract:
-    {
-        return del_zero(ExprType::Subtract, left_diff->clone(), right_diff->clone());
-    }
-    case ExprType::Multiply:
-    {
-
-        std::shared_ptr<Node<T>> new_left = del_mult(ExprType::Multiply, left_diff->clone(), right->clone());
-        std::shared_ptr<Node<T>> new_right = del_mult(ExprType::Multiply, left->clone(), right_diff->clone());
-
-        return del_zero(ExprType::Add, new_left->clone(), new_right->clone());
-    }
-    case ExprType::Divide:
-    {
-        auto new_sub_left = del_mult(ExprType::Multiply, left_diff->clone(), right->clone());
-
-        auto new_sub_right = del_mult(ExprType::Multiply, left->clone(), right_diff->clone());
-
-        auto num = del_zero(ExprType::Subtract, new_sub_left->clone(), new_sub_right->clone());
-
-        auto den = del_pow(ExprType::Power, right->clone(), std::static_pointer_cast<Node<T>>(std::make_shared<ConstNode<T>>(2)));
-
-        return del_div(ExprType::Divide, num->clone(), den->clone());
-    }
-    case ExprType::Power:
-    {
-        auto big_left_node = del_pow(ExprType::Power, left->clone(), right->clone());
-
-        auto small_left_node = del_mult(ExprType::Multiply, left_diff->clone(), del_div(ExprType::Divide, right->clone(), left->clone()));
-
-        auto small_right_node = del_mult(ExprType::Multiply, right_diff->clone(), std::static_pointer_cast<Node<T>>(std::make_shared<FunctionNode<T>>(ExprType::Ln, left)));
-
-        auto big_right_node = del_zero(ExprType::Add, small_left_node, small_right_node);
-
-        return del_mult(ExprType::Multiply, big_left_node, big_right_node);
-    }
-    }
-    throw std::runtime_error("Doesn`t exist operation");
+    return diff_by_rules<T>(type, left, right, dvar);
 }
 
 /*=========*/
@@ -481,37 +639,25 @@ std::shared_ptr<Node<T>> BinaryOpNode<T>::diff(const std::string &dvar) const
 template <Numeric T>
 FunctionNode<T>::FunctionNode(ExprType type, std::shared_ptr<Node<T>> arg) : type(type), arg(arg) {}
 
+template <Numeric T>
+FunctionNode<T>::~FunctionNode()
+{
+    if (owns_subtree(arg))
+        release_subtrees<T>(std::move(arg));
+}
+
 template <Numeric T>
 T FunctionNode<T>::eval(const std::map<std::string, T> &vars) const
 {
     T arg_val = arg->eval(vars);
-    switch (type)
-    {
-    case ExprType::Sin:
-        return std::sin(arg_val);
-    case ExprType::Cos:
-        return std::cos(arg_val);
-    case ExprType::Exp:
-        return std::exp(arg_val);
-    case ExprType::Ln: {
-        if(arg_val == T(0))
-            throw std::runtime_error("ln argument must be not 0");
-        if constexpr (std::is_same_v<T, Complex>)
-        {}
-        else{
-            if(arg_val <= T(0)) {
-                throw std::runtime_error("ln argument must be more 0");
-            }
-        }
-        return std::log(arg_val);   
-    }
-    }
-    throw std::runtime_error("Fuction doesn`t exist");
+    return apply_function(type, arg_val);
 }
 
 template <Numeric T>
 std::string FunctionNode<T>::to_string() const
 {
+    if (type == ExprType::Negate)
+        return "(-" + arg->to_string() + ")";
     return ExprTypeToString(type) + "(" + arg->to_string() + ")";
 }
 
@@ -524,36 +670,209 @@ std::shared_ptr<Node<T>> FunctionNode<T>::clone() const
 template <Numeric T>
 std::shared_ptr<Node<T>> FunctionNode<T>::diff(const std::string &dvar) const
 {
-    auto arg_diff = arg->diff(dvar);
-    std::shared_ptr<Node<T>> new_node;
-    switch (type)
-    {
-    case ExprType::Sin:
+    return diff_by_rules<T>(type, arg, nullptr, dvar);
+}
+
+/*=========*/
+/*DiffRules*/
+/*=========*/
+
+template <Numeric T>
+const std::shared_ptr<Node<T>> &DiffContext<T>::dleft() const
+{
+    if (!left_diff)
+        left_diff = left->diff(dvar);
+    return left_diff;
+}
+
+template <Numeric T>
+const std::shared_ptr<Node<T>> &DiffContext<T>::dright() const
+{
+    if (!right_diff)
+        right_diff = right->diff(dvar);
+    return right_diff;
+}
+
+template <Numeric T>
+std::shared_ptr<Node<T>> make_const(T val)
+{
+    return std::static_pointer_cast<Node<T>>(std::make_shared<ConstNode<T>>(val));
+}
+
+template <Numeric T>
+std::shared_ptr<Node<T>> make_function(ExprType type, std::shared_ptr<Node<T>> arg)
+{
+    return std::static_pointer_cast<Node<T>>(std::make_shared<FunctionNode<T>>(type, arg));
+}
+
+// ln от константы сворачивается, если это не выводит за область определения
+template <Numeric T>
+std::shared_ptr<Node<T>> ln_of(std::shared_ptr<Node<T>> node)
+{
+    if (node->getType() == ExprType::Constant)
     {
-        new_node = std::make_shared<FunctionNode<T>>(ExprType::Cos, arg->clone());
-        return del_mult(ExprType::Multiply, new_node->clone(), arg_diff->clone());
+        T val = node->eval({});
+        bool positive = true;
+        if constexpr (!std::is_same_v<T, Complex>)
+            positive = val > T(0);
+        if (positive && !(val == T(0)))
+            return make_const<T>(std::log(val));
     }
-    case ExprType::Cos:
-    {
-        auto new_node = std::make_shared<FunctionNode<T>>(ExprType::Sin, arg->clone());
-        auto neg_node = del_mult(ExprType::Multiply, std::static_pointer_cast<Node<T>>(std::make_shared<ConstNode<T>>(-1)), new_node->clone());
+    return make_function<T>(ExprType::Ln, node);
+}
 
-        return del_mult(ExprType::Multiply, neg_node->clone(), arg_diff->clone());
-    }
-    case ExprType::Exp:
-    {
-        new_node = std::make_shared<FunctionNode<T>>(ExprType::Exp, arg->clone());
+template <Numeric T>
+const std::shared_ptr<Node<T>> &inner_arg(const std::shared_ptr<Node<T>> &node)
+{
+    return static_cast<const FunctionNode<T> *>(node.get())->getArg();
+}
 
-        return del_mult(ExprType::Multiply, new_node->clone(), arg_diff->clone());
-    }
-    case ExprType::Ln:
-    {
-        auto reciprocal = del_div(ExprType::Divide, std::static_pointer_cast<Node<T>>(std::make_shared<ConstNode<T>>(1)), arg->clone());
+template <Numeric T>
+const std::vector<DiffRule<T>> &diff_rules()
+{
+    using Ctx = DiffContext<T>;
+    using Ptr = std::shared_ptr<Node<T>>;
+    static const std::vector<DiffRule<T>> rules = {
+        // (f ± g)' = f' ± g'
+        {ExprType::Add, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr { return del_zero(ExprType::Add, c.dleft()->clone(), c.dright()->clone()); }},
+        {ExprType::Subtract, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr { return del_zero(ExprType::Subtract, c.dleft()->clone(), c.dright()->clone()); }},
+
+        // (c * g)' = c * g',  (f * c)' = f' * c
+        {ExprType::Multiply, [](const Ctx &c) { return is_zero(c.dleft()); },
+         [](const Ctx &c) -> Ptr { return del_mult(ExprType::Multiply, c.left->clone(), c.dright()->clone()); }},
+        {ExprType::Multiply, [](const Ctx &c) { return is_zero(c.dright()); },
+         [](const Ctx &c) -> Ptr { return del_mult(ExprType::Multiply, c.dleft()->clone(), c.right->clone()); }},
+        {ExprType::Multiply, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr
+         {
+             auto new_left = del_mult(ExprType::Multiply, c.dleft()->clone(), c.right->clone());
+             auto new_right = del_mult(ExprType::Multiply, c.left->clone(), c.dright()->clone());
+             return del_zero(ExprType::Add, new_left, new_right);
+         }},
+
+        // (f / c)' = f' / c,  (c / g)' = -c * g' / g^2
+        {ExprType::Divide, [](const Ctx &c) { return is_zero(c.dright()); },
+         [](const Ctx &c) -> Ptr { return del_div(ExprType::Divide, c.dleft()->clone(), c.right->clone()); }},
+        {ExprType::Divide, [](const Ctx &c) { return is_zero(c.dleft()); },
+         [](const Ctx &c) -> Ptr
+         {
+             auto neg = del_mult(ExprType::Multiply, make_const<T>(-1), c.left->clone());
+             auto num = del_mult(ExprType::Multiply, neg, c.dright()->clone());
+             auto den = del_pow(ExprType::Power, c.right->clone(), make_const<T>(2));
+             return del_div(ExprType::Divide, num, den);
+         }},
+        {ExprType::Divide, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr
+         {
+             auto new_sub_left = del_mult(ExprType::Multiply, c.dleft()->clone(), c.right->clone());
+             auto new_sub_right = del_mult(ExprType::Multiply, c.left->clone(), c.dright()->clone());
+             auto num = del_zero(ExprType::Subtract, new_sub_left, new_sub_right);
+             auto den = del_pow(ExprType::Power, c.right->clone(), make_const<T>(2));
+             return del_div(ExprType::Divide, num, den);
+         }},
+
+        // (f^c)' = c * f^(c-1) * f',  (a^g)' = a^g * ln(a) * g'
+        {ExprType::Power, [](const Ctx &c) { return is_zero(c.dright()); },
+         [](const Ctx &c) -> Ptr
+         {
+             auto exponent = del_zero(ExprType::Subtract, c.right->clone(), make_const<T>(1));
+             auto power = del_pow(ExprType::Power, c.left->clone(), exponent);
+             auto factor = del_mult(ExprType::Multiply, c.right->clone(), power);
+             return del_mult(ExprType::Multiply, factor, c.dleft()->clone());
+         }},
+        {ExprType::Power, [](const Ctx &c) { return is_zero(c.dleft()); },
+         [](const Ctx &c) -> Ptr
+         {
+             auto power = del_pow(ExprType::Power, c.left->clone(), c.right->clone());
+             auto factor = del_mult(ExprType::Multiply, power, ln_of(c.left->clone()));
+             return del_mult(ExprType::Multiply, factor, c.dright()->clone());
+         }},
+        {ExprType::Power, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr
+         {
+             auto big_left_node = del_pow(ExprType::Power, c.left->clone(), c.right->clone());
+             auto small_left_node = del_mult(ExprType::Multiply, c.dleft()->clone(),
+                                             del_div(ExprType::Divide, c.right->clone(), c.left->clone()));
+             auto small_right_node = del_mult(ExprType::Multiply, c.dright()->clone(), ln_of(c.left->clone()));
+             auto big_right_node = del_zero(ExprType::Add, small_left_node, small_right_node);
+             return del_mult(ExprType::Multiply, big_left_node, big_right_node);
+         }},
+
+        // (-f)' = -f'
+        {ExprType::Negate, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr
+         {
+             if (c.dleft()->getType() == ExprType::Constant)
+                 return make_const<T>(-c.dleft()->eval({}));
+             return make_function<T>(ExprType::Negate, c.dleft()->clone());
+         }},
+
+        {ExprType::Sin, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr
+         { return del_mult(ExprType::Multiply, make_function<T>(ExprType::Cos, c.left->clone()), c.dleft()->clone()); }},
+        {ExprType::Cos, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr
+         {
+             auto neg_node = del_mult(ExprType::Multiply, make_const<T>(-1), make_function<T>(ExprType::Sin, c.left->clone()));
+             return del_mult(ExprType::Multiply, neg_node, c.dleft()->clone());
+         }},
+
+        // sqrt(f)' = f' / (2 * sqrt(f))
+        {ExprType::Sqrt, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr
+         {
+             auto twice = del_mult(ExprType::Multiply, make_const<T>(2), make_function<T>(ExprType::Sqrt, c.left->clone()));
+             return del_div(ExprType::Divide, c.dleft()->clone(), twice);
+         }},
+
+        // exp(ln(g))' = g'
+        {ExprType::Exp, [](const Ctx &c) { return c.left->getType() == ExprType::Ln; },
+         [](const Ctx &c) -> Ptr { return inner_arg(c.left)->diff(c.dvar); }},
+        {ExprType::Exp, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr
+         { return del_mult(ExprType::Multiply, make_function<T>(ExprType::Exp, c.left->clone()), c.dleft()->clone()); }},
+
+        // ln(exp(g))' = g',  ln(f^c)' = c * f' / f,  ln(f)' = f' / f
+        {ExprType::Ln, [](const Ctx &c) { return c.left->getType() == ExprType::Exp; },
+         [](const Ctx &c) -> Ptr { return inner_arg(c.left)->diff(c.dvar); }},
+        {ExprType::Ln,
+         [](const Ctx &c)
+         {
+             if (c.left->getType() != ExprType::Power)
+                 return false;
+             auto pow_node = static_cast<const BinaryOpNode<T> *>(c.left.get());
+             return is_zero(pow_node->getRight()->diff(c.dvar));
+         },
+         [](const Ctx &c) -> Ptr
+         {
+             auto pow_node = static_cast<const BinaryOpNode<T> *>(c.left.get());
+             auto base = pow_node->getLeft();
+             auto ratio = del_div(ExprType::Divide, base->diff(c.dvar), base->clone());
+             return del_mult(ExprType::Multiply, pow_node->getRight()->clone(), ratio);
+         }},
+        {ExprType::Ln, [](const Ctx &) { return true; },
+         [](const Ctx &c) -> Ptr { return del_div(ExprType::Divide, c.dleft()->clone(), c.left->clone()); }},
+    };
+    return rules;
+}
 
-        return del_mult(ExprType::Multiply, reciprocal->clone(), arg_diff->clone());
-    }
-    }
-    throw std::runtime_error("Fuction doesn`t exist");
+template <Numeric T>
+std::shared_ptr<Node<T>> diff_by_rules(ExprType type, std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r,
+                                       const std::string &dvar)
+{
+    DiffContext<T> ctx{l, r, dvar, nullptr, nullptr};
+    return diff_by_rules<T>(type, ctx);
+}
+
+template <Numeric T>
+std::shared_ptr<Node<T>> diff_by_rules(ExprType type, const DiffContext<T> &ctx)
+{
+    for (const auto &rule : diff_rules<T>())
+        if (rule.type == type && rule.applies(ctx))
+            return rule.emit(ctx);
+    throw std::runtime_error("Doesn`t exist operation");
 }
 
 /*=========*/
@@ -670,17 +989,184 @@ std::ostream &operator<<(std::ostream &out, const Expression<T> &expr)
 }
 
 template <Numeric T>
-bool is_one(std::shared_ptr<Node<T>> node)
+bool is_one(const std::shared_ptr<Node<T>> &node)
+{
+    return node->getType() == ExprType::Constant && static_cast<const ConstNode<T> *>(node.get())->getVal() == T(1);
+}
+
+template <Numeric T>
+bool is_zero(const std::shared_ptr<Node<T>> &node)
+{
+    return node->getType() == ExprType::Constant && static_cast<const ConstNode<T> *>(node.get())->getVal() == T(0);
+}
+
+template <Numeric T>
+void collect_variables(const std::shared_ptr<Node<T>> &node, std::set<std::string> &names)
+{
+    ExprType type = node->getType();
+    if (type == ExprType::Variable)
+        names.insert(static_cast<const VarNode<T> *>(node.get())->getName());
+    else if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        collect_variables(bin->getLeft(), names);
+        collect_variables(bin->getRight(), names);
+    }
+    else if (is_function(type))
+        collect_variables(static_cast<const FunctionNode<T> *>(node.get())->getArg(), names);
+}
+
+template <Numeric T>
+void count_nodes_impl(const std::shared_ptr<Node<T>> &node, std::set<const Node<T> *> &seen)
+{
+    if (!seen.insert(node.get()).second)
+        return;
+    ExprType type = node->getType();
+    if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        count_nodes_impl(bin->getLeft(), seen);
+        count_nodes_impl(bin->getRight(), seen);
+    }
+    else if (is_function(type))
+        count_nodes_impl(static_cast<const FunctionNode<T> *>(node.get())->getArg(), seen);
+}
+
+template <Numeric T>
+size_t count_nodes(const std::shared_ptr<Node<T>> &node)
+{
+    std::set<const Node<T> *> seen;
+    count_nodes_impl(node, seen);
+    return seen.size();
+}
+
+template <Numeric T>
+std::shared_ptr<Node<T>> substitute_impl(const std::shared_ptr<Node<T>> &node,
+                                         const std::map<std::string, std::shared_ptr<Node<T>>> &repl,
+                                         std::unordered_map<const Node<T> *, std::shared_ptr<Node<T>>> &done)
+{
+    auto it = done.find(node.get());
+    if (it != done.end())
+        return it->second;
+
+    std::shared_ptr<Node<T>> result = node;
+    ExprType type = node->getType();
+    if (type == ExprType::Variable)
+    {
+        auto found = repl.find(static_cast<const VarNode<T> *>(node.get())->getName());
+        if (found != repl.end())
+            result = found->second;
+    }
+    else if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        auto l = substitute_impl(bin->getLeft(), repl, done);
+        auto r = substitute_impl(bin->getRight(), repl, done);
+        if (l != bin->getLeft() || r != bin->getRight())
+            result = make<T>(type, l, r);
+    }
+    else if (is_function(type))
+    {
+        auto fn = static_cast<const FunctionNode<T> *>(node.get());
+        auto arg = substitute_impl(fn->getArg(), repl, done);
+        if (arg != fn->getArg())
+            result = std::make_shared<FunctionNode<T>>(type, arg);
+    }
+    done[node.get()] = result;
+    return result;
+}
+
+template <Numeric T>
+std::shared_ptr<Node<T>> substitute(const std::shared_ptr<Node<T>> &node,
+                                    const std::map<std::string, std::shared_ptr<Node<T>>> &repl)
 {
-    auto const_node = std::dynamic_pointer_cast<ConstNode<T>>(node);
-    return (const_node && const_node->eval({}) == T(1));
+    std::unordered_map<const Node<T> *, std::shared_ptr<Node<T>>> done;
+    return substitute_impl(node, repl, done);
 }
 
 template <Numeric T>
-bool is_zero(std::shared_ptr<Node<T>> node)
+std::shared_ptr<Node<T>> fold_binary(ExprType type, std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r)
 {
-    auto const_node = std::dynamic_pointer_cast<ConstNode<T>>(node);
-    return (const_node && const_node->eval({}) == T(0));
+    if (l->getType() == ExprType::Constant && r->getType() == ExprType::Constant)
+    {
+        try
+        {
+            return make_const<T>(apply_binary(type, l->eval({}), r->eval({})));
+        }
+        catch (const std::runtime_error &)
+        {
+            return make<T>(type, l, r);
+        }
+    }
+    bool drops_operand = (type == ExprType::Multiply && (is_zero(l) || is_zero(r))) ||
+                         (type == ExprType::Divide && is_zero(l)) || (type == ExprType::Power && is_zero(r));
+    if (drops_operand)
+        return make<T>(type, l, r);
+    if (type == ExprType::Add || type == ExprType::Subtract)
+        return del_zero(type, l, r);
+    if (type == ExprType::Multiply)
+        return del_mult(type, l, r);
+    if (type == ExprType::Divide)
+        return del_div(type, l, r);
+    return del_pow(type, l, r);
+}
+
+template <Numeric T>
+std::shared_ptr<Node<T>> fold_function(ExprType type, std::shared_ptr<Node<T>> arg)
+{
+    if (arg->getType() == ExprType::Constant)
+    {
+        try
+        {
+            return make_const<T>(apply_function(type, arg->eval({})));
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+    }
+    return make_function<T>(type, arg);
+}
+
+template <Numeric T>
+std::shared_ptr<Node<T>> specialize_impl(const std::shared_ptr<Node<T>> &node, const std::map<std::string, T> &bindings,
+                                         std::unordered_map<const Node<T> *, std::shared_ptr<Node<T>>> &done)
+{
+    auto it = done.find(node.get());
+    if (it != done.end())
+        return it->second;
+
+    std::shared_ptr<Node<T>> result = node;
+    ExprType type = node->getType();
+    if (type == ExprType::Variable)
+    {
+        auto found = bindings.find(static_cast<const VarNode<T> *>(node.get())->getName());
+        if (found != bindings.end())
+            result = make_const<T>(found->second);
+    }
+    else if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        auto l = specialize_impl(bin->getLeft(), bindings, done);
+        auto r = specialize_impl(bin->getRight(), bindings, done);
+        if (l != bin->getLeft() || r != bin->getRight())
+            result = fold_binary(type, l, r);
+    }
+    else if (is_function(type))
+    {
+        auto fn = static_cast<const FunctionNode<T> *>(node.get());
+        auto arg = specialize_impl(fn->getArg(), bindings, done);
+        if (arg != fn->getArg())
+            result = fold_function(type, arg);
+    }
+    done[node.get()] = result;
+    return result;
+}
+
+template <Numeric T>
+Expression<T> Expression<T>::specialize(const std::map<std::string, T> &bindings) const
+{
+    std::unordered_map<const Node<T> *, std::shared_ptr<Node<T>>> done;
+    return Expression<T>(specialize_impl(root, bindings, done));
 }
 
 template <Numeric T>
@@ -711,13 +1197,24 @@ Expression<T> Expression<T>::ln() const
     return Expression<T>(newNode);
 }
 
+template <Numeric T>
+Expression<T> Expression<T>::sqrt() const
+{
+    auto newNode = std::make_shared<FunctionNode<T>>(ExprType::Sqrt, this->clone());
+    return Expression<T>(newNode);
+}
+
 template <Numeric T>
 Expression<T> Expression<T>::diff(const std::string &dvar) const
 {
     return Expression<T>(root->diff(dvar));
 }
 
-int priority(char op)
+/*=========*/
+/*Parser*/
+/*=========*/
+
+inline int priority(char op)
 {
     if (op == '^')
         return 3;
@@ -728,226 +1225,552 @@ int priority(char op)
     return -1;
 }
 
-bool is_operator(char c)
+inline bool is_operator(char c)
 {
     return (c == '+' || c == '-' || c == '*' || c == '/' || c == '^');
 }
 
-Complex ParseComplex(const std::string &s)
+inline ExprType binary_type(char op)
 {
-    // std::cout << s << '\n';
-    if (s.find('i') == std::string::npos)
-        return Complex(stold(s), 0);
+    switch (op)
+    {
+    case '+':
+        return ExprType::Add;
+    case '-':
+        return ExprType::Subtract;
+    case '*':
+        return ExprType::Multiply;
+    case '/':
+        return ExprType::Divide;
+    default:
+        return ExprType::Power;
+    }
+}
 
-    int pos_plus = s.find('+');
-    int pos_minus = s.find('-');
+// Число без знака из начала text: цифры, точка, показатель (12, .5, 5., 1e-9, 2.5E+3).
+// std::from_chars не зависит от локали и не выделяет память; округление точное для F.
+// Возвращает число прочитанных символов, 0 — если числа нет
+template <typename F>
+size_t lex_number(std::string_view text, F &value)
+{
+    if (text.empty() || !(std::isdigit((unsigned char)text[0]) || text[0] == '.'))
+        return 0;
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error != std::errc())
+        return 0;
+    return end - text.data();
+}
 
-    if (pos_plus == std::string::npos && pos_minus == std::string::npos){ 
-        return Complex(0, stold(s.substr(0, s.size() - 1)));
-    }
-    int pos = 0;
-    if(pos_plus == std::string::npos)
-        pos = pos_minus;
-    else
-        pos = pos_plus;    
-    // std::cout << stold(s.substr(0, pos)) << '\n';
-    // std::cout << stold(s.substr(pos + 1, s.size() - pos - 1)) << '\n';
-    return Complex(stold(s.substr(0, pos)), stold(s.substr(pos + 1, s.size() - pos - 1)));
+// Комплексный литерал "a", "bi", "a+bi", "a-bi" (коэффициент при i можно опустить: "2-i")
+inline Complex ParseComplex(std::string_view s)
+{
+    size_t pos = 0;
+    auto fail = [&]() { throw std::runtime_error("Invalid complex literal '" + std::string(s) + "'"); };
+    auto part = [&](bool sign_required, Real &value, bool &imaginary)
+    {
+        bool negative = pos < s.size() && s[pos] == '-';
+        if (negative || (pos < s.size() && s[pos] == '+'))
+            ++pos;
+        else if (sign_required)
+            fail();
+        size_t n = lex_number(s.substr(pos), value);
+        pos += n;
+        imaginary = pos < s.size() && s[pos] == 'i';
+        if (imaginary)
+            ++pos;
+        if (n == 0 && !imaginary)
+            fail();
+        if (n == 0)
+            value = 1;
+        if (negative)
+            value = -value;
+    };
+
+    Real first, second;
+    bool first_imaginary, second_imaginary;
+    part(false, first, first_imaginary);
+    if (pos == s.size())
+        return first_imaginary ? Complex(0, first) : Complex(first, 0);
+    if (first_imaginary)
+        fail();
+    part(true, second, second_imaginary);
+    if (pos != s.size() || !second_imaginary)
+        fail();
+    return Complex(first, second);
 }
 
+// Встроенные функции, отсортированы по имени: поиск двоичный, таблица строится при компиляции
+struct FunctionName
+{
+    std::string_view name;
+    ExprType type;
+};
+
+inline constexpr std::array<FunctionName, 5> builtin_functions = {{
+    {"cos", ExprType::Cos},
+    {"exp", ExprType::Exp},
+    {"ln", ExprType::Ln},
+    {"sin", ExprType::Sin},
+    {"sqrt", ExprType::Sqrt},
+}};
+
+static_assert(std::is_sorted(builtin_functions.begin(), builtin_functions.end(),
+                             [](const FunctionName &a, const FunctionName &b) { return a.name < b.name; }));
+
+// Имя в нижнем регистре — встроенная функция или std::nullopt
+constexpr std::optional<ExprType> builtin_function(std::string_view name)
+{
+    auto it = std::lower_bound(builtin_functions.begin(), builtin_functions.end(), name,
+                               [](const FunctionName &f, std::string_view key) { return f.name < key; });
+    if (it != builtin_functions.end() && it->name == name)
+        return it->type;
+    return std::nullopt;
+}
+
+// Пользовательская функция одного аргумента: строит узел по узлу аргумента
 template <Numeric T>
-Expression<T> make_expression(const std::string &t)
+using FunctionBuilder = std::function<std::shared_ptr<Node<T>>(std::shared_ptr<Node<T>>)>;
+
+// Регистрация один раз на всю программу, дальше функция доступна в каждом разборе.
+// Имена нечувствительны к регистру, встроенные и уже определённые переопределить нельзя
+template <Numeric T>
+void define_function(std::string_view name, FunctionBuilder<T> builder);
+
+// Функция через формулу: define_function<Real>("sigmoid", "x", "1 / (1 + exp(-x))")
+template <Numeric T>
+void define_function(std::string_view name, std::string_view param, std::string_view body);
+
+// Построитель для имени в нижнем регистре или nullptr
+template <Numeric T>
+const FunctionBuilder<T> *find_function(std::string_view name);
+
+enum class ParseErrorKind
+{
+    UnexpectedEnd,         // выражение оборвалось
+    UnexpectedCharacter,   // символ не на своём месте, в том числе лишняя ')'
+    ExpectedParen,         // нет ')' после выражения в скобках или аргумента
+    ExpectedArgumentParen, // нет '(' после имени функции
+    EmptyArgument,         // sin()
+    InvalidNumber,         // "." без цифр
+    TooDeep,               // вложенность больше Parser::max_depth
+    InputError             // файл не открылся или чтение оборвалось
+};
+
+struct ParseError
+{
+    ParseErrorKind kind;
+    size_t offset;  // в байтах от начала строки
+    char found = 0; // для UnexpectedCharacter
+
+    std::string message() const;
+};
+
+// Значение или ошибка — то же, что std::expected из C++23
+template <typename V, typename E>
+class Expected
+{
+    static_assert(!std::is_same_v<V, E>);
+
+public:
+    Expected(V value) : data(std::in_place_index<0>, std::move(value)) {}
+    Expected(E error) : data(std::in_place_index<1>, std::move(error)) {}
+
+    bool has_value() const { return data.index() == 0; }
+    explicit operator bool() const { return has_value(); }
+
+    V &value() { return std::get<0>(data); }
+    const V &value() const { return std::get<0>(data); }
+    V &operator*() { return value(); }
+    const V &operator*() const { return value(); }
+    V *operator->() { return &value(); }
+    const V *operator->() const { return &value(); }
+
+    const E &error() const { return std::get<1>(data); }
+
+private:
+    std::variant<V, E> data;
+};
+
+// Источник символов для Parser — строка целиком в памяти (в том числе отображённый файл).
+// Другие источники (FdSource) дают те же операции; lookahead(n) — до n следующих
+// символов подряд, меньше только в конце ввода
+class TextSource
 {
-    std::string s = "";
-    for (char c : t)
+public:
+    TextSource(std::string_view text) : text(text) {}
+
+    bool at_end() const { return pos >= text.size(); }
+    char peek() const { return text[pos]; }
+    void advance(size_t n = 1) { pos += n; }
+    size_t offset() const { return pos; }
+    std::string_view lookahead(size_t n) const { return text.substr(pos, n); }
+    bool failed() const { return false; }
+
+private:
+    std::string_view text;
+    size_t pos = 0;
+};
+
+// Построение узлов для Parser: обычное дерево с упрощениями del_*.
+// HashConsBuilder (HashCons.hpp) с тем же интерфейсом кладёт узлы сразу в таблицу уникальных узлов
+template <Numeric T>
+struct TreeBuilder
+{
+    using Ptr = std::shared_ptr<Node<T>>;
+
+    Ptr constant(T value) { return make_const<T>(value); }
+    Ptr variable(std::string name) { return std::make_shared<VarNode<T>>(std::move(name)); }
+    Ptr function(ExprType type, Ptr arg) { return make_function<T>(type, std::move(arg)); }
+    Ptr call(const FunctionBuilder<T> &builder, Ptr arg) { return builder(std::move(arg)); }
+    Ptr binary(ExprType type, Ptr l, Ptr r);
+};
+
+// Однопроходный разбор методом Пратта: каждый символ читается один раз,
+// подстроки не копируются, память выделяется только под узлы.
+//   expr    := unary (op unary)*   — + - (1), * / (2), ^ (3), все левоассоциативны
+//   unary   := '-' unary | primary — унарный минус слабее ^: -x^2 = -(x^2)
+//   primary := число | имя | функция '(' expr ')' | '(' expr ')'
+//   число   := 12 | 1.5 | .5 | 1e-9 | 2.5E+3, для Complex ещё 3i
+// Имена нечувствительны к регистру; после первой буквы допускаются цифры и '_'.
+// Пробелы между лексемами пропускаются.
+// Ошибки не бросаются: разбор останавливается на первой, её место и вид — в error()
+template <Numeric T, typename Source = TextSource, typename Builder = TreeBuilder<T>>
+class Parser
+{
+public:
+    using Ptr = std::shared_ptr<Node<T>>;
+
+    // Около 600 байт стека на уровень: с запасом для потока со стеком 8 МБ
+    static constexpr int max_depth = 4096;
+    // Наибольшее заглядывание вперёд: длиннее числа не принимаются
+    static constexpr size_t max_number_length = 512;
+
+    explicit Parser(Source source, Builder builder = Builder())
+        : src(std::move(source)), build(std::move(builder)) {}
+
+    // nullptr при ошибке
+    Ptr parse();
+    const std::optional<ParseError> &error() const { return failure; }
+
+private:
+    Source src;
+    Builder build;
+    int depth = 0;
+    std::optional<ParseError> failure;
+
+    void skip_spaces();
+    bool at(char c);
+    bool expect(char c);
+    Ptr fail(ParseErrorKind kind);
+
+    Ptr expression(int min_priority);
+    Ptr unary();
+    Ptr primary();
+    Ptr number();
+    Ptr identifier();
+    Ptr argument();
+};
+
+// Разбор без исключений на пути ошибки — для массовой проверки формул
+template <Numeric T>
+Expected<Expression<T>, ParseError> try_parse(std::string_view text);
+
+// То же, ошибка бросается как std::runtime_error с текстом ParseError::message()
+template <Numeric T>
+Expression<T> make_expression(std::string_view text);
+
+inline std::string ParseError::message() const
+{
+    std::string what;
+    switch (kind)
     {
-        if (c == ' ')
-            continue;
-        if (std::isalpha(c))
-            s += std::tolower(c);
-        else
-            s += c;
-    }
-    std::stack<Expression<T>> vals;
-    std::stack<char> ops;
-
-    std::map<std::string, std::function<Expression<T>(Expression<T>)>>
-        functions = {
-            {"sin", [](Expression<T> arg)
-             {
-                 return arg.sin();
-             }},
-            {"cos", [](Expression<T> arg)
-             {
-                 return arg.cos();
-             }},
-            {"ln", [](Expression<T> arg)
-             {
-                 return arg.ln();
-             }},
-            {"exp", [](Expression<T> arg)
-             {
-                 return arg.exp();
-             }}};
-
-    for (int i = 0; i < (int)s.size(); ++i)
+    case ParseErrorKind::UnexpectedEnd:
+        what = "Unexpected end of expression";
+        break;
+    case ParseErrorKind::UnexpectedCharacter:
+        what = std::string("Unexpected '") + found + "'";
+        break;
+    case ParseErrorKind::ExpectedParen:
+        what = "Expected ')'";
+        break;
+    case ParseErrorKind::ExpectedArgumentParen:
+        what = "Expected '(' after function name";
+        break;
+    case ParseErrorKind::EmptyArgument:
+        what = "Expected argument";
+        break;
+    case ParseErrorKind::InvalidNumber:
+        what = "Expected number";
+        break;
+    case ParseErrorKind::TooDeep:
+        what = "Expression is nested too deeply";
+        break;
+    case ParseErrorKind::InputError:
+        what = "Cannot read input";
+        break;
+    }
+    return what + " at position " + std::to_string(offset);
+}
+
+template <Numeric T, typename Source, typename Builder>
+void Parser<T, Source, Builder>::skip_spaces()
+{
+    while (!src.at_end() && std::isspace((unsigned char)src.peek()))
+        src.advance();
+}
+
+template <Numeric T, typename Source, typename Builder>
+bool Parser<T, Source, Builder>::at(char c)
+{
+    skip_spaces();
+    return !src.at_end() && src.peek() == c;
+}
+
+template <Numeric T, typename Source, typename Builder>
+bool Parser<T, Source, Builder>::expect(char c)
+{
+    if (!at(c))
+        return false;
+    src.advance();
+    return true;
+}
+
+template <Numeric T, typename Source, typename Builder>
+typename Parser<T, Source, Builder>::Ptr Parser<T, Source, Builder>::fail(ParseErrorKind kind)
+{
+    if (!failure)
+        failure = ParseError{kind, src.offset(), src.at_end() ? '\0' : src.peek()};
+    return nullptr;
+}
+
+template <Numeric T, typename Source, typename Builder>
+typename Parser<T, Source, Builder>::Ptr Parser<T, Source, Builder>::parse()
+{
+    Ptr result = expression(1);
+    if (result)
+    {
+        skip_spaces();
+        if (!src.at_end())
+            result = fail(ParseErrorKind::UnexpectedCharacter);
+    }
+    // Оборванное чтение выглядит как конец ввода: сообщаем настоящую причину
+    if (src.failed())
     {
-        if (s[i] == ' ')
-            continue;
+        failure = ParseError{ParseErrorKind::InputError, src.offset()};
+        return nullptr;
+    }
+    return result;
+}
 
-        if (std::isdigit(s[i]))
-        {
-            std::string num = "";
-            while (i < (int)s.size() && (std::isdigit(s[i]) || s[i] == '.'))
-            {
-                num += s[i];
-                i++;
-            }
-            --i;
-            vals.push(Expression<T>(std::stold(num)));
-        }
+// Правые операнды разбираются с приоритетом на единицу выше: a - b - c = (a - b) - c
+template <Numeric T, typename Source, typename Builder>
+typename Parser<T, Source, Builder>::Ptr Parser<T, Source, Builder>::expression(int min_priority)
+{
+    if (depth >= max_depth)
+        return fail(ParseErrorKind::TooDeep);
+    ++depth;
+    Ptr left = unary();
+    while (left)
+    {
+        skip_spaces();
+        if (src.at_end() || !is_operator(src.peek()) || priority(src.peek()) < min_priority)
+            break;
+        char op = src.peek();
+        src.advance();
+        Ptr right = expression(priority(op) + 1);
+        left = right ? build.binary(binary_type(op), std::move(left), std::move(right)) : nullptr;
+    }
+    --depth;
+    return left;
+}
 
-        else if (std::isalpha(s[i]))
-        {
-            std::string token = "";
-            while (i < s.size() && std::isalpha(s[i]))
-            {
-                token += s[i];
-                i++;
-            }
+template <Numeric T, typename Source, typename Builder>
+typename Parser<T, Source, Builder>::Ptr Parser<T, Source, Builder>::unary()
+{
+    if (!at('-'))
+        return primary();
+    src.advance();
+    Ptr operand = expression(priority('^'));
+    if (!operand)
+        return nullptr;
+    return build.binary(ExprType::Multiply, build.constant(T(-1)), std::move(operand));
+}
 
-            if (functions.count(token))
-            {
-                if (s[i] != '(')
-                {
-                    throw std::runtime_error("Expected '('");
-                }
-                std::string arg = "";
-                int balance = 1;
-                ++i;
-                while (i < s.size() && balance > 0)
-                {
-                    if (s[i] == '(')
-                        balance++;
-                    if (s[i] == ')')
-                        balance--;
-                    if (balance > 0)
-                        arg += s[i];
-                    ++i;
-                }
-                --i;
-                if (arg.empty())
-                    throw std::runtime_error("Expected argument\n");
-                auto expr_arg = make_expression<T>(arg);
-                vals.push(functions[token](expr_arg));
-            }
-            else
-            {
-                --i;
-                vals.push(Expression<T>(token));
-            }
-        }
-        else if (is_operator(s[i]))
-        {
-            if (i == 0 || is_operator(s[i - 1]))
-            {
-                if (s[i] == '-')
-                {
-                    std::string tmp = "";
-                    while (i < s.size() && !is_operator(s[i]))
-                    {
-                        tmp += s[i];
-                        i++;
-                    }
-                    --i;
-                    vals.push(Expression<T>(-1) * make_expression<T>(tmp));
-                }
-                else
-                {
-                    throw std::runtime_error("Incorrect expression");
-                }
-            }
-            else
-            {
-                while (!ops.empty() && priority(ops.top()) >= priority(s[i]))
-                {
-                    char op = ops.top();
-                    ops.pop();
-
-                    auto right = vals.top();
-                    vals.pop();
-                    auto left = vals.top();
-                    vals.pop();
-
-                    if (op == '+')
-                        vals.push(left + right);
-                    if (op == '-')
-                        vals.push(left - right);
-                    if (op == '*')
-                        vals.push(left * right);
-                    if (op == '/')
-                        vals.push(left / right);
-                    if (op == '^')
-                        vals.push(left ^ right);
-                }
-                ops.push(s[i]);
-            }
-        }
-        else if (s[i] == '(')
-        {
-            ops.push(s[i]);
-        }
+template <Numeric T, typename Source, typename Builder>
+typename Parser<T, Source, Builder>::Ptr Parser<T, Source, Builder>::primary()
+{
+    skip_spaces();
+    if (src.at_end())
+        return fail(ParseErrorKind::UnexpectedEnd);
+    char c = src.peek();
+    if (std::isdigit((unsigned char)c) || c == '.')
+        return number();
+    if (std::isalpha((unsigned char)c))
+        return identifier();
+    if (c != '(')
+        return fail(ParseErrorKind::UnexpectedCharacter);
+    src.advance();
+    Ptr inner = expression(1);
+    if (inner && !expect(')'))
+        return fail(ParseErrorKind::ExpectedParen);
+    return inner;
+}
 
-        else if (s[i] == ')')
+// Для Complex число с суффиксом i — мнимая константа: 2 + 3.5i
+template <Numeric T, typename Source, typename Builder>
+typename Parser<T, Source, Builder>::Ptr Parser<T, Source, Builder>::number()
+{
+    std::conditional_t<std::is_floating_point_v<T>, T, Real> value;
+    size_t n = lex_number(src.lookahead(max_number_length), value);
+    if (n == 0 || n == max_number_length)
+        return fail(ParseErrorKind::InvalidNumber);
+    src.advance(n);
+    if constexpr (std::is_same_v<T, Complex>)
+    {
+        std::string_view next = src.lookahead(2);
+        bool suffix = !next.empty() && next[0] == 'i' &&
+                      !(next.size() > 1 && (std::isalnum((unsigned char)next[1]) || next[1] == '_'));
+        if (suffix)
         {
-            while (!ops.empty() && ops.top() != '(')
-            {
-                char op = ops.top();
-                ops.pop();
-
-                Expression<T> right = vals.top();
-                vals.pop();
-                Expression<T> left = vals.top();
-                vals.pop();
-
-                if (op == '+')
-                    vals.push(left + right);
-                else if (op == '-')
-                    vals.push(left - right);
-                else if (op == '*')
-                    vals.push(left * right);
-                else if (op == '/')
-                    vals.push(left / right);
-                else if (op == '^')
-                    vals.push(left ^ right);
-            }
-            ops.pop();
+            src.advance();
+            return build.constant(Complex(0, value));
         }
     }
+    return build.constant(T(value));
+}
+
+template <Numeric T, typename Source, typename Builder>
+typename Parser<T, Source, Builder>::Ptr Parser<T, Source, Builder>::identifier()
+{
+    std::string name;
+    while (!src.at_end() && (std::isalnum((unsigned char)src.peek()) || src.peek() == '_'))
+    {
+        name += std::tolower((unsigned char)src.peek());
+        src.advance();
+    }
 
-    while (!ops.empty())
+    if (auto type = builtin_function(name))
     {
-        char op = ops.top();
-        ops.pop();
-
-        Expression<T> right = vals.top();
-        vals.pop();
-        Expression<T> left = vals.top();
-        vals.pop();
-
-        if (op == '+')
-            vals.push(left + right);
-        else if (op == '-')
-            vals.push(left - right);
-        else if (op == '*')
-            vals.push(left * right);
-        else if (op == '/')
-            vals.push(left / right);
-        else if (op == '^')
-            vals.push(left ^ right);
-    }
-
-    return vals.top();
+        Ptr arg = argument();
+        return arg ? build.function(*type, std::move(arg)) : nullptr;
+    }
+    if (auto builder = find_function<T>(name))
+    {
+        Ptr arg = argument();
+        return arg ? build.call(*builder, std::move(arg)) : nullptr;
+    }
+    return build.variable(std::move(name));
+}
+
+// '(' expr ')' после имени функции
+template <Numeric T, typename Source, typename Builder>
+typename Parser<T, Source, Builder>::Ptr Parser<T, Source, Builder>::argument()
+{
+    if (!at('('))
+        return fail(ParseErrorKind::ExpectedArgumentParen);
+    src.advance();
+    if (at(')'))
+        return fail(ParseErrorKind::EmptyArgument);
+    Ptr arg = expression(1);
+    if (arg && !expect(')'))
+        return fail(ParseErrorKind::ExpectedParen);
+    return arg;
+}
+
+template <Numeric T>
+typename TreeBuilder<T>::Ptr TreeBuilder<T>::binary(ExprType type, Ptr l, Ptr r)
+{
+    switch (type)
+    {
+    case ExprType::Add:
+    case ExprType::Subtract:
+        return del_zero(type, std::move(l), std::move(r));
+    case ExprType::Multiply:
+        return del_mult(type, std::move(l), std::move(r));
+    case ExprType::Divide:
+        return del_div(type, std::move(l), std::move(r));
+    default:
+        return del_pow(type, std::move(l), std::move(r));
+    }
+}
+
+template <Numeric T>
+class FunctionRegistry
+{
+public:
+    static FunctionRegistry &instance()
+    {
+        static FunctionRegistry registry;
+        return registry;
+    }
+
+    void define(std::string name, FunctionBuilder<T> builder)
+    {
+        for (char &ch : name)
+            ch = std::tolower((unsigned char)ch);
+        if (name.empty() || !std::isalpha((unsigned char)name[0]) ||
+            !std::all_of(name.begin(), name.end(), [](char ch) { return std::isalnum((unsigned char)ch) || ch == '_'; }))
+            throw std::runtime_error("Invalid function name '" + name + "'");
+        if (builtin_function(name))
+            throw std::runtime_error("Function '" + name + "' is already defined");
+
+        std::unique_lock lock(mutex);
+        if (!functions.emplace(name, std::move(builder)).second)
+            throw std::runtime_error("Function '" + name + "' is already defined");
+    }
+
+    // Записи не удаляются и не меняются, поэтому указатель действителен и после снятия блокировки
+    const FunctionBuilder<T> *find(std::string_view name) const
+    {
+        std::shared_lock lock(mutex);
+        auto it = functions.find(name);
+        return it == functions.end() ? nullptr : &it->second;
+    }
+
+private:
+    mutable std::shared_mutex mutex;
+    std::map<std::string, FunctionBuilder<T>, std::less<>> functions;
+};
+
+template <Numeric T>
+void define_function(std::string_view name, FunctionBuilder<T> builder)
+{
+    FunctionRegistry<T>::instance().define(std::string(name), std::move(builder));
+}
+
+template <Numeric T>
+void define_function(std::string_view name, std::string_view param, std::string_view body)
+{
+    auto tree = make_expression<T>(body).getRoot();
+    std::string var(param);
+    for (char &ch : var)
+        ch = std::tolower((unsigned char)ch);
+    define_function<T>(name, [tree, var](std::shared_ptr<Node<T>> arg) { return substitute(tree, {{var, arg}}); });
+}
+
+template <Numeric T>
+const FunctionBuilder<T> *find_function(std::string_view name)
+{
+    return FunctionRegistry<T>::instance().find(name);
+}
+
+template <Numeric T>
+Expected<Expression<T>, ParseError> try_parse(std::string_view text)
+{
+    Parser<T> parser(text);
+    auto root = parser.parse();
+    if (!root)
+        return *parser.error();
+    return Expression<T>(root);
+}
+
+template <Numeric T>
+Expression<T> make_expression(std::string_view text)
+{
+    auto result = try_parse<T>(text);
+    if (!result)
+        throw std::runtime_error(result.error().message());
+    return std::move(*result);
 }
 
 #endif // Expression_HPP
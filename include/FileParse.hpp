@@ -0,0 +1,177 @@
+#ifndef FileParse_HPP
+#define FileParse_HPP
+
+#include "Expression.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+=====================
+PARSING FROM FILES
+=====================
+*/
+
+// Источник для Parser, читающий дескриптор блоками через read(2): в памяти держится
+// только окно буфера, поэтому формула может быть больше памяти под текст.
+// Подходит для каналов и сокетов, где mmap недоступен
+class FdSource
+{
+public:
+    explicit FdSource(int fd, size_t capacity = 1 << 16);
+
+    bool at_end() { return !fill(1); }
+    char peek() const { return buffer[pos]; }
+    void advance(size_t n = 1);
+    size_t offset() const { return consumed + pos; }
+    std::string_view lookahead(size_t n);
+    bool failed() const { return error != 0; }
+    int getErrno() const { return error; }
+
+private:
+    int fd;
+    std::vector<char> buffer;
+    size_t pos = 0;      // текущий символ в буфере
+    size_t size = 0;     // прочитано в буфер
+    size_t consumed = 0; // байт до начала буфера
+    bool eof = false;
+    int error = 0;
+
+    // Дочитывает, пока в буфере нет n символов от pos; false, если ввод кончился раньше
+    bool fill(size_t n);
+};
+
+// Файл, отображённый в память только для чтения; пустой файл даёт пустой текст
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &path);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool is_open() const { return opened; }
+    std::string_view text() const { return {data, length}; }
+
+private:
+    const char *data = nullptr;
+    size_t length = 0;
+    bool opened = false;
+};
+
+// Разбор формулы из дескриптора без чтения всего текста в память
+template <Numeric T = Real>
+Expected<Expression<T>, ParseError> try_parse_fd(int fd, size_t capacity = 1 << 16);
+
+// Разбор формулы из файла: обычный файл отображается в память, остальное
+// (каналы, /dev/stdin) читается через FdSource. Файл не открылся — InputError
+template <Numeric T = Real>
+Expected<Expression<T>, ParseError> try_parse_file(const std::string &path);
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+inline FdSource::FdSource(int fd, size_t capacity) : fd(fd), buffer(std::max<size_t>(capacity, 2)) {}
+
+inline bool FdSource::fill(size_t n)
+{
+    while (size - pos < n && !eof && !error)
+    {
+        // Прочитанное сдвигается в начало, чтобы окно не росло
+        if (pos > 0)
+        {
+            std::copy(buffer.begin() + pos, buffer.begin() + size, buffer.begin());
+            consumed += pos;
+            size -= pos;
+            pos = 0;
+        }
+        ssize_t got = ::read(fd, buffer.data() + size, buffer.size() - size);
+        if (got > 0)
+            size += got;
+        else if (got == 0)
+            eof = true;
+        else if (errno != EINTR)
+            error = errno;
+    }
+    return size - pos >= n;
+}
+
+inline void FdSource::advance(size_t n)
+{
+    fill(n);
+    pos = std::min(pos + n, size);
+}
+
+inline std::string_view FdSource::lookahead(size_t n)
+{
+    // Заглядывание длиннее буфера (число у его края) расширяет буфер; Parser
+    // просит не больше max_number_length символов
+    if (n > buffer.size())
+        buffer.resize(n);
+    fill(n);
+    return std::string_view(buffer.data() + pos, std::min(n, size - pos));
+}
+
+inline MappedFile::MappedFile(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat info;
+    if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+    {
+        length = info.st_size;
+        if (length == 0)
+            opened = true;
+        else
+        {
+            void *mapped = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED)
+            {
+                ::madvise(mapped, length, MADV_SEQUENTIAL);
+                data = static_cast<const char *>(mapped);
+                opened = true;
+            }
+            else
+                length = 0;
+        }
+    }
+    ::close(fd);
+}
+
+inline MappedFile::~MappedFile()
+{
+    if (data)
+        ::munmap(const_cast<char *>(data), length);
+}
+
+template <Numeric T>
+Expected<Expression<T>, ParseError> try_parse_fd(int fd, size_t capacity)
+{
+    Parser<T, FdSource> parser{FdSource(fd, capacity)};
+    auto root = parser.parse();
+    if (!root)
+        return *parser.error();
+    return Expression<T>(root);
+}
+
+template <Numeric T>
+Expected<Expression<T>, ParseError> try_parse_file(const std::string &path)
+{
+    {
+        MappedFile file(path);
+        if (file.is_open())
+            return try_parse<T>(file.text());
+    }
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return ParseError{ParseErrorKind::InputError, 0};
+    auto result = try_parse_fd<T>(fd);
+    ::close(fd);
+    return result;
+}
+
+#endif // FileParse_HPP
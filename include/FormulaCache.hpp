@@ -0,0 +1,181 @@
+#ifndef FormulaCache_HPP
+#define FormulaCache_HPP
+
+#include "CompiledExpression.hpp"
+#include <list>
+#include <mutex>
+
+/*
+=====================
+FORMULA CACHE
+=====================
+*/
+
+// Разобранная и скомпилированная формула; после вставки в кэш не меняется
+template <Numeric T = Real>
+struct CachedFormula
+{
+    Expression<T> expression;
+    CompiledExpression<T> compiled;
+    size_t bytes = 0; // оценка занимаемой памяти, по ней считается бюджет кэша
+
+    explicit CachedFormula(Expression<T> expr);
+};
+
+struct FormulaCacheStats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+// Потокобезопасный LRU-кэш "текст формулы -> CachedFormula" с бюджетом в байтах.
+// Ключ — нормализованный текст: регистр букв в именах не важен, пробелы между знаками
+// убираются, а рядом с именем или числом схлопываются в один ("1e -5" не станет 1e-5).
+// Поэтому "Sin( X ) * y" и "sin( x )*Y" дают одну запись. Ключ служит только для поиска:
+// при промахе разбирается сам текст, и позиции ошибок указывают в него.
+// Разбор и компиляция идут вне блокировки; ошибки разбора не кэшируются
+template <Numeric T = Real>
+class FormulaCache
+{
+public:
+    using Entry = std::shared_ptr<const CachedFormula<T>>;
+
+    explicit FormulaCache(size_t byte_budget = 64u << 20) : budget(byte_budget) {}
+
+    Expected<Entry, ParseError> get(std::string_view text);
+
+    FormulaCacheStats stats() const;
+    size_t getBudget() const { return budget; }
+    void clear();
+
+    static std::string normalize_key(std::string_view text);
+
+private:
+    using Item = std::pair<std::string, Entry>;
+
+    size_t budget;
+    mutable std::mutex mutex;
+    std::list<Item> order; // в начале — недавно использованные
+    std::unordered_map<std::string, typename std::list<Item>::iterator> index;
+    FormulaCacheStats counters;
+
+    void insert(std::string key, const Entry &entry);
+};
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+template <Numeric T>
+CachedFormula<T>::CachedFormula(Expression<T> expr) : expression(std::move(expr)), compiled(expression)
+{
+    // Узел дерева — объект с виртуальной таблицей и shared_ptr на детей, ячейка ленты —
+    // инструкция, значение и служебные флаги
+    bytes = sizeof(*this) + count_nodes(expression.getRoot()) * 64 +
+            compiled.size() * (sizeof(Instruction) + sizeof(T) + 2 * sizeof(int)) +
+            compiled.constant_values().size() * sizeof(T);
+    for (const auto &name : compiled.variables())
+        bytes += sizeof(std::string) + name.size();
+}
+
+template <Numeric T>
+std::string FormulaCache<T>::normalize_key(std::string_view text)
+{
+    // Одинаковый ключ должен означать одинаковый разбор. Parser приводит к нижнему
+    // регистру только имена, в числах регистр важен (суффикс i у Complex)
+    auto word = [](char c) { return std::isalnum((unsigned char)c) || c == '_' || c == '.'; };
+    std::string key;
+    key.reserve(text.size());
+    bool space = false, name = false;
+    for (char c : text)
+    {
+        if (std::isspace((unsigned char)c))
+        {
+            space = true;
+            continue;
+        }
+        if (space && !key.empty() && (word(key.back()) || word(c)))
+            key += ' ';
+        space = false;
+        // Имя начинается с буквы, перед которой нет цифры или другого имени
+        if (std::isalpha((unsigned char)c))
+            name = name || key.empty() || !word(key.back());
+        else if (!std::isalnum((unsigned char)c) && c != '_')
+            name = false;
+        key += name ? (char)std::tolower((unsigned char)c) : c;
+    }
+    return key;
+}
+
+template <Numeric T>
+Expected<typename FormulaCache<T>::Entry, ParseError> FormulaCache<T>::get(std::string_view text)
+{
+    std::string key = normalize_key(text);
+    {
+        std::lock_guard lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            ++counters.hits;
+            order.splice(order.begin(), order, it->second);
+            return it->second->second;
+        }
+        ++counters.misses;
+    }
+
+    auto parsed = try_parse<T>(text);
+    if (!parsed)
+        return parsed.error();
+    Entry entry = std::make_shared<const CachedFormula<T>>(std::move(*parsed));
+    insert(std::move(key), entry);
+    return entry;
+}
+
+template <Numeric T>
+void FormulaCache<T>::insert(std::string key, const Entry &entry)
+{
+    size_t bytes = entry->bytes + key.size();
+    if (bytes > budget)
+        return;
+
+    std::lock_guard lock(mutex);
+    // Другой поток мог успеть разобрать ту же формулу
+    if (index.count(key))
+        return;
+    while (counters.bytes + bytes > budget)
+    {
+        auto &victim = order.back();
+        counters.bytes -= victim.second->bytes + victim.first.size();
+        index.erase(victim.first);
+        order.pop_back();
+        ++counters.evictions;
+    }
+    order.emplace_front(std::move(key), entry);
+    index.emplace(order.front().first, order.begin());
+    counters.bytes += bytes;
+    counters.entries = order.size();
+}
+
+template <Numeric T>
+FormulaCacheStats FormulaCache<T>::stats() const
+{
+    std::lock_guard lock(mutex);
+    FormulaCacheStats result = counters;
+    result.entries = order.size();
+    return result;
+}
+
+template <Numeric T>
+void FormulaCache<T>::clear()
+{
+    std::lock_guard lock(mutex);
+    order.clear();
+    index.clear();
+    counters.bytes = 0;
+    counters.entries = 0;
+}
+
+#endif // FormulaCache_HPP
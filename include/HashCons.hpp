@@ -0,0 +1,239 @@
+#ifndef HashCons_HPP
+#define HashCons_HPP
+
+#include "Expression.hpp"
+#include <unordered_map>
+
+/*
+=====================
+HASH CONSING
+=====================
+*/
+
+// Таблица уникальных узлов: структурно равные поддеревья отображаются в один узел.
+// Для + и * порядок аргументов не важен: y*x найдёт уже записанный x*y.
+template <Numeric T = Real>
+class HashCons
+{
+public:
+    using Ptr = std::shared_ptr<Node<T>>;
+
+    // Канонический узел для поддерева; дети канонизируются рекурсивно
+    Ptr intern(const Ptr &node);
+    // То же для многих корней из одной чужой таблицы: общие узлы обходятся один раз
+    Ptr intern(const Ptr &node, std::unordered_map<const Node<T> *, Ptr> &seen) { return intern_impl(node, seen); }
+
+    // Узел op(l, r) / op(arg) из уже канонических детей
+    Ptr intern_binary(ExprType type, const Ptr &l, const Ptr &r);
+    Ptr intern_function(ExprType type, const Ptr &arg);
+    Ptr intern_const(T value);
+    Ptr intern_var(const std::string &name);
+
+    size_t size() const { return table.size(); }
+
+private:
+    struct Key
+    {
+        ExprType type;
+        int a, b;
+        T value;
+        std::string name;
+
+        bool operator==(const Key &other) const
+        {
+            return type == other.type && a == other.a && b == other.b && same_value(value, other.value) &&
+                   name == other.name;
+        }
+
+        // -0 и 0 — разные константы (0^-1 = inf, (-0)^-1 = -inf), как в CompiledExpression::constant_key
+        static bool same_value(T x, T y)
+        {
+            if constexpr (std::is_same_v<T, Complex>)
+                return x == y && std::signbit(x.real()) == std::signbit(y.real()) &&
+                       std::signbit(x.imag()) == std::signbit(y.imag());
+            else
+                return x == y && std::signbit(x) == std::signbit(y);
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const;
+    };
+
+    std::unordered_map<Key, Ptr, KeyHash> table;
+    std::unordered_map<const Node<T> *, int> ids; // канонический узел -> номер
+
+    Ptr intern_impl(const Ptr &node, std::unordered_map<const Node<T> *, Ptr> &seen);
+    template <typename Create>
+    Ptr lookup(Key &&key, Create &&create);
+    int id(const Ptr &node) const { return ids.at(node.get()); }
+};
+
+// Построитель узлов для Parser прямо в таблице: промежуточного дерева нет, а узел,
+// уже записанный в таблицу, не создаётся заново. Упрощения те же, что у TreeBuilder
+template <Numeric T>
+class HashConsBuilder
+{
+public:
+    using Ptr = std::shared_ptr<Node<T>>;
+
+    explicit HashConsBuilder(HashCons<T> &store) : store(store) {}
+
+    Ptr constant(T value) { return store.intern_const(value); }
+    Ptr variable(std::string name) { return store.intern_var(name); }
+    Ptr function(ExprType type, Ptr arg) { return store.intern_function(type, arg); }
+    Ptr call(const FunctionBuilder<T> &builder, Ptr arg) { return store.intern(builder(std::move(arg))); }
+    Ptr binary(ExprType type, Ptr l, Ptr r);
+
+private:
+    HashCons<T> &store;
+};
+
+// Разбор сразу в таблицу store: равные поддеревья разных формул — один узел
+template <Numeric T>
+Expected<Expression<T>, ParseError> try_parse_into(HashCons<T> &store, std::string_view text);
+
+// Устранение общих подвыражений: дерево превращается в DAG с общими узлами,
+// CompiledExpression и BatchEvaluator вычисляют такой узел один раз.
+// Копирование Expression снова разворачивает DAG в дерево, результат лучше перемещать
+template <Numeric T>
+Expression<T> cse(const Expression<T> &expr, size_t *removed = nullptr);
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+inline size_t hash_combine(size_t seed, size_t value)
+{
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+template <Numeric T>
+size_t HashCons<T>::KeyHash::operator()(const Key &key) const
+{
+    size_t h = std::hash<int>()((int)key.type);
+    h = hash_combine(h, std::hash<int>()(key.a));
+    h = hash_combine(h, std::hash<int>()(key.b));
+    if constexpr (std::is_same_v<T, Complex>)
+    {
+        h = hash_combine(h, std::hash<Real>()(key.value.real()));
+        h = hash_combine(h, std::hash<Real>()(key.value.imag()));
+    }
+    else
+        h = hash_combine(h, std::hash<T>()(key.value));
+    return hash_combine(h, std::hash<std::string>()(key.name));
+}
+
+template <Numeric T>
+template <typename Create>
+typename HashCons<T>::Ptr HashCons<T>::lookup(Key &&key, Create &&create)
+{
+    auto it = table.find(key);
+    if (it != table.end())
+        return it->second;
+    Ptr node = create();
+    ids[node.get()] = table.size();
+    table.emplace(std::move(key), node);
+    return node;
+}
+
+template <Numeric T>
+typename HashCons<T>::Ptr HashCons<T>::intern_const(T value)
+{
+    return lookup(Key{ExprType::Constant, -1, -1, value, ""}, [&] { return make_const<T>(value); });
+}
+
+template <Numeric T>
+typename HashCons<T>::Ptr HashCons<T>::intern_var(const std::string &name)
+{
+    return lookup(Key{ExprType::Variable, -1, -1, T(0), name},
+                  [&] { return std::static_pointer_cast<Node<T>>(std::make_shared<VarNode<T>>(name)); });
+}
+
+template <Numeric T>
+typename HashCons<T>::Ptr HashCons<T>::intern_binary(ExprType type, const Ptr &l, const Ptr &r)
+{
+    int a = id(l), b = id(r);
+    if (type == ExprType::Add || type == ExprType::Multiply)
+    {
+        auto it = table.find(Key{type, b, a, T(0), ""});
+        if (it != table.end())
+            return it->second;
+    }
+    return lookup(Key{type, a, b, T(0), ""}, [&] { return make<T>(type, l, r); });
+}
+
+template <Numeric T>
+typename HashCons<T>::Ptr HashCons<T>::intern_function(ExprType type, const Ptr &arg)
+{
+    return lookup(Key{type, id(arg), -1, T(0), ""}, [&] { return make_function<T>(type, arg); });
+}
+
+template <Numeric T>
+typename HashCons<T>::Ptr HashCons<T>::intern(const Ptr &node)
+{
+    // Входные узлы запоминаются только на время обхода: после него их адреса могут переиспользоваться
+    std::unordered_map<const Node<T> *, Ptr> seen;
+    return intern_impl(node, seen);
+}
+
+template <Numeric T>
+typename HashCons<T>::Ptr HashCons<T>::intern_impl(const Ptr &node, std::unordered_map<const Node<T> *, Ptr> &seen)
+{
+    auto it = seen.find(node.get());
+    if (it != seen.end())
+        return it->second;
+    if (ids.count(node.get()))
+        return node;
+
+    Ptr result;
+    ExprType type = node->getType();
+    if (type == ExprType::Constant)
+        result = intern_const(static_cast<const ConstNode<T> *>(node.get())->getVal());
+    else if (type == ExprType::Variable)
+        result = intern_var(static_cast<const VarNode<T> *>(node.get())->getName());
+    else if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        Ptr l = intern_impl(bin->getLeft(), seen);
+        Ptr r = intern_impl(bin->getRight(), seen);
+        result = intern_binary(type, l, r);
+    }
+    else
+        result = intern_function(type, intern_impl(static_cast<const FunctionNode<T> *>(node.get())->getArg(), seen));
+
+    seen[node.get()] = result;
+    return result;
+}
+
+// del_* упрощают только при константном операнде; без него узел ищется в таблице без выделения памяти
+template <Numeric T>
+typename HashConsBuilder<T>::Ptr HashConsBuilder<T>::binary(ExprType type, Ptr l, Ptr r)
+{
+    if (l->getType() != ExprType::Constant && r->getType() != ExprType::Constant)
+        return store.intern_binary(type, l, r);
+    return store.intern(TreeBuilder<T>().binary(type, std::move(l), std::move(r)));
+}
+
+template <Numeric T>
+Expected<Expression<T>, ParseError> try_parse_into(HashCons<T> &store, std::string_view text)
+{
+    Parser<T, TextSource, HashConsBuilder<T>> parser(text, HashConsBuilder<T>(store));
+    auto root = parser.parse();
+    if (!root)
+        return *parser.error();
+    return Expression<T>(root);
+}
+
+template <Numeric T>
+Expression<T> cse(const Expression<T> &expr, size_t *removed)
+{
+    HashCons<T> table;
+    auto root = table.intern(expr.getRoot());
+    if (removed)
+        *removed = count_nodes(expr.getRoot()) - count_nodes(root);
+    return Expression<T>(root);
+}
+
+#endif // HashCons_HPP
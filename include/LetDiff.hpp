@@ -0,0 +1,194 @@
+#ifndef LetDiff_HPP
+#define LetDiff_HPP
+
+#include "Expression.hpp"
+#include <utility>
+#include <vector>
+
+/*
+=====================
+LET EXPRESSION
+=====================
+*/
+
+// Последовательность именованных промежуточных значений и итоговое выражение:
+//   t1 = x * y
+//   t2 = cos(t1)
+//   result = t2 * y
+// Каждое связывание ссылается только на переменные и на предыдущие имена.
+template <Numeric T = Real>
+class LetExpression
+{
+private:
+    std::vector<std::pair<std::string, Expression<T>>> lets;
+    Expression<T> result;
+
+public:
+    LetExpression(std::vector<std::pair<std::string, Expression<T>>> lets, Expression<T> result);
+
+    const std::vector<std::pair<std::string, Expression<T>>> &bindings() const { return lets; }
+    const Expression<T> &getResult() const { return result; }
+
+    T eval(const std::map<std::string, T> &vars) const;
+
+    std::string to_string() const;
+
+    // Одно выражение, где каждое имя заменено общим узлом: CompiledExpression
+    // посчитает такой узел один раз, сколько бы раз он ни использовался
+    Expression<T> inline_all() const;
+};
+
+// Дифференцирование с разделением цепного правила: для каждого узла g заводятся
+// имена для g и g', а правила из diff_rules получают аргументы и их производные по именам
+template <Numeric T>
+LetExpression<T> diff_let(const Expression<T> &expr, const std::string &dvar);
+
+template <Numeric T>
+std::ostream &operator<<(std::ostream &out, const LetExpression<T> &let);
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+template <Numeric T>
+LetExpression<T>::LetExpression(std::vector<std::pair<std::string, Expression<T>>> lets, Expression<T> result)
+    : lets(std::move(lets)), result(std::move(result))
+{
+}
+
+template <Numeric T>
+T LetExpression<T>::eval(const std::map<std::string, T> &vars) const
+{
+    std::map<std::string, T> scope = vars;
+    for (const auto &[name, expr] : lets)
+        scope[name] = expr.eval(scope);
+    return result.eval(scope);
+}
+
+template <Numeric T>
+std::string LetExpression<T>::to_string() const
+{
+    std::string out;
+    for (const auto &[name, expr] : lets)
+        out += name + " = " + expr.to_string() + "\n";
+    return out + "result = " + result.to_string();
+}
+
+template <Numeric T>
+Expression<T> LetExpression<T>::inline_all() const
+{
+    std::map<std::string, std::shared_ptr<Node<T>>> repl;
+    for (const auto &[name, expr] : lets)
+        repl[name] = substitute(expr.getRoot(), repl);
+    return Expression<T>(substitute(result.getRoot(), repl));
+}
+
+template <Numeric T>
+std::ostream &operator<<(std::ostream &out, const LetExpression<T> &let)
+{
+    out << let.to_string();
+    return out;
+}
+
+template <Numeric T>
+class LetBuilder
+{
+public:
+    using Ptr = std::shared_ptr<Node<T>>;
+
+    const std::string &dvar;
+    std::set<std::string> taken;
+    std::vector<std::pair<std::string, Ptr>> lets;
+    int counter = 0;
+
+    explicit LetBuilder(const std::string &dvar) : dvar(dvar) {}
+
+    // Нетривиальное выражение получает имя, листья подставляются как есть
+    Ptr bind(Ptr node)
+    {
+        if (node->getType() == ExprType::Constant || node->getType() == ExprType::Variable)
+            return node;
+        std::string name;
+        do
+            name = "t" + std::to_string(++counter);
+        while (taken.count(name));
+        lets.push_back({name, node});
+        return std::make_shared<VarNode<T>>(name);
+    }
+
+    // Пара (значение, производная) для поддерева
+    std::pair<Ptr, Ptr> visit(const Ptr &node)
+    {
+        ExprType type = node->getType();
+        if (type == ExprType::Constant)
+            return {node, make_const<T>(0)};
+        if (type == ExprType::Variable)
+        {
+            bool is_dvar = static_cast<const VarNode<T> *>(node.get())->getName() == dvar;
+            return {node, make_const<T>(is_dvar ? 1 : 0)};
+        }
+        if (is_binary(type))
+        {
+            auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+            auto [va, da] = visit(bin->getLeft());
+            auto [vb, db] = visit(bin->getRight());
+            Ptr value = bind(make<T>(type, va, vb));
+            if (is_zero(da) && is_zero(db))
+                return {value, make_const<T>(0)};
+            DiffContext<T> ctx{va, vb, dvar, da, db};
+            return {value, bind(diff_by_rules<T>(type, ctx))};
+        }
+        auto [va, da] = visit(static_cast<const FunctionNode<T> *>(node.get())->getArg());
+        Ptr value = bind(make_function<T>(type, va));
+        if (is_zero(da))
+            return {value, make_const<T>(0)};
+        DiffContext<T> ctx{va, nullptr, dvar, da, nullptr};
+        return {value, bind(diff_by_rules<T>(type, ctx))};
+    }
+};
+
+template <Numeric T>
+LetExpression<T> diff_let(const Expression<T> &expr, const std::string &dvar)
+{
+    LetBuilder<T> builder{dvar};
+    collect_variables(expr.getRoot(), builder.taken);
+    auto result = builder.visit(expr.getRoot()).second;
+
+    // Производная корня — это и есть результат, отдельное имя ей не нужно
+    if (result->getType() == ExprType::Variable && !builder.lets.empty() &&
+        static_cast<const VarNode<T> *>(result.get())->getName() == builder.lets.back().first)
+    {
+        result = builder.lets.back().second;
+        builder.lets.pop_back();
+    }
+
+    // Убираем неиспользуемые связывания и перенумеровываем оставшиеся по порядку
+    std::set<std::string> used;
+    collect_variables(result, used);
+    std::vector<char> keep(builder.lets.size(), 0);
+    for (size_t k = builder.lets.size(); k-- > 0;)
+        if (used.count(builder.lets[k].first))
+        {
+            keep[k] = 1;
+            collect_variables(builder.lets[k].second, used);
+        }
+
+    std::map<std::string, std::shared_ptr<Node<T>>> rename;
+    std::vector<std::pair<std::string, Expression<T>>> lets;
+    int counter = 0;
+    for (size_t k = 0; k < builder.lets.size(); ++k)
+    {
+        if (!keep[k])
+            continue;
+        std::string name;
+        do
+            name = "t" + std::to_string(++counter);
+        while (builder.taken.count(name));
+        auto node = substitute(builder.lets[k].second, rename);
+        rename[builder.lets[k].first] = std::make_shared<VarNode<T>>(name);
+        lets.push_back({name, Expression<T>(node)});
+    }
+    return LetExpression<T>(std::move(lets), Expression<T>(substitute(result, rename)));
+}
+
+#endif // LetDiff_HPP
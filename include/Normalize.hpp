@@ -0,0 +1,419 @@
+#ifndef Normalize_HPP
+#define Normalize_HPP
+
+#include "HashCons.hpp"
+
+/*
+=====================
+NORMALIZE
+=====================
+*/
+
+// Нормализация всего дерева до неподвижной точки.
+// MathPolicy::Exact — только замены, не меняющие результат ни в одной точке:
+//  - сворачиваются соседние константы: 2 + 3 + x = 5 + x, но x + 0.1 + 0.2 остаётся;
+//  - x / 2^k -> 2^-k * x, константный множитель встаёт слева;
+//  - -1*u превращается в узел Negate, a + -u — в вычитание: a + -1*b = a - b;
+//  - функции и степени от констант вычисляются, для Complex переменная i — константа.
+// MathPolicy::Fast — ещё и цепочки +/- и */÷ разворачиваются, константы в них
+// сворачиваются в одну, одинаковые слагаемые собираются и сокращаются:
+// 2*x + y + 3*x - 1 + 4 = 5*x + y + 3,  x - x = 0,  x / 3 = 0.333333*x.
+// Узлы строятся через HashCons, поэтому результат — DAG без повторов
+template <Numeric T>
+// iterations — число проходов, включая последний, ничего не изменивший
+Expression<T> normalize(const Expression<T> &expr, MathPolicy policy = MathPolicy::Exact,
+                        size_t *iterations = nullptr);
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+template <Numeric T>
+class Normalizer
+{
+public:
+    using Ptr = std::shared_ptr<Node<T>>;
+
+    HashCons<T> table;
+
+    explicit Normalizer(MathPolicy policy = MathPolicy::Exact) : fast(policy == MathPolicy::Fast) {}
+
+    Ptr run(const Ptr &node)
+    {
+        std::unordered_map<const Node<T> *, Ptr> done;
+        return visit(node, done);
+    }
+
+private:
+    bool fast;
+
+    // Слагаемое coef * rest; rest == nullptr означает чистую константу
+    struct Term
+    {
+        T coef;
+        Ptr rest;
+    };
+
+    static bool is_negative(T value)
+    {
+        if constexpr (std::is_same_v<T, Complex>)
+            return value.imag() == 0 && value.real() < 0;
+        else
+            return value < 0;
+    }
+
+    static T value_of(const Ptr &node) { return static_cast<const ConstNode<T> *>(node.get())->getVal(); }
+
+    Ptr constant(T value) { return table.intern_const(value); }
+
+    Ptr visit(const Ptr &node, std::unordered_map<const Node<T> *, Ptr> &done)
+    {
+        auto it = done.find(node.get());
+        if (it != done.end())
+            return it->second;
+
+        Ptr result;
+        ExprType type = node->getType();
+        if (type == ExprType::Constant)
+            result = constant(value_of(node));
+        else if (type == ExprType::Variable)
+        {
+            const auto &name = static_cast<const VarNode<T> *>(node.get())->getName();
+            if (std::is_same_v<T, Complex> && name == "i")
+                result = constant(imaginary_unit<T>());
+            else
+                result = table.intern_var(name);
+        }
+        else if (is_binary(type))
+        {
+            auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+            Ptr l = visit(bin->getLeft(), done);
+            Ptr r = visit(bin->getRight(), done);
+            if (type == ExprType::Add || type == ExprType::Subtract)
+                result = fast ? sum(type, l, r) : exact_sum(type, l, r);
+            else if (type == ExprType::Multiply || type == ExprType::Divide)
+                result = fast ? product(type, l, r) : exact_product(type, l, r);
+            else
+                result = power(l, r);
+        }
+        else
+        {
+            Ptr arg = visit(static_cast<const FunctionNode<T> *>(node.get())->getArg(), done);
+            result = type == ExprType::Negate ? negate(arg) : function(type, arg);
+        }
+        done[node.get()] = result;
+        return result;
+    }
+
+    // Свёртка, которая не должна менять поведение: ошибки и NaN остаются на время вычисления
+    template <typename F>
+    Ptr try_fold(F compute, const std::function<Ptr()> &keep)
+    {
+        try
+        {
+            T value = compute();
+            if (value == value)
+                return constant(value);
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+        return keep();
+    }
+
+    Ptr fold(ExprType type, const Ptr &l, const Ptr &r)
+    {
+        return try_fold([&] { return apply_binary(type, value_of(l), value_of(r)); },
+                        [&] { return table.intern_binary(type, l, r); });
+    }
+
+    Ptr function(ExprType type, const Ptr &arg)
+    {
+        if (arg->getType() == ExprType::Constant)
+            return try_fold([&] { return apply_function(type, value_of(arg)); },
+                            [&] { return table.intern_function(type, arg); });
+        return table.intern_function(type, arg);
+    }
+
+    Ptr power(const Ptr &base, const Ptr &exponent)
+    {
+        if (exponent->getType() == ExprType::Constant)
+        {
+            T p = value_of(exponent);
+            if (p == T(1))
+                return base;
+            if (p == T(0))
+                return constant(T(1));
+            if (base->getType() == ExprType::Constant)
+                return try_fold([&] { return apply_binary(ExprType::Power, value_of(base), p); },
+                                [&] { return table.intern_binary(ExprType::Power, base, exponent); });
+        }
+        return table.intern_binary(ExprType::Power, base, exponent);
+    }
+
+    Ptr negate(const Ptr &arg)
+    {
+        if (fast)
+            return sum(ExprType::Subtract, constant(T(0)), arg);
+        if (arg->getType() == ExprType::Negate)
+            return inner_arg(arg);
+        return function(ExprType::Negate, arg);
+    }
+
+    // x / c = x * (1/c) до бита, только если c — вещественная степень двойки и 1/c конечно.
+    // Для Complex умножение на (1/c, 0) даёт nan там, где деление даёт inf
+    static bool exact_reciprocal(T c)
+    {
+        if constexpr (std::is_same_v<T, Complex>)
+            return false;
+        else
+        {
+            int e;
+            return std::isfinite(c) && std::isfinite(T(1) / c) && std::fabs(std::frexp(c, &e)) == T(0.5);
+        }
+    }
+
+    // Exact: порядок вычисления сохраняется, поэтому сворачиваются только соседние константы
+    Ptr exact_sum(ExprType type, const Ptr &l, const Ptr &r)
+    {
+        if (l->getType() == ExprType::Constant && r->getType() == ExprType::Constant)
+            return fold(type, l, r);
+        if (r->getType() == ExprType::Negate)
+            return table.intern_binary(type == ExprType::Add ? ExprType::Subtract : ExprType::Add, l, inner_arg(r));
+        return table.intern_binary(type, l, r);
+    }
+
+    Ptr exact_product(ExprType type, const Ptr &l, const Ptr &r)
+    {
+        bool left_const = l->getType() == ExprType::Constant;
+        bool right_const = r->getType() == ExprType::Constant;
+        if (left_const && right_const)
+            return fold(type, l, r);
+        if (type == ExprType::Divide)
+        {
+            if (right_const && exact_reciprocal(value_of(r)))
+                return exact_product(ExprType::Multiply, constant(T(1) / value_of(r)), l);
+            return table.intern_binary(type, l, r);
+        }
+        if (right_const)
+            return exact_product(type, r, l);
+        // Для Complex -1*u считает 0*inf и отличается от -u
+        if (left_const && value_of(l) == T(-1) && !std::is_same_v<T, Complex>)
+            return negate(r);
+        return table.intern_binary(type, l, r);
+    }
+
+    // Разложение нормализованного узла на coef * rest
+    Term split(const Ptr &node)
+    {
+        ExprType type = node->getType();
+        if (type == ExprType::Constant)
+            return {value_of(node), nullptr};
+        if (type == ExprType::Negate)
+        {
+            Term inner = split(inner_arg(node));
+            return {-inner.coef, inner.rest};
+        }
+        if (type == ExprType::Multiply)
+        {
+            // HashCons может вернуть ранее записанный узел с константой справа
+            auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+            if (bin->getLeft()->getType() == ExprType::Constant)
+                return {value_of(bin->getLeft()), bin->getRight()};
+            if (bin->getRight()->getType() == ExprType::Constant)
+                return {value_of(bin->getRight()), bin->getLeft()};
+        }
+        return {T(1), node};
+    }
+
+    void flatten_sum(const Ptr &node, T sign, std::vector<Term> &terms)
+    {
+        ExprType type = node->getType();
+        if (type == ExprType::Add || type == ExprType::Subtract)
+        {
+            auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+            flatten_sum(bin->getLeft(), sign, terms);
+            flatten_sum(bin->getRight(), type == ExprType::Add ? sign : -sign, terms);
+            return;
+        }
+        if (type == ExprType::Negate)
+        {
+            flatten_sum(inner_arg(node), -sign, terms);
+            return;
+        }
+        Term term = split(node);
+        terms.push_back({sign * term.coef, term.rest});
+    }
+
+    // coef * rest без знака: знак учитывается вызывающим
+    Ptr scaled(T coef, const Ptr &rest)
+    {
+        if (coef == T(1))
+            return rest;
+        return table.intern_binary(ExprType::Multiply, constant(coef), rest);
+    }
+
+    Ptr sum(ExprType type, const Ptr &l, const Ptr &r)
+    {
+        std::vector<Term> raw;
+        flatten_sum(l, T(1), raw);
+        flatten_sum(r, type == ExprType::Add ? T(1) : T(-1), raw);
+
+        // Константы складываются, одинаковые (после HashCons — равные по указателю) слагаемые собираются
+        T c = T(0);
+        std::vector<Term> terms;
+        std::unordered_map<const Node<T> *, size_t> index;
+        for (const auto &term : raw)
+        {
+            if (!term.rest)
+            {
+                c = c + term.coef;
+                continue;
+            }
+            auto it = index.find(term.rest.get());
+            if (it == index.end())
+            {
+                index[term.rest.get()] = terms.size();
+                terms.push_back(term);
+            }
+            else
+                terms[it->second].coef = terms[it->second].coef + term.coef;
+        }
+
+        std::vector<Ptr> plus, minus;
+        for (const auto &term : terms)
+        {
+            if (term.coef == T(0))
+                continue;
+            if (is_negative(term.coef))
+                minus.push_back(scaled(-term.coef, term.rest));
+            else
+                plus.push_back(scaled(term.coef, term.rest));
+        }
+
+        Ptr result;
+        for (const auto &p : plus)
+            result = result ? table.intern_binary(ExprType::Add, result, p) : p;
+        if (!result)
+        {
+            // Только вычитаемые: c - a - b или -(a + b)
+            if (!(c == T(0)) || minus.empty())
+            {
+                result = constant(c);
+                c = T(0);
+            }
+            else
+            {
+                Ptr all = minus[0];
+                for (size_t k = 1; k < minus.size(); ++k)
+                    all = table.intern_binary(ExprType::Add, all, minus[k]);
+                return table.intern_function(ExprType::Negate, all);
+            }
+        }
+        for (const auto &m : minus)
+            result = table.intern_binary(ExprType::Subtract, result, m);
+        if (!(c == T(0)))
+            result = is_negative(c) ? table.intern_binary(ExprType::Subtract, result, constant(-c))
+                                    : table.intern_binary(ExprType::Add, result, constant(c));
+        return result;
+    }
+
+    // Множители числителя и знаменателя; константы сворачиваются в coef,
+    // кроме нуля в знаменателе: деление на него должно бросить при вычислении
+    void flatten_product(const Ptr &node, bool denominator, T &coef, std::vector<Ptr> &num, std::vector<Ptr> &den)
+    {
+        ExprType type = node->getType();
+        if (type == ExprType::Constant)
+        {
+            T value = value_of(node);
+            if (denominator && value == T(0))
+                den.push_back(node);
+            else
+                coef = denominator ? coef / value : coef * value;
+            return;
+        }
+        if (type == ExprType::Negate)
+        {
+            coef = -coef;
+            flatten_product(inner_arg(node), denominator, coef, num, den);
+            return;
+        }
+        if (type == ExprType::Multiply)
+        {
+            auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+            flatten_product(bin->getLeft(), denominator, coef, num, den);
+            flatten_product(bin->getRight(), denominator, coef, num, den);
+            return;
+        }
+        // Делители внутри знаменателя не переворачиваются: a / (b / c) может бросать при c = 0
+        if (type == ExprType::Divide && !denominator)
+        {
+            auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+            flatten_product(bin->getLeft(), false, coef, num, den);
+            flatten_product(bin->getRight(), true, coef, num, den);
+            return;
+        }
+        (denominator ? den : num).push_back(node);
+    }
+
+    Ptr product(ExprType type, const Ptr &l, const Ptr &r)
+    {
+        // Деление на нулевую константу оставляем: оно должно бросить при вычислении
+        if (type == ExprType::Divide && is_zero(r))
+            return table.intern_binary(type, l, r);
+
+        T coef = T(1);
+        std::vector<Ptr> num, den;
+        flatten_product(l, false, coef, num, den);
+        flatten_product(r, type == ExprType::Divide, coef, num, den);
+        if (coef == T(0) && den.empty())
+            return constant(T(0));
+        if (!(coef == coef))
+            return table.intern_binary(type, l, r);
+
+        // Множитель -1 становится узлом Negate, остальные константы стоят слева
+        bool negate = coef == T(-1) && !num.empty();
+        Ptr top;
+        for (const auto &f : num)
+            top = top ? table.intern_binary(ExprType::Multiply, top, f) : f;
+        if (!top)
+            top = constant(coef);
+        else if (!negate)
+            top = scaled(coef, top);
+
+        Ptr result = top;
+        if (!den.empty())
+        {
+            Ptr bottom = den[0];
+            for (size_t k = 1; k < den.size(); ++k)
+                bottom = table.intern_binary(ExprType::Multiply, bottom, den[k]);
+            result = table.intern_binary(ExprType::Divide, top, bottom);
+        }
+        if (!negate)
+            return result;
+        return table.intern_function(ExprType::Negate, result);
+    }
+};
+
+template <Numeric T>
+Expression<T> normalize(const Expression<T> &expr, MathPolicy policy, size_t *iterations)
+{
+    Normalizer<T> normalizer(policy);
+    auto root = normalizer.run(expr.getRoot());
+    size_t count = 1;
+
+    // Каждый проход строит узлы в той же таблице: неподвижная точка — тот же указатель
+    while (count < 16)
+    {
+        auto next = normalizer.run(root);
+        ++count;
+        if (next == root)
+            break;
+        root = next;
+    }
+    if (iterations)
+        *iterations = count;
+    return Expression<T>(root);
+}
+
+#endif // Normalize_HPP
@@ -0,0 +1,149 @@
+#ifndef PassManager_HPP
+#define PassManager_HPP
+
+#include "EGraph.hpp"
+#include "Normalize.hpp"
+#include "Polynomial.hpp"
+#include "StrengthReduce.hpp"
+#include <chrono>
+#include <sstream>
+
+/*
+=====================
+PASS MANAGER
+=====================
+*/
+
+template <Numeric T = Real>
+struct Pass
+{
+    std::string name;
+    std::function<Expression<T>(const Expression<T> &)> run;
+};
+
+struct PassStats
+{
+    std::string name;
+    double millis = 0;
+    size_t nodes_before = 0; // различных узлов до прохода (общие узлы DAG считаются один раз)
+    size_t nodes_after = 0;
+};
+
+// Проход по имени:
+//   normalize            — свёртка соседних констант и нормализация, MathPolicy::Exact
+//   normalize-fast       — то же с перестановкой констант и сбором слагаемых, MathPolicy::Fast
+//   horner               — многочлены в форме Горнера (меняет округление, только для -O3)
+//   strength-reduce      — понижение стоимости, MathPolicy::Exact
+//   strength-reduce-fast — то же, MathPolicy::Fast
+//   egraph               — насыщение равенств и извлечение по стоимости
+//   cse                  — устранение общих подвыражений
+template <Numeric T>
+Pass<T> make_pass(const std::string &name);
+
+// Последовательность проходов. Уровни:
+//   -O0 — ничего;  -O1 — normalize, strength-reduce;
+//   -O2 — normalize, strength-reduce, cse;
+//   -O3 — normalize-fast, egraph, horner, strength-reduce-fast, cse.
+// -O1 и -O2 сохраняют результат в каждой точке до бита, включая inf, nan, знак нуля
+// и исключения: их проходы работают с MathPolicy::Exact, а cse различает -0 и 0.
+// -O3 (MathPolicy::Fast) меняет округление, а там, где исходное выражение не конечно, —
+// и сам результат.
+// cse всегда последний: копирование Expression снова разворачивает DAG
+template <Numeric T = Real>
+class PassManager
+{
+private:
+    std::vector<Pass<T>> passes;
+
+public:
+    PassManager() = default;
+    static PassManager for_level(int level);
+
+    void add(Pass<T> pass) { passes.push_back(std::move(pass)); }
+    void add(const std::string &name) { add(make_pass<T>(name)); }
+    const std::vector<Pass<T>> &getPasses() const { return passes; }
+
+    Expression<T> run(const Expression<T> &expr, std::vector<PassStats> *stats = nullptr) const;
+};
+
+// Таблица "проход, время, узлы до -> после" для --print-passes
+inline std::string format_pass_stats(const std::vector<PassStats> &stats);
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+template <Numeric T>
+Pass<T> make_pass(const std::string &name)
+{
+    if (name == "normalize")
+        return {name, [](const Expression<T> &e) { return normalize(e); }};
+    if (name == "normalize-fast")
+        return {name, [](const Expression<T> &e) { return normalize(e, MathPolicy::Fast); }};
+    if (name == "horner")
+        return {name, [](const Expression<T> &e) { return horner_form(e); }};
+    if (name == "strength-reduce")
+        return {name, [](const Expression<T> &e) { return strength_reduce(e); }};
+    if (name == "strength-reduce-fast")
+        return {name, [](const Expression<T> &e)
+                { return strength_reduce(e, StrengthReduceOptions{MathPolicy::Fast}); }};
+    if (name == "egraph")
+        return {name, [](const Expression<T> &e) { return egraph_optimize(e); }};
+    if (name == "cse")
+        return {name, [](const Expression<T> &e) { return cse(e); }};
+    throw std::runtime_error("Unknown pass '" + name + "'");
+}
+
+template <Numeric T>
+PassManager<T> PassManager<T>::for_level(int level)
+{
+    static const std::vector<std::vector<std::string>> levels = {
+        {},
+        {"normalize", "strength-reduce"},
+        {"normalize", "strength-reduce", "cse"},
+        {"normalize-fast", "egraph", "horner", "strength-reduce-fast", "cse"}};
+    if (level < 0 || level >= (int)levels.size())
+        throw std::runtime_error("Optimisation level must be from 0 to 3");
+
+    PassManager manager;
+    for (const auto &name : levels[level])
+        manager.add(name);
+    return manager;
+}
+
+template <Numeric T>
+Expression<T> PassManager<T>::run(const Expression<T> &expr, std::vector<PassStats> *stats) const
+{
+    // Между проходами передаётся корень, а не копия Expression, чтобы не терять общие узлы
+    auto root = expr.getRoot();
+    for (const auto &pass : passes)
+    {
+        PassStats entry{pass.name};
+        if (stats)
+            entry.nodes_before = count_nodes(root);
+        auto start = std::chrono::steady_clock::now();
+        root = pass.run(Expression<T>(root)).getRoot();
+        auto finish = std::chrono::steady_clock::now();
+        if (stats)
+        {
+            entry.millis = std::chrono::duration<double, std::milli>(finish - start).count();
+            entry.nodes_after = count_nodes(root);
+            stats->push_back(entry);
+        }
+    }
+    return Expression<T>(root);
+}
+
+inline std::string format_pass_stats(const std::vector<PassStats> &stats)
+{
+    std::ostringstream out;
+    for (const auto &entry : stats)
+    {
+        long long delta = (long long)entry.nodes_after - (long long)entry.nodes_before;
+        out << entry.name << ": " << entry.millis << " ms, nodes " << entry.nodes_before << " -> "
+            << entry.nodes_after << " (" << (delta > 0 ? "+" : "") << delta << ")\n";
+    }
+    return out.str();
+}
+
+#endif // PassManager_HPP
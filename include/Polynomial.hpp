@@ -0,0 +1,461 @@
+#ifndef Polynomial_HPP
+#define Polynomial_HPP
+
+#include "EGraph.hpp"
+#include <optional>
+
+/*
+=====================
+POLYNOMIAL
+=====================
+*/
+
+// Разреженный многочлен от нескольких переменных в канонической форме:
+// моном — вектор степеней по variables(), одинаковые мономы собираются в один,
+// нулевые коэффициенты не хранятся
+template <Numeric T = Real>
+class Polynomial
+{
+public:
+    using Monomial = std::vector<unsigned>;
+
+private:
+    std::vector<std::string> vars;
+    std::map<Monomial, T> terms;
+
+    // Сумма термов [begin, end) с общими степенями переменных до v схемой Горнера по v
+    using Iter = typename std::vector<std::pair<Monomial, T>>::const_iterator;
+    T horner(Iter begin, Iter end, size_t v, const std::vector<std::vector<T>> &powers) const;
+    std::shared_ptr<Node<T>> horner_node(Iter begin, Iter end, size_t v) const;
+
+public:
+    explicit Polynomial(std::vector<std::string> vars, T value = T(0));
+
+    // Многочлен, равный одной переменной из vars
+    static Polynomial variable(std::vector<std::string> vars, const std::string &name);
+
+    const std::vector<std::string> &variables() const { return vars; }
+    const std::map<Monomial, T> &getTerms() const { return terms; }
+    size_t size() const { return terms.size(); }
+    unsigned degree() const;
+
+    void add_term(const Monomial &monomial, T coefficient);
+
+    Polynomial operator+(const Polynomial &other) const;
+    Polynomial operator-(const Polynomial &other) const;
+    Polynomial operator*(const Polynomial &other) const;
+    Polynomial pow(unsigned exponent) const;
+    bool operator==(const Polynomial &other) const { return vars == other.vars && terms == other.terms; }
+
+    // Многомерная схема Горнера, степени переменных берутся из таблицы
+    T eval(const std::vector<T> &x) const;
+    T eval(const std::map<std::string, T> &bindings) const;
+
+    // Выражение в форме Горнера: x*(x*(a*x + b) + c) + d
+    Expression<T> to_expression() const;
+};
+
+// Пределы размера: раскрытие (a+b+...)^n растёт комбинаторно, больший многочлен не строится
+inline constexpr size_t poly_max_terms = 256;
+inline constexpr unsigned poly_max_degree = 32;
+
+// Многочлен для выражения или std::nullopt, если в нём есть функции, деление
+// на неконстанту, степень, отличная от целой неотрицательной константы,
+// или многочлен выходит за poly_max_terms / poly_max_degree
+template <Numeric T>
+std::optional<Polynomial<T>> to_polynomial(const Expression<T> &expr);
+
+// Каждое максимальное полиномиальное поддерево заменяется канонической формой Горнера,
+// если она не больше исходного поддерева ни по числу узлов, ни по tree_cost.
+// Переписывание уровня MathPolicy::Fast: подобные мономы сокращаются (x*y - y*x = 0
+// и при x = inf), деление на константу становится умножением на 1/c, порядок сложений другой
+template <Numeric T>
+Expression<T> horner_form(const Expression<T> &expr);
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+template <Numeric T>
+Polynomial<T>::Polynomial(std::vector<std::string> vars, T value) : vars(std::move(vars))
+{
+    add_term(Monomial(this->vars.size(), 0), value);
+}
+
+template <Numeric T>
+Polynomial<T> Polynomial<T>::variable(std::vector<std::string> vars, const std::string &name)
+{
+    Polynomial result(vars);
+    auto it = std::lower_bound(result.vars.begin(), result.vars.end(), name);
+    if (it == result.vars.end() || *it != name)
+        throw std::runtime_error("Variable '" + name + "' is not provided");
+    Monomial monomial(result.vars.size(), 0);
+    monomial[it - result.vars.begin()] = 1;
+    result.add_term(monomial, T(1));
+    return result;
+}
+
+template <Numeric T>
+unsigned Polynomial<T>::degree() const
+{
+    unsigned result = 0;
+    for (const auto &[monomial, c] : terms)
+    {
+        unsigned d = 0;
+        for (unsigned e : monomial)
+            d += e;
+        result = std::max(result, d);
+    }
+    return result;
+}
+
+template <Numeric T>
+void Polynomial<T>::add_term(const Monomial &monomial, T coefficient)
+{
+    if (coefficient == T(0))
+        return;
+    auto [it, inserted] = terms.emplace(monomial, coefficient);
+    if (inserted)
+        return;
+    it->second = it->second + coefficient;
+    if (it->second == T(0))
+        terms.erase(it);
+}
+
+template <Numeric T>
+Polynomial<T> Polynomial<T>::operator+(const Polynomial &other) const
+{
+    Polynomial result = *this;
+    for (const auto &[monomial, c] : other.terms)
+        result.add_term(monomial, c);
+    return result;
+}
+
+template <Numeric T>
+Polynomial<T> Polynomial<T>::operator-(const Polynomial &other) const
+{
+    Polynomial result = *this;
+    for (const auto &[monomial, c] : other.terms)
+        result.add_term(monomial, -c);
+    return result;
+}
+
+template <Numeric T>
+Polynomial<T> Polynomial<T>::operator*(const Polynomial &other) const
+{
+    Polynomial result(vars);
+    Monomial monomial(vars.size());
+    for (const auto &[ma, ca] : terms)
+        for (const auto &[mb, cb] : other.terms)
+        {
+            for (size_t v = 0; v < vars.size(); ++v)
+                monomial[v] = ma[v] + mb[v];
+            result.add_term(monomial, ca * cb);
+        }
+    return result;
+}
+
+template <Numeric T>
+Polynomial<T> Polynomial<T>::pow(unsigned exponent) const
+{
+    Polynomial result(vars, T(1));
+    Polynomial base = *this;
+    for (; exponent > 0; exponent >>= 1)
+    {
+        if (exponent & 1)
+            result = result * base;
+        if (exponent > 1)
+            base = base * base;
+    }
+    return result;
+}
+
+template <Numeric T>
+T Polynomial<T>::horner(Iter begin, Iter end, size_t v, const std::vector<std::vector<T>> &powers) const
+{
+    if (v == vars.size())
+        return begin->second;
+
+    // Термы упорядочены по степени v; от старшей группы к младшей:
+    // acc = acc * x^(e_prev - e) + q_e, в конце acc * x^(e_min)
+    T acc = T(0);
+    unsigned prev = 0;
+    for (Iter group_end = end; group_end != begin;)
+    {
+        unsigned e = std::prev(group_end)->first[v];
+        Iter group_begin = group_end;
+        while (group_begin != begin && std::prev(group_begin)->first[v] == e)
+            --group_begin;
+        T q = horner(group_begin, group_end, v + 1, powers);
+        acc = group_end == end ? q : acc * powers[v][prev - e] + q;
+        prev = e;
+        group_end = group_begin;
+    }
+    return acc * powers[v][prev];
+}
+
+template <Numeric T>
+T Polynomial<T>::eval(const std::vector<T> &x) const
+{
+    if (x.size() != vars.size())
+        throw std::runtime_error("Inputs size doesn`t match variables");
+    if (terms.empty())
+        return T(0);
+
+    // Таблица x_v^k для k до наибольшей степени v
+    std::vector<unsigned> max_exp(vars.size(), 0);
+    for (const auto &[monomial, c] : terms)
+        for (size_t v = 0; v < vars.size(); ++v)
+            max_exp[v] = std::max(max_exp[v], monomial[v]);
+    std::vector<std::vector<T>> powers(vars.size());
+    for (size_t v = 0; v < vars.size(); ++v)
+    {
+        powers[v].assign(max_exp[v] + 1, T(1));
+        for (unsigned k = 1; k <= max_exp[v]; ++k)
+            powers[v][k] = powers[v][k - 1] * x[v];
+    }
+
+    std::vector<std::pair<Monomial, T>> sorted(terms.begin(), terms.end());
+    return horner(sorted.begin(), sorted.end(), 0, powers);
+}
+
+template <Numeric T>
+T Polynomial<T>::eval(const std::map<std::string, T> &bindings) const
+{
+    std::vector<T> x(vars.size());
+    for (size_t v = 0; v < vars.size(); ++v)
+    {
+        if (vars[v] == "i")
+        {
+            x[v] = imaginary_unit<T>();
+            continue;
+        }
+        auto it = bindings.find(vars[v]);
+        if (it == bindings.end())
+            throw std::runtime_error("Variable '" + vars[v] + "' is not provided");
+        x[v] = it->second;
+    }
+    return eval(x);
+}
+
+// Узлы без тривиальных множителей и слагаемых: 1*u = u, 0 + u = u, x^1 = x
+template <Numeric T>
+std::shared_ptr<Node<T>> poly_mul(std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r)
+{
+    if (is_one(l))
+        return r;
+    if (is_one(r))
+        return l;
+    return make<T>(ExprType::Multiply, l, r);
+}
+
+// u + c с отрицательной вещественной константой c записывается как u - |c|
+template <Numeric T>
+std::shared_ptr<Node<T>> poly_add(std::shared_ptr<Node<T>> l, std::shared_ptr<Node<T>> r)
+{
+    if (r->getType() == ExprType::Constant)
+    {
+        T c = static_cast<const ConstNode<T> *>(r.get())->getVal();
+        bool negative = false;
+        if constexpr (std::is_same_v<T, Complex>)
+            negative = c.imag() == 0 && c.real() < 0;
+        else
+            negative = c < 0;
+        if (negative)
+            return make<T>(ExprType::Subtract, l, make_const<T>(-c));
+    }
+    return make<T>(ExprType::Add, l, r);
+}
+
+template <Numeric T>
+std::shared_ptr<Node<T>> poly_power(const std::string &name, unsigned e)
+{
+    std::shared_ptr<Node<T>> x = std::make_shared<VarNode<T>>(name);
+    if (e == 0)
+        return make_const<T>(1);
+    return e == 1 ? x : make<T>(ExprType::Power, x, make_const<T>(T(e)));
+}
+
+template <Numeric T>
+std::shared_ptr<Node<T>> Polynomial<T>::horner_node(Iter begin, Iter end, size_t v) const
+{
+    if (v == vars.size())
+        return make_const<T>(begin->second);
+
+    std::shared_ptr<Node<T>> acc;
+    unsigned prev = 0;
+    for (Iter group_end = end; group_end != begin;)
+    {
+        unsigned e = std::prev(group_end)->first[v];
+        Iter group_begin = group_end;
+        while (group_begin != begin && std::prev(group_begin)->first[v] == e)
+            --group_begin;
+        auto q = horner_node(group_begin, group_end, v + 1);
+        if (group_end == end)
+            acc = q;
+        else
+            acc = poly_add(poly_mul(acc, poly_power<T>(vars[v], prev - e)), q);
+        prev = e;
+        group_end = group_begin;
+    }
+    return poly_mul(acc, poly_power<T>(vars[v], prev));
+}
+
+template <Numeric T>
+Expression<T> Polynomial<T>::to_expression() const
+{
+    if (terms.empty())
+        return Expression<T>(make_const<T>(0));
+    std::vector<std::pair<Monomial, T>> sorted(terms.begin(), terms.end());
+    return Expression<T>(horner_node(sorted.cbegin(), sorted.cend(), 0));
+}
+
+// Неотрицательная целая константа-показатель (до 64) или -1
+template <Numeric T>
+long long poly_exponent(const std::shared_ptr<Node<T>> &node)
+{
+    if (node->getType() != ExprType::Constant)
+        return -1;
+    T p = static_cast<const ConstNode<T> *>(node.get())->getVal();
+    Real value = 0;
+    if constexpr (std::is_same_v<T, Complex>)
+        value = p.imag() == 0 ? p.real() : -1;
+    else
+        value = p;
+    return value >= 0 && value <= 64 && std::floor(value) == value ? (long long)value : -1;
+}
+
+template <Numeric T>
+bool poly_within_limits(const Polynomial<T> &p)
+{
+    return p.size() <= poly_max_terms && p.degree() <= poly_max_degree;
+}
+
+// Возведение в степень с проверкой пределов после каждого умножения
+template <Numeric T>
+std::optional<Polynomial<T>> poly_pow_bounded(const Polynomial<T> &base, unsigned exponent)
+{
+    if ((unsigned long long)base.degree() * exponent > poly_max_degree)
+        return std::nullopt;
+    Polynomial<T> result(base.variables(), T(1));
+    Polynomial<T> square = base;
+    for (; exponent > 0; exponent >>= 1)
+    {
+        if (exponent & 1)
+        {
+            result = result * square;
+            if (!poly_within_limits(result))
+                return std::nullopt;
+        }
+        if (exponent > 1)
+        {
+            square = square * square;
+            if (!poly_within_limits(square))
+                return std::nullopt;
+        }
+    }
+    return result;
+}
+
+// Многочлены всех полиномиальных поддеревьев, посчитанные снизу вверх за один обход
+template <Numeric T>
+const std::optional<Polynomial<T>> &
+polynomial_of(const std::shared_ptr<Node<T>> &node, const std::vector<std::string> &vars,
+              std::unordered_map<const Node<T> *, std::optional<Polynomial<T>>> &memo)
+{
+    auto it = memo.find(node.get());
+    if (it != memo.end())
+        return it->second;
+
+    std::optional<Polynomial<T>> result;
+    ExprType type = node->getType();
+    if (type == ExprType::Constant)
+        result = Polynomial<T>(vars, static_cast<const ConstNode<T> *>(node.get())->getVal());
+    else if (type == ExprType::Variable)
+        result = Polynomial<T>::variable(vars, static_cast<const VarNode<T> *>(node.get())->getName());
+    else if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        const auto &l = polynomial_of(bin->getLeft(), vars, memo);
+        const auto &r = polynomial_of(bin->getRight(), vars, memo);
+        long long e = type == ExprType::Power ? poly_exponent(bin->getRight()) : -1;
+        if (l && r)
+        {
+            if (type == ExprType::Add)
+                result = *l + *r;
+            else if (type == ExprType::Subtract)
+                result = *l - *r;
+            else if (type == ExprType::Multiply)
+                result = *l * *r;
+            else if (type == ExprType::Divide && r->size() == 1 && r->degree() == 0)
+                result = *l * Polynomial<T>(vars, T(1) / r->getTerms().begin()->second);
+        }
+        if (l && type == ExprType::Power && e >= 0)
+            result = poly_pow_bounded(*l, e);
+        if (result && !poly_within_limits(*result))
+            result.reset();
+    }
+    else
+    {
+        const auto &arg = polynomial_of(static_cast<const FunctionNode<T> *>(node.get())->getArg(), vars, memo);
+        if (arg && type == ExprType::Negate)
+            result = Polynomial<T>(vars) - *arg;
+    }
+
+    return memo[node.get()] = std::move(result);
+}
+
+template <Numeric T>
+std::optional<Polynomial<T>> to_polynomial(const Expression<T> &expr)
+{
+    std::set<std::string> names;
+    collect_variables(expr.getRoot(), names);
+    std::vector<std::string> vars(names.begin(), names.end());
+    std::unordered_map<const Node<T> *, std::optional<Polynomial<T>>> memo;
+    return polynomial_of(expr.getRoot(), vars, memo);
+}
+
+template <Numeric T>
+std::shared_ptr<Node<T>> horner_rewrite(const std::shared_ptr<Node<T>> &node,
+                                         std::unordered_map<const Node<T> *, std::optional<Polynomial<T>>> &memo)
+{
+    ExprType type = node->getType();
+    if (type == ExprType::Constant || type == ExprType::Variable)
+        return node;
+    const auto &poly = memo.at(node.get());
+    if (poly)
+    {
+        // Переменные, которых нет в многочлене, из формы Горнера выпадают сами.
+        // Раскрытие (a+b)^3 длиннее исходника — тогда поддерево остаётся как есть
+        auto horner = poly->to_expression().getRoot();
+        CostModel cost;
+        if (count_nodes(horner) > count_nodes(node) || tree_cost(horner, cost) > tree_cost(node, cost))
+            return node;
+        return horner;
+    }
+    if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        auto l = horner_rewrite(bin->getLeft(), memo);
+        auto r = horner_rewrite(bin->getRight(), memo);
+        if (l == bin->getLeft() && r == bin->getRight())
+            return node;
+        return make<T>(type, l, r);
+    }
+    auto arg = static_cast<const FunctionNode<T> *>(node.get())->getArg();
+    auto new_arg = horner_rewrite(arg, memo);
+    return new_arg == arg ? node : make_function<T>(type, new_arg);
+}
+
+template <Numeric T>
+Expression<T> horner_form(const Expression<T> &expr)
+{
+    std::set<std::string> names;
+    collect_variables(expr.getRoot(), names);
+    std::vector<std::string> vars(names.begin(), names.end());
+    std::unordered_map<const Node<T> *, std::optional<Polynomial<T>>> memo;
+    polynomial_of(expr.getRoot(), vars, memo);
+    return Expression<T>(horner_rewrite(expr.getRoot(), memo));
+}
+
+#endif // Polynomial_HPP
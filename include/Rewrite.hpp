@@ -0,0 +1,352 @@
+#ifndef Rewrite_HPP
+#define Rewrite_HPP
+
+#include "HashCons.hpp"
+
+/*
+=====================
+REWRITE RULES
+=====================
+*/
+
+// Правило "образец -> замена", обе части разбираются make_expression.
+// Каждая переменная образца (кроме i) — переменная шаблона: сопоставляется с любым
+// поддеревом, повторная переменная — с тем же самым поддеревом:
+//   "ln(a*b) -> ln(a)+ln(b)",  "sin(a)^2 + cos(a)^2 -> 1"
+// Образцы упрощаются конструктором как обычные выражения: "a*1" превращается в "a"
+template <Numeric T = Real>
+class RewriteRule
+{
+private:
+    std::string text;
+    Expression<T> pattern;
+    Expression<T> replacement;
+
+public:
+    explicit RewriteRule(const std::string &rule);
+
+    const std::string &getText() const { return text; }
+    const Expression<T> &getPattern() const { return pattern; }
+    const Expression<T> &getReplacement() const { return replacement; }
+};
+
+// Набор правил, собранный в дерево различения (discrimination tree): образцы
+// записываются в префиксном порядке в общий бор, так что сопоставление узла
+// со всеми правилами стоит порядка размера образцов, а не числа правил
+template <Numeric T = Real>
+class RuleSet
+{
+public:
+    using Ptr = std::shared_ptr<Node<T>>;
+
+    void add(const std::string &rule);
+    size_t size() const { return rules.size(); }
+    const std::vector<RewriteRule<T>> &getRules() const { return rules; }
+
+    // Переписывание снизу вверх до неподвижной точки (не больше max_passes проходов).
+    // При нескольких подходящих правилах побеждает добавленное раньше
+    Expression<T> apply(const Expression<T> &expr, size_t *rewrites = nullptr, size_t max_passes = 16) const;
+
+    // Номер первого подходящего правила и значения переменных шаблона, либо -1
+    int match(const Ptr &node, std::map<std::string, Ptr> &bindings) const;
+
+private:
+    struct Symbol
+    {
+        ExprType type;
+        T value;
+        std::string name; // только для переменной i
+
+        bool operator==(const Symbol &other) const
+        {
+            return type == other.type && value == other.value && name == other.name;
+        }
+    };
+
+    struct SymbolHash
+    {
+        size_t operator()(const Symbol &symbol) const;
+    };
+
+    struct TrieNode
+    {
+        std::unordered_map<Symbol, int, SymbolHash> children;
+        int wildcard = -1;      // переход по переменной шаблона
+        std::vector<int> rules; // правила, образец которых здесь заканчивается
+    };
+
+    std::vector<RewriteRule<T>> rules;
+    std::vector<std::vector<std::string>> wildcard_names; // имена переменных в префиксном порядке
+    std::vector<TrieNode> trie = std::vector<TrieNode>(1);
+
+    static bool is_wildcard(const Ptr &node);
+    static Symbol symbol_of(const Ptr &node);
+    static void push_children(const Ptr &node, std::vector<Ptr> &work);
+
+    void insert(const Ptr &pattern, int rule);
+    void collect(int state, std::vector<Ptr> work, std::vector<Ptr> &bound, int &best,
+                 std::map<std::string, Ptr> &best_bindings) const;
+    Ptr rewrite(const Ptr &node, std::unordered_map<const Node<T> *, Ptr> &done, size_t &count) const;
+};
+
+// Структурное равенство деревьев
+template <Numeric T>
+bool same_tree(const std::shared_ptr<Node<T>> &a, const std::shared_ptr<Node<T>> &b);
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+template <Numeric T>
+RewriteRule<T>::RewriteRule(const std::string &rule)
+    : text(rule), pattern(T(0)), replacement(T(0))
+{
+    size_t arrow = rule.find("->");
+    if (arrow == std::string::npos || rule.find("->", arrow + 2) != std::string::npos)
+        throw std::runtime_error("Rule must look like 'pattern -> replacement'");
+    pattern = make_expression<T>(rule.substr(0, arrow));
+    replacement = make_expression<T>(rule.substr(arrow + 2));
+
+    auto root_type = pattern.getRoot()->getType();
+    if (root_type == ExprType::Variable || root_type == ExprType::Constant)
+        throw std::runtime_error("Pattern must be an operation or a function");
+
+    std::set<std::string> bound, used;
+    collect_variables(pattern.getRoot(), bound);
+    collect_variables(replacement.getRoot(), used);
+    for (const auto &name : used)
+        if (name != "i" && !bound.count(name))
+            throw std::runtime_error("Pattern variable '" + name + "' is not bound");
+}
+
+template <Numeric T>
+bool same_tree(const std::shared_ptr<Node<T>> &a, const std::shared_ptr<Node<T>> &b)
+{
+    if (a == b)
+        return true;
+    ExprType type = a->getType();
+    if (type != b->getType())
+        return false;
+    if (type == ExprType::Constant)
+        return a->eval({}) == b->eval({});
+    if (type == ExprType::Variable)
+        return static_cast<const VarNode<T> *>(a.get())->getName() ==
+               static_cast<const VarNode<T> *>(b.get())->getName();
+    if (is_binary(type))
+    {
+        auto x = static_cast<const BinaryOpNode<T> *>(a.get());
+        auto y = static_cast<const BinaryOpNode<T> *>(b.get());
+        return same_tree(x->getLeft(), y->getLeft()) && same_tree(x->getRight(), y->getRight());
+    }
+    return same_tree(inner_arg(a), inner_arg(b));
+}
+
+template <Numeric T>
+size_t RuleSet<T>::SymbolHash::operator()(const Symbol &symbol) const
+{
+    size_t h = std::hash<int>()((int)symbol.type);
+    if constexpr (std::is_same_v<T, Complex>)
+    {
+        h = hash_combine(h, std::hash<Real>()(symbol.value.real()));
+        h = hash_combine(h, std::hash<Real>()(symbol.value.imag()));
+    }
+    else
+        h = hash_combine(h, std::hash<T>()(symbol.value));
+    return hash_combine(h, std::hash<std::string>()(symbol.name));
+}
+
+template <Numeric T>
+bool RuleSet<T>::is_wildcard(const Ptr &node)
+{
+    return node->getType() == ExprType::Variable && static_cast<const VarNode<T> *>(node.get())->getName() != "i";
+}
+
+template <Numeric T>
+typename RuleSet<T>::Symbol RuleSet<T>::symbol_of(const Ptr &node)
+{
+    ExprType type = node->getType();
+    if (type == ExprType::Constant)
+        return {type, static_cast<const ConstNode<T> *>(node.get())->getVal(), ""};
+    if (type == ExprType::Variable)
+        return {type, T(0), static_cast<const VarNode<T> *>(node.get())->getName()};
+    return {type, T(0), ""};
+}
+
+// Дети кладутся в стек так, чтобы левый снимался первым (префиксный порядок)
+template <Numeric T>
+void RuleSet<T>::push_children(const Ptr &node, std::vector<Ptr> &work)
+{
+    ExprType type = node->getType();
+    if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        work.push_back(bin->getRight());
+        work.push_back(bin->getLeft());
+    }
+    else if (is_function(type))
+        work.push_back(inner_arg(node));
+}
+
+template <Numeric T>
+void RuleSet<T>::insert(const Ptr &pattern, int rule)
+{
+    std::vector<Ptr> work = {pattern};
+    std::vector<std::string> names;
+    int state = 0;
+    while (!work.empty())
+    {
+        Ptr node = work.back();
+        work.pop_back();
+        if (is_wildcard(node))
+        {
+            names.push_back(static_cast<const VarNode<T> *>(node.get())->getName());
+            if (trie[state].wildcard < 0)
+            {
+                trie[state].wildcard = trie.size();
+                trie.emplace_back();
+            }
+            state = trie[state].wildcard;
+            continue;
+        }
+        Symbol symbol = symbol_of(node);
+        auto it = trie[state].children.find(symbol);
+        if (it == trie[state].children.end())
+        {
+            int next = trie.size();
+            trie[state].children.emplace(symbol, next);
+            trie.emplace_back();
+            state = next;
+        }
+        else
+            state = it->second;
+        push_children(node, work);
+    }
+    trie[state].rules.push_back(rule);
+    wildcard_names.push_back(std::move(names));
+}
+
+template <Numeric T>
+void RuleSet<T>::add(const std::string &rule)
+{
+    rules.emplace_back(rule);
+    insert(rules.back().getPattern().getRoot(), rules.size() - 1);
+}
+
+// Обход бора вместе с деревом: work — ещё не сопоставленные поддеревья в префиксном порядке,
+// bound — поддеревья, попавшие на переменные шаблона
+template <Numeric T>
+void RuleSet<T>::collect(int state, std::vector<Ptr> work, std::vector<Ptr> &bound, int &best,
+                         std::map<std::string, Ptr> &best_bindings) const
+{
+    const auto &trie_node = trie[state];
+    if (work.empty())
+    {
+        for (int rule : trie_node.rules)
+        {
+            if (best >= 0 && rule >= best)
+                continue;
+            // Повторные переменные шаблона должны совпасть с одинаковыми поддеревьями
+            std::map<std::string, Ptr> bindings;
+            bool consistent = true;
+            const auto &names = wildcard_names[rule];
+            for (size_t k = 0; k < names.size() && consistent; ++k)
+            {
+                auto [it, inserted] = bindings.emplace(names[k], bound[k]);
+                consistent = inserted || same_tree(it->second, bound[k]);
+            }
+            if (consistent)
+            {
+                best = rule;
+                best_bindings = std::move(bindings);
+            }
+        }
+        return;
+    }
+
+    Ptr node = work.back();
+    work.pop_back();
+    auto it = trie_node.children.find(symbol_of(node));
+    if (it != trie_node.children.end())
+    {
+        std::vector<Ptr> next = work;
+        push_children(node, next);
+        collect(it->second, std::move(next), bound, best, best_bindings);
+    }
+    if (trie_node.wildcard >= 0)
+    {
+        bound.push_back(node);
+        collect(trie_node.wildcard, std::move(work), bound, best, best_bindings);
+        bound.pop_back();
+    }
+}
+
+template <Numeric T>
+int RuleSet<T>::match(const Ptr &node, std::map<std::string, Ptr> &bindings) const
+{
+    int best = -1;
+    std::vector<Ptr> bound;
+    collect(0, {node}, bound, best, bindings);
+    return best;
+}
+
+template <Numeric T>
+typename RuleSet<T>::Ptr RuleSet<T>::rewrite(const Ptr &node, std::unordered_map<const Node<T> *, Ptr> &done,
+                                             size_t &count) const
+{
+    auto it = done.find(node.get());
+    if (it != done.end())
+        return it->second;
+
+    Ptr result = node;
+    ExprType type = node->getType();
+    if (is_binary(type))
+    {
+        auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+        auto l = rewrite(bin->getLeft(), done, count);
+        auto r = rewrite(bin->getRight(), done, count);
+        if (l != bin->getLeft() || r != bin->getRight())
+            result = make<T>(type, l, r);
+    }
+    else if (is_function(type))
+    {
+        auto arg = rewrite(inner_arg(node), done, count);
+        if (arg != inner_arg(node))
+            result = make_function<T>(type, arg);
+    }
+
+    // Корень переписывается, пока подходят правила; новые поддеревья замены
+    // дочищаются следующим проходом apply
+    std::map<std::string, Ptr> bindings;
+    for (int step = 0; step < 8; ++step)
+    {
+        bindings.clear();
+        int rule = match(result, bindings);
+        if (rule < 0)
+            break;
+        result = substitute(rules[rule].getReplacement().getRoot(), bindings);
+        ++count;
+    }
+    done[node.get()] = result;
+    return result;
+}
+
+template <Numeric T>
+Expression<T> RuleSet<T>::apply(const Expression<T> &expr, size_t *rewrites, size_t max_passes) const
+{
+    size_t total = 0;
+    auto root = expr.getRoot();
+    for (size_t pass = 0; pass < max_passes; ++pass)
+    {
+        size_t count = 0;
+        std::unordered_map<const Node<T> *, Ptr> done;
+        root = rewrite(root, done, count);
+        total += count;
+        if (count == 0)
+            break;
+    }
+    if (rewrites)
+        *rewrites = total;
+    return Expression<T>(root);
+}
+
+#endif // Rewrite_HPP
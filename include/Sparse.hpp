@@ -0,0 +1,429 @@
+#ifndef Sparse_HPP
+#define Sparse_HPP
+
+#include "CompiledExpression.hpp"
+#include <algorithm>
+#include <numeric>
+#include <set>
+
+/*==========*/
+/*Sparse matrices*/
+/*==========*/
+
+template <Numeric T>
+struct CooMatrix
+{
+    size_t rows = 0, cols = 0;
+    std::vector<size_t> row, col;
+    std::vector<T> values;
+};
+
+template <Numeric T>
+struct CsrMatrix
+{
+    size_t rows = 0, cols = 0;
+    std::vector<size_t> row_ptr, col_idx;
+    std::vector<T> values;
+
+    size_t nnz() const { return values.size(); }
+    CooMatrix<T> to_coo() const;
+};
+
+// Структура ненулей: для каждой строки отсортированный список столбцов
+struct SparsityPattern
+{
+    size_t rows = 0, cols = 0;
+    std::vector<std::vector<int>> row_cols;
+
+    size_t nnz() const;
+    SparsityPattern transpose() const;
+};
+
+template <Numeric T>
+std::vector<std::vector<int>> slot_dependencies(const CompiledExpression<T> &compiled);
+
+template <Numeric T>
+SparsityPattern jacobian_sparsity(const CompiledExpression<T> &compiled);
+
+// Структурные ненули гессиана первого выхода (симметричный шаблон вместе с диагональю)
+template <Numeric T>
+SparsityPattern hessian_sparsity(const CompiledExpression<T> &compiled);
+
+// Жадная раскраска столбцов: столбцы одного цвета не имеют общих строк
+inline std::vector<int> color_columns(const SparsityPattern &pattern);
+
+// Звёздная раскраска симметричного шаблона: нет двухцветных путей из 4 вершин
+inline std::vector<int> star_color(const SparsityPattern &pattern);
+
+/*
+=====================
+SPARSE DERIVATIVES
+=====================
+*/
+
+// Якобиан системы по сжатой матрице: по одному проходу на цвет.
+// Выбирает прямой режим (раскраска столбцов) или обратный (раскраска строк) — где цветов меньше.
+// compiled должен жить дольше объекта
+template <Numeric T = Real>
+class SparseJacobian
+{
+private:
+    const CompiledExpression<T> &compiled;
+    SparsityPattern pattern;
+    std::vector<int> colors;
+    int n_colors = 0;
+    bool by_rows = false;
+
+public:
+    explicit SparseJacobian(const CompiledExpression<T> &compiled);
+
+    const SparsityPattern &getPattern() const { return pattern; }
+    int sweeps() const { return n_colors; }
+    bool reverse_mode() const { return by_rows; }
+
+    CsrMatrix<T> compute(const std::map<std::string, T> &bindings) const;
+};
+
+// Гессиан первого выхода по звёздной раскраске: по одному HVP на цвет
+template <Numeric T = Real>
+class SparseHessian
+{
+private:
+    const CompiledExpression<T> &compiled;
+    SparsityPattern pattern;
+    std::vector<int> colors;
+    int n_colors = 0;
+
+public:
+    explicit SparseHessian(const CompiledExpression<T> &compiled);
+
+    const SparsityPattern &getPattern() const { return pattern; }
+    int sweeps() const { return n_colors; }
+
+    CsrMatrix<T> compute(const std::map<std::string, T> &bindings) const;
+};
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+template <Numeric T>
+CooMatrix<T> CsrMatrix<T>::to_coo() const
+{
+    CooMatrix<T> coo;
+    coo.rows = rows;
+    coo.cols = cols;
+    coo.col = col_idx;
+    coo.values = values;
+    coo.row.reserve(values.size());
+    for (size_t r = 0; r < rows; ++r)
+        for (size_t k = row_ptr[r]; k < row_ptr[r + 1]; ++k)
+            coo.row.push_back(r);
+    return coo;
+}
+
+inline size_t SparsityPattern::nnz() const
+{
+    size_t count = 0;
+    for (const auto &row : row_cols)
+        count += row.size();
+    return count;
+}
+
+inline SparsityPattern SparsityPattern::transpose() const
+{
+    SparsityPattern t;
+    t.rows = cols;
+    t.cols = rows;
+    t.row_cols.resize(cols);
+    for (size_t r = 0; r < rows; ++r)
+        for (int c : row_cols[r])
+            t.row_cols[c].push_back(r);
+    return t;
+}
+
+template <Numeric T>
+std::vector<std::vector<int>> slot_dependencies(const CompiledExpression<T> &compiled)
+{
+    const auto &code = compiled.instructions();
+    std::vector<std::vector<int>> deps(code.size());
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        const auto &ins = code[i];
+        if (ins.op == ExprType::Variable)
+            deps[i] = {ins.lhs};
+        else if (is_binary(ins.op))
+            std::set_union(deps[ins.lhs].begin(), deps[ins.lhs].end(), deps[ins.rhs].begin(),
+                           deps[ins.rhs].end(), std::back_inserter(deps[i]));
+        else if (ins.op != ExprType::Constant)
+            deps[i] = deps[ins.lhs];
+    }
+    return deps;
+}
+
+template <Numeric T>
+SparsityPattern jacobian_sparsity(const CompiledExpression<T> &compiled)
+{
+    auto deps = slot_dependencies(compiled);
+    SparsityPattern pattern;
+    pattern.rows = compiled.outputs().size();
+    pattern.cols = compiled.variables().size();
+    for (int slot : compiled.outputs())
+        pattern.row_cols.push_back(deps[slot]);
+    return pattern;
+}
+
+template <Numeric T>
+SparsityPattern hessian_sparsity(const CompiledExpression<T> &compiled)
+{
+    const auto &code = compiled.instructions();
+    auto deps = slot_dependencies(compiled);
+    size_t n = compiled.variables().size();
+
+    // Только ячейки, от которых зависит первый выход
+    std::vector<char> reach(code.size(), 0);
+    reach[compiled.outputs()[0]] = 1;
+    for (size_t i = code.size(); i-- > 0;)
+    {
+        if (!reach[i] || code[i].op == ExprType::Constant || code[i].op == ExprType::Variable)
+            continue;
+        reach[code[i].lhs] = 1;
+        if (is_binary(code[i].op))
+            reach[code[i].rhs] = 1;
+    }
+
+    std::vector<std::set<int>> rows(n);
+    auto connect = [&](const std::vector<int> &a, const std::vector<int> &b)
+    {
+        for (int p : a)
+            for (int q : b)
+            {
+                rows[p].insert(q);
+                rows[q].insert(p);
+            }
+    };
+
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        const auto &ins = code[i];
+        if (!reach[i])
+            continue;
+        switch (ins.op)
+        {
+        case ExprType::Multiply:
+            connect(deps[ins.lhs], deps[ins.rhs]);
+            break;
+        case ExprType::Divide:
+            connect(deps[ins.rhs], deps[i]);
+            break;
+        case ExprType::Power:
+            connect(deps[i], deps[i]);
+            break;
+        case ExprType::Sin:
+        case ExprType::Cos:
+        case ExprType::Exp:
+        case ExprType::Ln:
+        case ExprType::Sqrt:
+            connect(deps[ins.lhs], deps[ins.lhs]);
+            break;
+        default:
+            break;
+        }
+    }
+
+    SparsityPattern pattern;
+    pattern.rows = pattern.cols = n;
+    for (auto &row : rows)
+        pattern.row_cols.emplace_back(row.begin(), row.end());
+    return pattern;
+}
+
+// Порядок обхода для жадных раскрасок: по убыванию степени
+inline std::vector<int> largest_first(const std::vector<std::vector<int>> &adj)
+{
+    std::vector<int> order(adj.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+                     { return adj[a].size() > adj[b].size(); });
+    return order;
+}
+
+std::vector<int> color_columns(const SparsityPattern &pattern)
+{
+    SparsityPattern by_col = pattern.transpose();
+    std::vector<int> color(pattern.cols, -1);
+    std::vector<int> forbidden(pattern.cols + 1, -1);
+
+    for (int j : largest_first(by_col.row_cols))
+    {
+        for (int r : by_col.row_cols[j])
+            for (int k : pattern.row_cols[r])
+                if (color[k] != -1)
+                    forbidden[color[k]] = j;
+        int c = 0;
+        while (forbidden[c] == j)
+            ++c;
+        color[j] = c;
+    }
+    return color;
+}
+
+std::vector<int> star_color(const SparsityPattern &pattern)
+{
+    size_t n = pattern.rows;
+    std::vector<std::vector<int>> adj(n);
+    for (size_t i = 0; i < n; ++i)
+        for (int j : pattern.row_cols[i])
+            if (j != (int)i)
+                adj[i].push_back(j);
+
+    std::vector<int> color(n, -1);
+    std::vector<int> forbidden(n + 1, -1);
+    std::vector<int> seen(n + 1, 0);
+
+    // Каждый путь из 4 вершин проверяется, когда красится последняя его вершина v:
+    // v либо на конце пути (v-w-x-y), либо внутри (w-v-x-y)
+    for (int v : largest_first(adj))
+    {
+        for (int w : adj[v])
+            if (color[w] != -1)
+            {
+                forbidden[color[w]] = v;
+                ++seen[color[w]];
+            }
+
+        for (int w : adj[v])
+        {
+            if (color[w] == -1)
+                continue;
+            for (int x : adj[w])
+            {
+                if (x == v || color[x] == -1)
+                    continue;
+                // w-v-x-y: у v два соседа цвета color(w)
+                if (seen[color[w]] >= 2)
+                    forbidden[color[x]] = v;
+                // v-w-x-y: у x есть другой сосед цвета color(w)
+                for (int y : adj[x])
+                    if (y != w && color[y] == color[w])
+                    {
+                        forbidden[color[x]] = v;
+                        break;
+                    }
+            }
+        }
+
+        int c = 0;
+        while (forbidden[c] == v)
+            ++c;
+        for (int w : adj[v])
+            if (color[w] != -1)
+                --seen[color[w]];
+        color[v] = c;
+    }
+    return color;
+}
+
+template <Numeric T>
+CsrMatrix<T> empty_csr(const SparsityPattern &pattern)
+{
+    CsrMatrix<T> csr;
+    csr.rows = pattern.rows;
+    csr.cols = pattern.cols;
+    csr.row_ptr.push_back(0);
+    for (const auto &row : pattern.row_cols)
+    {
+        csr.col_idx.insert(csr.col_idx.end(), row.begin(), row.end());
+        csr.row_ptr.push_back(csr.col_idx.size());
+    }
+    csr.values.assign(csr.col_idx.size(), T(0));
+    return csr;
+}
+
+// Затравочные векторы: единицы на позициях каждого цвета
+template <Numeric T>
+std::vector<std::vector<T>> color_seeds(const std::vector<int> &colors, int n_colors)
+{
+    std::vector<std::vector<T>> seeds(n_colors, std::vector<T>(colors.size(), T(0)));
+    for (size_t j = 0; j < colors.size(); ++j)
+        seeds[colors[j]][j] = T(1);
+    return seeds;
+}
+
+template <Numeric T>
+SparseJacobian<T>::SparseJacobian(const CompiledExpression<T> &compiled)
+    : compiled(compiled), pattern(jacobian_sparsity(compiled))
+{
+    auto col_colors = color_columns(pattern);
+    auto row_colors = color_columns(pattern.transpose());
+    int n_col = col_colors.empty() ? 0 : *std::max_element(col_colors.begin(), col_colors.end()) + 1;
+    int n_row = row_colors.empty() ? 0 : *std::max_element(row_colors.begin(), row_colors.end()) + 1;
+
+    by_rows = n_row < n_col;
+    colors = by_rows ? row_colors : col_colors;
+    n_colors = by_rows ? n_row : n_col;
+}
+
+template <Numeric T>
+CsrMatrix<T> SparseJacobian<T>::compute(const std::map<std::string, T> &bindings) const
+{
+    CsrMatrix<T> csr = empty_csr<T>(pattern);
+    if (n_colors == 0)
+        return csr;
+
+    if (by_rows)
+    {
+        // compressed[c][j] = сумма строк цвета c
+        auto compressed = compiled.vjps(bindings, color_seeds<T>(colors, n_colors));
+        for (size_t r = 0; r < csr.rows; ++r)
+            for (size_t k = csr.row_ptr[r]; k < csr.row_ptr[r + 1]; ++k)
+                csr.values[k] = compressed[colors[r]][csr.col_idx[k]];
+    }
+    else
+    {
+        // compressed[c][i] = сумма столбцов цвета c
+        auto compressed = compiled.jvps(bindings, color_seeds<T>(colors, n_colors));
+        for (size_t r = 0; r < csr.rows; ++r)
+            for (size_t k = csr.row_ptr[r]; k < csr.row_ptr[r + 1]; ++k)
+                csr.values[k] = compressed[colors[csr.col_idx[k]]][r];
+    }
+    return csr;
+}
+
+template <Numeric T>
+SparseHessian<T>::SparseHessian(const CompiledExpression<T> &compiled)
+    : compiled(compiled), pattern(hessian_sparsity(compiled)), colors(star_color(pattern))
+{
+    n_colors = colors.empty() ? 0 : *std::max_element(colors.begin(), colors.end()) + 1;
+}
+
+template <Numeric T>
+CsrMatrix<T> SparseHessian<T>::compute(const std::map<std::string, T> &bindings) const
+{
+    CsrMatrix<T> csr = empty_csr<T>(pattern);
+    if (n_colors == 0)
+        return csr;
+
+    auto compressed = compiled.hvps(bindings, color_seeds<T>(colors, n_colors));
+
+    // seen[i][c] — сколько соседей i (включая i) имеют цвет c
+    std::vector<std::map<int, int>> seen(csr.rows);
+    for (size_t i = 0; i < csr.rows; ++i)
+        for (int j : pattern.row_cols[i])
+            ++seen[i][colors[j]];
+
+    // Звёздная раскраска гарантирует, что H_ij стоит в сжатом столбце один
+    // либо в строке i цвета color(j), либо в строке j цвета color(i)
+    for (size_t i = 0; i < csr.rows; ++i)
+        for (size_t k = csr.row_ptr[i]; k < csr.row_ptr[i + 1]; ++k)
+        {
+            int j = csr.col_idx[k];
+            if (seen[i][colors[j]] == 1)
+                csr.values[k] = compressed[colors[j]][i];
+            else
+                csr.values[k] = compressed[colors[i]][j];
+        }
+    return csr;
+}
+
+#endif // Sparse_HPP
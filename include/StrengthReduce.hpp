@@ -0,0 +1,176 @@
+#ifndef StrengthReduce_HPP
+#define StrengthReduce_HPP
+
+#include "Expression.hpp"
+
+/*
+=====================
+STRENGTH REDUCTION
+=====================
+*/
+
+struct StrengthReduceOptions
+{
+    MathPolicy policy = MathPolicy::Exact;
+    bool reciprocal_division = true; // x / c -> x * (1/c); при Exact — только для c = 2^k
+    int max_power = 16;              // наибольшая |n|, для которой x^n раскрывается в умножения
+};
+
+// Замена дорогих операций дешёвыми:
+//   Exact: x^2 -> x*x,  x^1 -> x,  x^0 -> 1,  x / 2^k -> x * 2^-k;
+//   Fast:  x^-1 -> 1/x (в нуле деление бросает, а pow даёт inf),
+//          x^n -> возведение в квадрат и умножение (общие узлы),  x^-n -> 1/x^n,
+//          x^0.5 -> sqrt(x),  x^-0.5 -> 1/sqrt(x),  x^(n+0.5) -> x^n * sqrt(x),
+//          exp(ln(x)) -> x,  ln(exp(x)) -> x,  x / c -> x * (1/c)
+template <Numeric T>
+Expression<T> strength_reduce(const Expression<T> &expr, const StrengthReduceOptions &options = {});
+
+/*==========*/
+/*Realisation*/
+/*==========*/
+
+template <Numeric T>
+class StrengthReducer
+{
+public:
+    using Ptr = std::shared_ptr<Node<T>>;
+
+    explicit StrengthReducer(const StrengthReduceOptions &options) : options(options) {}
+
+    Ptr visit(const Ptr &node)
+    {
+        auto it = done.find(node.get());
+        if (it != done.end())
+            return it->second;
+
+        Ptr result = node;
+        ExprType type = node->getType();
+        if (is_binary(type))
+        {
+            auto bin = static_cast<const BinaryOpNode<T> *>(node.get());
+            Ptr l = visit(bin->getLeft());
+            Ptr r = visit(bin->getRight());
+            // power и divide возвращают nullptr, если переписывание не применимо
+            Ptr reduced;
+            if (type == ExprType::Power && r->getType() == ExprType::Constant)
+                reduced = power(l, r);
+            else if (type == ExprType::Divide && r->getType() == ExprType::Constant)
+                reduced = divide(l, r);
+            if (reduced)
+                result = reduced;
+            else if (l != bin->getLeft() || r != bin->getRight())
+                result = make<T>(type, l, r);
+        }
+        else if (is_function(type))
+        {
+            Ptr arg = visit(inner_arg(node));
+            bool fast = options.policy == MathPolicy::Fast;
+            if (fast && ((type == ExprType::Exp && arg->getType() == ExprType::Ln) ||
+                         (type == ExprType::Ln && arg->getType() == ExprType::Exp)))
+                result = inner_arg(arg);
+            else if (arg != inner_arg(node))
+                result = make_function<T>(type, arg);
+        }
+        done[node.get()] = result;
+        return result;
+    }
+
+private:
+    const StrengthReduceOptions &options;
+    std::unordered_map<const Node<T> *, Ptr> done;
+
+    // Вещественная часть показателя, если он вещественный; для Complex pow и умножение
+    // округляют по-разному, поэтому без Fast комплексные степени не трогаем
+    static bool real_value(T value, Real &out)
+    {
+        if constexpr (std::is_same_v<T, Complex>)
+        {
+            if (value.imag() != 0)
+                return false;
+            out = value.real();
+        }
+        else
+            out = value;
+        return true;
+    }
+
+    // x^n, n >= 1, возведением в квадрат: x^5 = (x^2)^2 * x, промежуточные узлы общие
+    Ptr integer_power(const Ptr &base, long long n)
+    {
+        Ptr result, square = base;
+        for (; n > 0; n >>= 1)
+        {
+            if (n & 1)
+                result = result ? make<T>(ExprType::Multiply, result, square) : square;
+            if (n > 1)
+                square = make<T>(ExprType::Multiply, square, square);
+        }
+        return result;
+    }
+
+    Ptr reciprocal(const Ptr &node) { return make<T>(ExprType::Divide, make_const<T>(1), node); }
+
+    Ptr power(const Ptr &base, const Ptr &exponent)
+    {
+        Real p;
+        if (!real_value(static_cast<const ConstNode<T> *>(exponent.get())->getVal(), p))
+            return nullptr;
+
+        bool fast = options.policy == MathPolicy::Fast;
+        bool exact_ok = !std::is_same_v<T, Complex>;
+        if (p == 1)
+            return base;
+        if (p == 0)
+            return make_const<T>(1);
+        if (p == 2 && (exact_ok || fast))
+            return make<T>(ExprType::Multiply, base, base);
+        if (!fast)
+            return nullptr;
+        if (p == -1)
+            return reciprocal(base);
+
+        Real twice = 2 * p;
+        if (std::floor(twice) != twice || std::fabs(p) > options.max_power)
+            return nullptr;
+
+        // p = n или p = n + 1/2
+        long long n = (long long)std::floor(std::fabs(p));
+        bool half = std::floor(p) != p;
+        Ptr result = n > 0 ? integer_power(base, n) : nullptr;
+        if (half)
+        {
+            Ptr root = make_function<T>(ExprType::Sqrt, base);
+            result = result ? make<T>(ExprType::Multiply, result, root) : root;
+        }
+        if (!result)
+            return make_const<T>(1);
+        return p < 0 ? reciprocal(result) : result;
+    }
+
+    Ptr divide(const Ptr &l, const Ptr &r)
+    {
+        T c = static_cast<const ConstNode<T> *>(r.get())->getVal();
+        if (!options.reciprocal_division || c == T(0))
+            return nullptr;
+        if (options.policy == MathPolicy::Exact)
+        {
+            // 1/c точно представимо только для степени двойки
+            Real v;
+            if (!real_value(c, v) || !std::isfinite(1 / v))
+                return nullptr;
+            int e;
+            if (std::fabs(std::frexp(v, &e)) != 0.5)
+                return nullptr;
+        }
+        return make<T>(ExprType::Multiply, l, make_const<T>(T(1) / c));
+    }
+};
+
+template <Numeric T>
+Expression<T> strength_reduce(const Expression<T> &expr, const StrengthReduceOptions &options)
+{
+    StrengthReducer<T> reducer(options);
+    return Expression<T>(reducer.visit(expr.getRoot()));
+}
+
+#endif // StrengthReduce_HPP
@@ -1,5 +1,24 @@
 #include <gtest/gtest.h>
 #include "Expression.hpp"
+#include "CompiledExpression.hpp"
+#include "Sparse.hpp"
+#include "Batch.hpp"
+#include "Checkpoint.hpp"
+#include "LetDiff.hpp"
+#include "HashCons.hpp"
+#include "EGraph.hpp"
+#include "Polynomial.hpp"
+#include "Normalize.hpp"
+#include "StrengthReduce.hpp"
+#include "PassManager.hpp"
+#include "Rewrite.hpp"
+#include "FormulaCache.hpp"
+#include "FileParse.hpp"
+#include "BulkParse.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <thread>
 
 TEST(ExpressionParsingTest, SimpleAddition) {
     auto expr = make_expression<Real>("2 + 3");
@@ -30,6 +49,216 @@ TEST(ExpressionParsingTest, SinFunction) {
     EXPECT_EQ(expr.eval(vars), 0);
 }
 
+TEST(ExpressionParsingTest, UnaryMinusAndNames) {
+    std::map<std::string, Real> vars = {{"x", 3}, {"y", 2}, {"t0", 0.5}};
+    EXPECT_EQ(make_expression<Real>("-x ^ 2").eval(vars), -9);
+    EXPECT_EQ(make_expression<Real>("y ^ -1").eval(vars), 0.5);
+    EXPECT_EQ(make_expression<Real>("x * -(y + 1)").eval(vars), -9);
+    EXPECT_EQ(make_expression<Real>("(-SIN(0) + 2 ^ 3 ^ 2) - 1 - 1").eval(vars), 62);
+    EXPECT_EQ(make_expression<Real>("exp(-k * t0)").to_string(), "exp(((-1.000000*k)*t0))");
+
+    EXPECT_THROW(make_expression<Real>("sin x"), std::runtime_error);
+    EXPECT_THROW(make_expression<Real>("sin()"), std::runtime_error);
+    EXPECT_THROW(make_expression<Real>("(x + 1"), std::runtime_error);
+    EXPECT_THROW(make_expression<Real>("x + 1)"), std::runtime_error);
+    EXPECT_THROW(make_expression<Real>("x * / y"), std::runtime_error);
+    EXPECT_THROW(make_expression<Real>(""), std::runtime_error);
+}
+
+TEST(ExpressionParsingTest, ScientificAndComplexLiterals) {
+    EXPECT_EQ(make_expression<Real>("1e-9").eval({}), 1e-9L);
+    EXPECT_EQ(make_expression<Real>(".5 + 5.").eval({}), 5.5L);
+    EXPECT_EQ(make_expression<Real>("2.5E+3 * x").eval({{"x", 2}}), 5000);
+    EXPECT_EQ(make_expression<double>("0.1").eval({}), 0.1);
+    EXPECT_EQ(make_expression<float>("1e-3").eval({}), 1e-3f);
+    EXPECT_THROW(make_expression<Real>("1.5.2"), std::runtime_error);
+    EXPECT_THROW(make_expression<Real>("."), std::runtime_error);
+
+    EXPECT_EQ(make_expression<Complex>("2 + 3.5i").eval({}), Complex(2, 3.5));
+    EXPECT_EQ(make_expression<Complex>("1e1i * i").eval({}), Complex(-10, 0));
+    EXPECT_EQ(ParseComplex("-1.5-2e-1i"), Complex(-1.5, -0.2L));
+    EXPECT_EQ(ParseComplex("4i"), Complex(0, 4));
+    EXPECT_EQ(ParseComplex("2-i"), Complex(2, -1));
+    EXPECT_EQ(ParseComplex("7"), Complex(7, 0));
+    EXPECT_THROW(ParseComplex("2+3"), std::runtime_error);
+    EXPECT_THROW(ParseComplex("x"), std::runtime_error);
+}
+
+TEST(ExpressionParsingTest, FunctionTableAndUserFunctions) {
+    static_assert(builtin_function("sqrt") == ExprType::Sqrt);
+    static_assert(!builtin_function("sigmoid"));
+
+    define_function<Real>("sigmoid", "x", "1 / (1 + exp(-x))");
+    define_function<Real>("sq", [](std::shared_ptr<Node<Real>> arg) { return make<Real>(ExprType::Multiply, arg, arg); });
+
+    auto expr = make_expression<Real>("SIGMOID(2 * y) + sq(y + 1)");
+    std::map<std::string, Real> vars = {{"y", 0.25}};
+    Real s = 1 / (1 + std::exp(-0.5L));
+    EXPECT_NEAR(expr.eval(vars), s + 1.5625L, 1e-15);
+    EXPECT_NEAR(expr.diff("y").eval(vars), 2 * s * (1 - s) + 2.5L, 1e-15);
+
+    EXPECT_THROW(define_function<Real>("sigmoid", "x", "x"), std::runtime_error);
+    EXPECT_THROW(define_function<Real>("Sin", "x", "x"), std::runtime_error);
+    EXPECT_THROW(define_function<Real>("2f", "x", "x"), std::runtime_error);
+    EXPECT_THROW(make_expression<Real>("sigmoid + 1"), std::runtime_error);
+}
+
+TEST(ExpressionParsingTest, TryParseReportsKindAndOffset) {
+    auto ok = try_parse<Real>("2 * x + 1");
+    ASSERT_TRUE(ok.has_value());
+    EXPECT_EQ(ok->eval({{"x", 3}}), 7);
+
+    struct Case
+    {
+        const char *text;
+        ParseErrorKind kind;
+        size_t offset;
+    };
+    const Case cases[] = {
+        {"x + 1)", ParseErrorKind::UnexpectedCharacter, 5},
+        {"x *", ParseErrorKind::UnexpectedEnd, 3},
+        {"(x + 1", ParseErrorKind::ExpectedParen, 6},
+        {"sin x", ParseErrorKind::ExpectedArgumentParen, 4},
+        {"cos( )", ParseErrorKind::EmptyArgument, 5},
+        {"1 + . * 2", ParseErrorKind::InvalidNumber, 4},
+        {"x * / y", ParseErrorKind::UnexpectedCharacter, 4},
+        {"", ParseErrorKind::UnexpectedEnd, 0},
+    };
+    for (const auto &c : cases)
+    {
+        auto result = try_parse<Real>(c.text);
+        ASSERT_FALSE(result.has_value()) << c.text;
+        EXPECT_EQ(result.error().kind, c.kind) << c.text;
+        EXPECT_EQ(result.error().offset, c.offset) << c.text;
+    }
+    EXPECT_EQ(try_parse<Real>("(x))").error().message(), "Unexpected ')' at position 3");
+
+    std::string deep = std::string(Parser<Real>::max_depth + 1, '(') + "x" + std::string(Parser<Real>::max_depth + 1, ')');
+    EXPECT_EQ(try_parse<Real>(deep).error().kind, ParseErrorKind::TooDeep);
+}
+
+TEST(ExpressionParsingTest, DeepAndLongInputsInOnePass) {
+    // Вложенные функции раньше копировали аргумент на каждом уровне
+    const int depth = 4000;
+    std::string nested;
+    for (int k = 0; k < depth; ++k)
+        nested += k % 2 ? "sin(" : "cos(";
+    nested += "x";
+    nested += std::string(depth, ')');
+    EXPECT_EQ(count_nodes(make_expression<Real>(nested).getRoot()), (size_t)depth + 1);
+
+    std::string sum = "x";
+    for (int k = 1; k < 20000; ++k)
+        sum += " + " + std::to_string(k % 10) + " * x";
+    EXPECT_GT(sum.size(), 100000u);
+    EXPECT_NEAR(make_expression<Real>(sum).eval({{"x", 1}}), 90001, 1e-9);
+}
+
+TEST(FileParseTest, ParsesLargeFileThroughMmapAndFd) {
+    // 200000 слагаемых: ни текст в памяти, ни рекурсия деструкторов не нужны
+    auto path = std::filesystem::temp_directory_path() / "differentiator_large_formula.txt";
+    const size_t terms = 200000;
+    {
+        std::ofstream out(path);
+        out << "x";
+        for (size_t k = 1; k < terms; ++k)
+            out << (k % 2 ? " + y" : " + x");
+        out << "\n";
+    }
+    auto spine = [](const Expression<Real> &expr)
+    {
+        size_t adds = 0;
+        auto node = expr.getRoot();
+        while (node->getType() == ExprType::Add)
+        {
+            ++adds;
+            node = static_cast<const BinaryOpNode<Real> *>(node.get())->getLeft();
+        }
+        return adds;
+    };
+
+    auto mapped = try_parse_file<Real>(path.string());
+    ASSERT_TRUE(mapped.has_value());
+    EXPECT_EQ(spine(*mapped), terms - 1);
+
+    // Маленький буфер заставляет дочитывать посреди лексем
+    int fd = ::open(path.c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    auto streamed = try_parse_fd<Real>(fd, 7);
+    ::close(fd);
+    ASSERT_TRUE(streamed.has_value());
+    EXPECT_EQ(spine(*streamed), terms - 1);
+    std::filesystem::remove(path);
+
+    auto missing = try_parse_file<Real>("/nonexistent/formula.txt");
+    ASSERT_FALSE(missing.has_value());
+    EXPECT_EQ(missing.error().kind, ParseErrorKind::InputError);
+}
+
+TEST(FileParseTest, StreamedErrorsMatchInMemoryParser) {
+    const char *texts[] = {"sin(x) * 2.5e3 + cos(y)", "x + 1)", "(x + 1", "sin x", "1 + . * 2", "12345678901234.5 ^ y",
+                           ""};
+    int fds[2];
+    for (const char *text : texts)
+    {
+        ASSERT_EQ(::pipe(fds), 0);
+        ASSERT_EQ(::write(fds[1], text, std::strlen(text)), (ssize_t)std::strlen(text));
+        ::close(fds[1]);
+        auto streamed = try_parse_fd<Real>(fds[0], 4);
+        ::close(fds[0]);
+        auto direct = try_parse<Real>(text);
+        ASSERT_EQ(streamed.has_value(), direct.has_value()) << text;
+        if (direct)
+            EXPECT_EQ(streamed->eval({{"x", 1}, {"y", 2}}), direct->eval({{"x", 1}, {"y", 2}})) << text;
+        else
+        {
+            EXPECT_EQ(streamed.error().kind, direct.error().kind) << text;
+            EXPECT_EQ(streamed.error().offset, direct.error().offset) << text;
+        }
+    }
+}
+
+TEST(BulkParseTest, KeepsOrderAndSharesNodesAcrossThreads) {
+    std::vector<std::string> lines;
+    for (int k = 0; k < 5000; ++k)
+        lines.push_back(k % 97 == 0 ? "sin(x" : "sin(x) * " + std::to_string(k % 50) + " + y");
+    std::vector<std::string_view> views(lines.begin(), lines.end());
+
+    auto batch = parse_many<Real>(views, 4, 64);
+    ASSERT_EQ(batch.results.size(), lines.size());
+    EXPECT_EQ(batch.errors, 52u);
+    for (size_t k = 0; k < lines.size(); ++k)
+    {
+        auto expected = try_parse<Real>(lines[k]);
+        ASSERT_EQ(batch.results[k].has_value(), expected.has_value()) << k;
+        if (expected)
+            EXPECT_EQ(batch.results[k]->eval({{"x", 1}, {"y", 2}}), expected->eval({{"x", 1}, {"y", 2}})) << k;
+        else
+            EXPECT_EQ(batch.results[k].error().offset, 5u) << k;
+    }
+    // Одинаковые строки из блоков разных потоков — один и тот же узел
+    EXPECT_EQ(batch.results[1]->getRoot(), batch.results[4951]->getRoot());
+    // x, y, sin(x), константы 2..49, их произведения с sin(x) и 49 сумм с y (*0 и *1 сворачиваются)
+    EXPECT_EQ(batch.context.size(), 3u + 48 + 48 + 49);
+}
+
+TEST(BulkParseTest, ParsesLinesOfFile) {
+    auto path = std::filesystem::temp_directory_path() / "differentiator_formula_lines.txt";
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << "x + 1\r\n2 * y\n(z\nexp(0)\n";
+    }
+    auto batch = parse_lines_file<Real>(path.string(), 2, 1);
+    std::filesystem::remove(path);
+    ASSERT_EQ(batch.results.size(), 4u);
+    EXPECT_EQ(batch.results[0]->eval({{"x", 2}}), 3);
+    EXPECT_EQ(batch.results[1]->eval({{"y", 2}}), 4);
+    ASSERT_FALSE(batch.results[2].has_value());
+    EXPECT_EQ(batch.results[2].error().kind, ParseErrorKind::ExpectedParen);
+    EXPECT_EQ(batch.results[3]->eval({}), 1);
+    EXPECT_THROW(parse_lines_file<Real>("/nonexistent/formulas.txt"), std::runtime_error);
+}
+
 TEST(SymbolicDifferentiationTest, PowerFunction) {
     auto expr = make_expression<Real>("x ^ 2");
     auto diff_expr = expr.diff("x");
@@ -51,6 +280,729 @@ TEST(SymbolicDifferentiationTest, LnFunction) {
     EXPECT_EQ(diff_expr.eval(vars), 1);
 }
 
+TEST(SymbolicDifferentiationTest, ConstantExponentAtZero) {
+    auto diff_expr = make_expression<Real>("x ^ 3").diff("x");
+    EXPECT_EQ(diff_expr.to_string().find("ln"), std::string::npos);
+    EXPECT_EQ(diff_expr.to_string().find("/"), std::string::npos);
+    EXPECT_EQ(diff_expr.eval({{"x", 0}}), 0);
+    EXPECT_EQ(diff_expr.eval({{"x", -2}}), 12);
+}
+
+TEST(SymbolicDifferentiationTest, SpecialisedRules) {
+    std::map<std::string, Real> vars = {{"x", -1.5}};
+    EXPECT_EQ(make_expression<Real>("x / 4").diff("x").eval(vars), 0.25);
+    EXPECT_NEAR(make_expression<Real>("2 ^ x").diff("x").eval(vars), std::pow(2.0L, -1.5L) * std::log(2.0L), 1e-15);
+    EXPECT_EQ(make_expression<Real>("exp(ln(x))").diff("x").eval(vars), 1);
+    EXPECT_NEAR(make_expression<Real>("ln(x ^ 2)").diff("x").eval(vars), 2 / -1.5L, 1e-15);
+    EXPECT_NEAR(make_expression<Real>("3 / x").diff("x").eval(vars), -3 / 2.25L, 1e-15);
+}
+
+TEST(CompiledExpressionTest, GradientMatchesSymbolic) {
+    auto expr = make_expression<Real>("x ^ 3 * y + sin(x * y)");
+    CompiledExpression<Real> compiled(expr);
+    std::map<std::string, Real> vars = {{"x", 1.5}, {"y", -0.5}};
+    auto grad = compiled.gradient(vars);
+    ASSERT_EQ(compiled.variables(), (std::vector<std::string>{"x", "y"}));
+    EXPECT_NEAR(grad[0], expr.diff("x").eval(vars), 1e-12);
+    EXPECT_NEAR(grad[1], expr.diff("y").eval(vars), 1e-12);
+    EXPECT_NEAR(compiled.eval(vars), expr.eval(vars), 1e-12);
+}
+
+TEST(CompiledExpressionTest, HessianMatchesSymbolic) {
+    auto expr = make_expression<Real>("x ^ 3 * y + sin(x * y) + exp(y) / x");
+    CompiledExpression<Real> compiled(expr);
+    std::map<std::string, Real> vars = {{"x", 1.5}, {"y", -0.5}};
+    auto H = compiled.hessian(vars);
+    std::vector<std::string> names = {"x", "y"};
+    for (int i = 0; i < 2; ++i)
+        for (int j = 0; j < 2; ++j)
+            EXPECT_NEAR(H[i][j], expr.diff(names[i]).diff(names[j]).eval(vars), 1e-10);
+    EXPECT_EQ(H[0][1], H[1][0]);
+}
+
+TEST(CompiledExpressionTest, HvpMatchesHessianProduct) {
+    auto expr = make_expression<Real>("x ^ y + ln(x * z) * cos(z)");
+    CompiledExpression<Real> compiled(expr);
+    std::map<std::string, Real> vars = {{"x", 1.3}, {"y", 2.1}, {"z", 0.7}};
+    std::vector<Real> v = {0.5, -1, 2};
+    auto H = compiled.hessian(vars);
+    auto Hv = compiled.hvp(vars, v);
+    for (int i = 0; i < 3; ++i)
+    {
+        Real expected = 0;
+        for (int j = 0; j < 3; ++j)
+            expected += H[i][j] * v[j];
+        EXPECT_NEAR(Hv[i], expected, 1e-10);
+    }
+}
+
+TEST(SparseDerivativesTest, BandedJacobianMatchesDense) {
+    const int n = 12;
+    std::vector<Expression<Real>> system;
+    std::map<std::string, Real> vars;
+    for (int k = 0; k < n; ++k)
+    {
+        std::string x = "x" + std::string(1, 'a' + k);
+        vars[x] = 0.1 * (k + 1);
+        if (k + 1 < n)
+        {
+            std::string y = "x" + std::string(1, 'a' + k + 1);
+            system.push_back(make_expression<Real>(x + " * " + y + " + sin(" + x + ")"));
+        }
+    }
+    CompiledExpression<Real> compiled(system);
+    SparseJacobian<Real> jacobian(compiled);
+    EXPECT_LE(jacobian.sweeps(), 2);
+
+    auto csr = jacobian.compute(vars);
+    EXPECT_EQ(csr.nnz(), 2u * (n - 1));
+    auto coo = csr.to_coo();
+    for (size_t k = 0; k < coo.values.size(); ++k)
+    {
+        std::vector<Real> w(compiled.outputs().size(), 0);
+        w[coo.row[k]] = 1;
+        EXPECT_NEAR(coo.values[k], compiled.vjp(vars, w)[coo.col[k]], 1e-12);
+    }
+}
+
+TEST(SparseDerivativesTest, StarColoredHessianMatchesDense) {
+    std::string formula = "0";
+    std::map<std::string, Real> vars;
+    const int n = 10;
+    for (int k = 0; k < n; ++k)
+    {
+        std::string x = "x" + std::string(1, 'a' + k);
+        vars[x] = 0.3 + 0.1 * k;
+        if (k + 1 < n)
+            formula += " + sin(" + x + ") * x" + std::string(1, 'a' + k + 1);
+    }
+    CompiledExpression<Real> compiled(make_expression<Real>(formula));
+    SparseHessian<Real> hessian(compiled);
+    EXPECT_LT(hessian.sweeps(), n);
+
+    auto dense = compiled.hessian(vars);
+    auto coo = hessian.compute(vars).to_coo();
+    for (size_t k = 0; k < coo.values.size(); ++k)
+        EXPECT_NEAR(coo.values[k], dense[coo.row[k]][coo.col[k]], 1e-12);
+    size_t dense_nnz = 0;
+    for (auto &row : dense)
+        for (Real h : row)
+            dense_nnz += h != 0;
+    EXPECT_EQ(coo.values.size(), dense_nnz);
+}
+
+TEST(CompiledExpressionTest, TaylorMatchesRepeatedDiff) {
+    auto expr = make_expression<Real>("sin(x) * exp(x / 2) + ln(x) ^ 2 + x ^ 0.5 * cos(y)");
+    CompiledExpression<Real> compiled(expr);
+    std::map<std::string, Real> vars = {{"x", 1.2}, {"y", 0.4}};
+    auto coefs = compiled.taylor(vars, "x", 4);
+    ASSERT_EQ(coefs.size(), 5u);
+
+    auto derivative = expr;
+    Real factorial = 1;
+    for (int k = 0; k <= 4; ++k)
+    {
+        if (k > 0)
+        {
+            derivative = derivative.diff("x");
+            factorial *= k;
+        }
+        EXPECT_NEAR(coefs[k] * factorial, derivative.eval(vars), 1e-9);
+    }
+}
+
+TEST(CompiledExpressionTest, TaylorIntegerPowerAtZero) {
+    CompiledExpression<Real> compiled(make_expression<Real>("x ^ 3"));
+    auto coefs = compiled.taylor({{"x", 0}}, "x", 4);
+    EXPECT_EQ(coefs, (std::vector<Real>{0, 0, 0, 1, 0}));
+}
+
+TEST(CompiledExpressionTest, FusesSinCosAndSharesExp) {
+    // В производной sin(x*y) появляется cos от копии x*y, exp(x+y) копируется целиком
+    auto expr = make_expression<double>("sin(x * y) * exp(x + y)");
+    auto derivative = expr.diff("x");
+    CompiledExpression<double> compiled(derivative);
+
+    int sin_slot = -1, cos_slot = -1, exps = 0;
+    const auto &code = compiled.instructions();
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        sin_slot = code[i].op == ExprType::Sin ? (int)i : sin_slot;
+        cos_slot = code[i].op == ExprType::Cos ? (int)i : cos_slot;
+        exps += code[i].op == ExprType::Exp;
+    }
+    ASSERT_GE(sin_slot, 0);
+    ASSERT_GE(cos_slot, 0);
+    EXPECT_EQ(code[sin_slot].lhs, code[cos_slot].lhs);
+    EXPECT_EQ(compiled.sincos_partner(sin_slot), cos_slot);
+    EXPECT_EQ(compiled.sincos_partner(cos_slot), sin_slot);
+    EXPECT_EQ(exps, 1);
+
+    std::map<std::string, double> vars = {{"x", 0.4}, {"y", -1.1}};
+    EXPECT_NEAR(compiled.eval(vars), derivative.eval(vars), 1e-14);
+    auto grad = compiled.gradient(vars);
+    EXPECT_NEAR(grad[0], derivative.diff("x").eval(vars), 1e-13);
+    EXPECT_NEAR(grad[1], derivative.diff("y").eval(vars), 1e-13);
+
+    BatchEvaluator<double> batch(compiled, 8);
+    std::vector<double> inputs = {0.4, 0.9, -0.3, -1.1, 0.2, 2.0};
+    auto values = batch.eval(inputs, 3);
+    auto batch_grad = batch.gradient(inputs, 3);
+    for (size_t r = 0; r < 3; ++r)
+    {
+        std::map<std::string, double> row = {{"x", inputs[r]}, {"y", inputs[3 + r]}};
+        auto expected = compiled.gradient(row);
+        EXPECT_NEAR(values[r], compiled.eval(row), 1e-14);
+        EXPECT_NEAR(batch_grad[r], expected[0], 1e-13);
+        EXPECT_NEAR(batch_grad[3 + r], expected[1], 1e-13);
+    }
+}
+
+TEST(BatchEvaluatorTest, GradientMatchesPointwise) {
+    auto expr = make_expression<double>("x ^ 2 * sin(y) + exp(x / y) - ln(y) * x");
+    CompiledExpression<double> compiled(expr);
+    BatchEvaluator<double> batch(compiled, 64);
+
+    const size_t n_rows = 1000;
+    std::vector<double> inputs(2 * n_rows);
+    for (size_t r = 0; r < n_rows; ++r)
+    {
+        inputs[r] = 0.001 * r - 0.3;
+        inputs[n_rows + r] = 1 + 0.002 * r;
+    }
+    auto values = batch.eval(inputs, n_rows);
+    auto grad = batch.gradient(inputs, n_rows);
+    ASSERT_EQ(grad.size(), 2 * n_rows);
+
+    for (size_t r = 0; r < n_rows; r += 37)
+    {
+        std::map<std::string, double> vars = {{"x", inputs[r]}, {"y", inputs[n_rows + r]}};
+        auto expected = compiled.gradient(vars);
+        EXPECT_NEAR(values[r], compiled.eval(vars), 1e-12);
+        EXPECT_NEAR(grad[r], expected[0], 1e-12);
+        EXPECT_NEAR(grad[n_rows + r], expected[1], 1e-12);
+    }
+}
+
+TEST(BatchEvaluatorTest, HoistsParameterSubtrees) {
+    auto expr = make_expression<double>("exp((0 - k) * s) * sin(x) + k * s / (1 + x ^ 2)");
+    CompiledExpression<double> compiled(expr);
+    BatchEvaluator<double> plain(compiled, 32);
+    BatchEvaluator<double> hoisted(compiled, 32, {"k", "s"});
+
+    // exp(-k*s) и k*s не зависят от строки, sin(x) и всё, что от него, — зависят
+    size_t invariant = 0;
+    for (size_t i = 0; i < compiled.size(); ++i)
+        invariant += hoisted.is_invariant(i);
+    EXPECT_GE(invariant, 7u);
+    EXPECT_FALSE(hoisted.is_invariant(compiled.outputs()[0]));
+
+    const size_t n_rows = 100;
+    const auto &vars = compiled.variables();
+    std::vector<double> inputs(vars.size() * n_rows);
+    for (size_t k = 0; k < vars.size(); ++k)
+        for (size_t r = 0; r < n_rows; ++r)
+            inputs[k * n_rows + r] = vars[k] == "x" ? 0.01 * r : (vars[k] == "k" ? 0.7 : 1.3);
+
+    EXPECT_EQ(hoisted.eval(inputs, n_rows), plain.eval(inputs, n_rows));
+    EXPECT_EQ(hoisted.gradient(inputs, n_rows), plain.gradient(inputs, n_rows));
+
+    inputs[n_rows - 1] += 1; // первый столбец — параметр k
+    EXPECT_THROW(hoisted.eval(inputs, n_rows), std::runtime_error);
+}
+
+TEST(CheckpointedTapeTest, GradientWithinBudget) {
+    std::string formula = "x";
+    for (int k = 0; k < 300; ++k)
+        formula = "sin(" + formula + ") * y + " + std::to_string(k % 7) + " * x / (1 + y ^ 2)";
+    CompiledExpression<Real> compiled(make_expression<Real>(formula));
+    std::map<std::string, Real> vars = {{"x", 0.4}, {"y", 0.9}};
+    auto expected = compiled.gradient(vars);
+
+    CheckpointedTape<Real> tape(compiled, 64 * sizeof(Real));
+    EXPECT_GT(tape.segments(), 1u);
+    CheckpointStats stats;
+    auto grad = tape.gradient(vars, &stats);
+    EXPECT_NEAR(grad[0], expected[0], 1e-9);
+    EXPECT_NEAR(grad[1], expected[1], 1e-9);
+    EXPECT_GT(stats.overhead(), 1);
+    EXPECT_LE(stats.peak_values, 64u);
+
+    CheckpointedTape<Real> unbounded(compiled, compiled.size() * 8 * sizeof(Real));
+    EXPECT_EQ(unbounded.segments(), 1u);
+    grad = unbounded.gradient(vars, &stats);
+    EXPECT_NEAR(grad[0], expected[0], 1e-9);
+    EXPECT_EQ(stats.overhead(), 1);
+}
+
+TEST(LetDiffTest, MatchesTreeDiff) {
+    auto expr = make_expression<Real>("sin(x ^ 2 * y + ln(x)) * exp(x * y) / (1 + x)");
+    auto let = diff_let(expr, "x");
+    std::map<std::string, Real> vars = {{"x", 0.7}, {"y", 1.3}};
+    Real expected = expr.diff("x").eval(vars);
+    EXPECT_NEAR(let.eval(vars), expected, 1e-12);
+
+    CompiledExpression<Real> compiled(let.inline_all());
+    EXPECT_NEAR(compiled.eval(vars), expected, 1e-12);
+    // Лента сама объединяет одинаковые поддеревья, поэтому выигрыш виден на уровне узлов выражения
+    EXPECT_LT(count_nodes(let.inline_all().getRoot()), count_nodes(expr.diff("x").getRoot()));
+    EXPECT_LE(compiled.size(), CompiledExpression<Real>(expr.diff("x")).size());
+}
+
+TEST(LetDiffTest, SharesArgumentOfChainRule) {
+    auto let = diff_let(make_expression<Real>("sin(x * y)"), "x");
+    ASSERT_EQ(let.bindings().size(), 1u);
+    EXPECT_EQ(let.bindings()[0].first, "t1");
+    EXPECT_EQ(let.to_string(), "t1 = (x*y)\nresult = (cos(t1)*y)");
+}
+
+TEST(CseTest, SharesRepeatedSubexpressions) {
+    auto expr = make_expression<Real>("(x ^ 2 + y ^ 2) / (x ^ 2 + y ^ 2 + 1) + sin(y ^ 2 + x ^ 2)");
+    size_t removed = 0;
+    auto shared = cse(expr, &removed);
+    EXPECT_EQ(removed, 15u);
+    EXPECT_EQ(count_nodes(shared.getRoot()) + removed, count_nodes(expr.getRoot()));
+
+    std::map<std::string, Real> vars = {{"x", 0.3}, {"y", 1.7}};
+    CompiledExpression<Real> compiled(shared);
+    EXPECT_EQ(compiled.size(), count_nodes(shared.getRoot()));
+    EXPECT_NEAR(compiled.eval(vars), expr.eval(vars), 1e-15);
+
+    // -0 и 0 не объединяются: 0^-1 + (-0)^-1 = inf - inf = nan
+    auto zeros = Expression<Real>(make<Real>(ExprType::Add,
+                                             make<Real>(ExprType::Power, make_const<Real>(0), make_const<Real>(-1)),
+                                             make<Real>(ExprType::Power, make_const<Real>(-0.0L), make_const<Real>(-1))));
+    ASSERT_TRUE(std::isnan(zeros.eval({})));
+    EXPECT_TRUE(std::isnan(cse(zeros).eval({})));
+}
+
+TEST(CseTest, ParsesStraightIntoTable) {
+    HashCons<Real> table;
+    auto a = try_parse_into(table, "sin(x * y) + 2 * y");
+    auto b = try_parse_into(table, "2 * y - sin(y * x)");
+    ASSERT_TRUE(a.has_value() && b.has_value());
+    // Оба выражения из одних и тех же узлов: 2 + 2 новых узла сверху общих x, y, x*y, sin, 2, 2*y
+    EXPECT_EQ(table.size(), 8u);
+    auto sum = static_cast<const BinaryOpNode<Real> *>(a->getRoot().get());
+    auto diff = static_cast<const BinaryOpNode<Real> *>(b->getRoot().get());
+    EXPECT_EQ(sum->getLeft(), diff->getRight());
+    EXPECT_EQ(sum->getRight(), diff->getLeft());
+
+    std::map<std::string, Real> vars = {{"x", 0.4}, {"y", 1.3}};
+    EXPECT_EQ(a->eval(vars), make_expression<Real>("sin(x * y) + 2 * y").eval(vars));
+    EXPECT_EQ(b->eval(vars), make_expression<Real>("2 * y - sin(y * x)").eval(vars));
+    EXPECT_FALSE(try_parse_into(table, "sin(x").has_value());
+
+    // 0 + e и 0 - e не копируют e
+    auto e = make_expression<Real>("exp(x) * y").getRoot();
+    EXPECT_EQ(del_zero<Real>(ExprType::Add, make_const<Real>(0), e), e);
+    auto negated = del_zero<Real>(ExprType::Subtract, make_const<Real>(0), e);
+    EXPECT_EQ(static_cast<const BinaryOpNode<Real> *>(negated.get())->getRight(), e);
+}
+
+TEST(EGraphTest, ShrinksDerivative) {
+    auto expr = make_expression<Real>("sin(x) ^ 2 + cos(x) ^ 2 + exp(ln(x * y)) * 3");
+    auto diff = expr.diff("x");
+    EGraphStats stats;
+    auto best = egraph_optimize(diff, EGraphOptions{}, &stats);
+    EXPECT_GT(stats.iterations, 0u);
+    EXPECT_LT(stats.cost_after, stats.cost_before);
+    EXPECT_EQ(stats.cost_after, tree_cost(best.getRoot(), CostModel{}));
+
+    std::map<std::string, Real> vars = {{"x", 0.8}, {"y", 1.9}};
+    EXPECT_NEAR(best.eval(vars), diff.eval(vars), 1e-12);
+}
+
+TEST(EGraphTest, AppliesIdentities) {
+    CostModel cost;
+    auto simplify = [](const std::string &text) { return egraph_optimize(make_expression<Real>(text)); };
+    EXPECT_EQ(tree_cost(simplify("sin(x) ^ 2 + cos(x) ^ 2").getRoot(), cost), 1);
+    EXPECT_EQ(simplify("ln(exp(x + 1)) - 1").to_string(), "x");
+    EXPECT_EQ(simplify("x ^ 2").to_string(), "(x*x)");
+    EXPECT_EQ(tree_cost(simplify("exp(x) * exp(y)").getRoot(), cost), cost(ExprType::Exp) + 3);
+}
+
+TEST(EGraphTest, KeepsDomainUnlessFast) {
+    // ln(x^4) определён при x = -1, 4*ln(x) — нет
+    auto even = make_expression<Real>("ln(x ^ 4)");
+    EXPECT_EQ(egraph_optimize(even).eval({{"x", -1}}), 0);
+    auto odd = egraph_optimize(make_expression<Real>("ln(x ^ 3)"));
+    EXPECT_NEAR(odd.eval({{"x", 2}}), 3 * std::log(2.0L), 1e-15);
+
+    auto exp_ln = make_expression<Real>("exp(ln(x)) + x / x");
+    auto exact = egraph_optimize(exp_ln);
+    EXPECT_THROW(exact.eval({{"x", -1}}), std::runtime_error);
+    EXPECT_THROW(exact.eval({{"x", 0}}), std::runtime_error);
+
+    EGraphOptions fast;
+    fast.policy = MathPolicy::Fast;
+    auto relaxed = egraph_optimize(exp_ln, fast);
+    EXPECT_EQ(relaxed.to_string(), "(x+1.000000)");
+    EXPECT_EQ(egraph_optimize(make_expression<Real>("ln(x) + ln(y)"), fast).eval({{"x", -1}, {"y", -2}}),
+              std::log(2.0L));
+}
+
+TEST(PolynomialTest, CollectsTermsAndEvaluatesByHorner) {
+    auto poly = to_polynomial(make_expression<Real>("(x + y) ^ 3 - x * (x ^ 2 + 3 * y ^ 2) + 2 * y / 4"));
+    ASSERT_TRUE(poly.has_value());
+    // 3x^2 y + y^3 + y/2
+    EXPECT_EQ(poly->size(), 3u);
+    EXPECT_EQ(poly->degree(), 3u);
+    EXPECT_EQ(poly->getTerms().at({2, 1}), 3);
+
+    std::map<std::string, Real> vars = {{"x", 1.3}, {"y", -0.7}};
+    Real expected = 3 * 1.3 * 1.3 * -0.7 + std::pow(-0.7L, 3) - 0.35;
+    EXPECT_NEAR(poly->eval(vars), expected, 1e-15);
+    EXPECT_NEAR(poly->to_expression().eval(vars), expected, 1e-15);
+    EXPECT_EQ(to_polynomial(poly->to_expression()), poly);
+
+    EXPECT_FALSE(to_polynomial(make_expression<Real>("x ^ y + 1")).has_value());
+}
+
+TEST(PolynomialTest, HornerFormKeepsNonPolynomialParts) {
+    auto expr = make_expression<Real>("sin(x * x + 2 * x + 1) + exp(y) * (y - 1) ^ 2");
+    auto horner = horner_form(expr);
+    std::map<std::string, Real> vars = {{"x", 0.4}, {"y", 1.1}};
+    EXPECT_NEAR(horner.eval(vars), expr.eval(vars), 1e-15);
+    // (y - 1)^2 короче своей формы Горнера ((y - 2)*y) + 1 и остаётся
+    EXPECT_EQ(horner.to_string(), "(sin((((x+2.000000)*x)+1.000000))+(exp(y)*((y-1.000000)^2.000000)))");
+}
+
+TEST(PolynomialTest, HornerFormDoesNotExpandPowersOfLongSums) {
+    // (a+...+h)^16 — 245157 мономов: многочлен не строится, выражение остаётся прежним
+    auto big = make_expression<Real>("(a + b + c + d + e + f + g + h) ^ 16");
+    EXPECT_FALSE(to_polynomial(big).has_value());
+    auto kept = horner_form(big);
+    EXPECT_EQ(kept.getRoot()->getType(), ExprType::Power);
+    EXPECT_EQ(count_nodes(kept.getRoot()), count_nodes(big.getRoot()));
+
+    // Раскрытие малой степени строится, но оно длиннее исходника и отбрасывается
+    auto small = make_expression<Real>("(a + b + c + d + e + f) ^ 3 + x * x");
+    EXPECT_TRUE(to_polynomial(small).has_value());
+    auto horner = horner_form(small);
+    EXPECT_LE(count_nodes(horner.getRoot()), count_nodes(small.getRoot()));
+    std::map<std::string, Real> vars = {{"a", 1}, {"b", 2}, {"c", 3}, {"d", 4}, {"e", 5}, {"f", 6}, {"x", 0.5}};
+    EXPECT_NEAR(horner.eval(vars), small.eval(vars), 1e-12);
+}
+
+TEST(NormalizeTest, FoldsConstantsAcrossChains) {
+    size_t iterations = 0;
+    EXPECT_EQ(normalize(make_expression<Real>("2 * x * 3"), MathPolicy::Fast, &iterations).to_string(), "(6.000000*x)");
+    EXPECT_EQ(iterations, 2u);
+    EXPECT_EQ(normalize(make_expression<Real>("(x + 1) + 2"), MathPolicy::Fast).to_string(), "(x+3.000000)");
+    EXPECT_EQ(normalize(make_expression<Real>("2 * x + y + 3 * x - 1 - 4"), MathPolicy::Fast).to_string(),
+              "(((5.000000*x)+y)-5.000000)");
+    EXPECT_EQ(normalize(make_expression<Real>("x - (y + x)"), MathPolicy::Fast).to_string(), "(-y)");
+    EXPECT_EQ(normalize(Expression<Real>("a") + Expression<Real>(-1) * Expression<Real>("b"), MathPolicy::Fast).to_string(),
+              "(a-b)");
+
+    auto neg = normalize(make_expression<Real>("y * sin(x) / (0 - 2)"), MathPolicy::Fast);
+    EXPECT_EQ(neg.to_string(), "(-0.500000*(y*sin(x)))");
+    std::map<std::string, Real> vars = {{"x", 0.3}, {"y", 1.4}, {"a", 2}, {"b", 5}};
+    EXPECT_NEAR(neg.eval(vars), -std::sin(0.3L) * 1.4L / 2, 1e-15);
+}
+
+TEST(NormalizeTest, ProducesNegateAndFoldsComplex) {
+    auto neg = normalize(Expression<Real>(-1) * make_expression<Real>("x + y"), MathPolicy::Fast);
+    EXPECT_EQ(neg.getRoot()->getType(), ExprType::Negate);
+    EXPECT_EQ(neg.to_string(), "(-(x+y))");
+    std::map<std::string, Real> vars = {{"x", 0.3}, {"y", 1.4}};
+    EXPECT_NEAR(neg.diff("x").eval(vars), -1, 1e-15);
+    EXPECT_NEAR(CompiledExpression<Real>(neg).gradient(vars)[1], -1, 1e-15);
+
+    auto c = normalize(make_expression<Complex>("(2 + 3 * i) * (1 - i) + z - z"), MathPolicy::Fast);
+    ASSERT_EQ(c.getRoot()->getType(), ExprType::Constant);
+    EXPECT_EQ(c.eval({}), Complex(5, 1));
+
+    EXPECT_THROW(normalize(make_expression<Real>("x / 0"), MathPolicy::Fast).eval({{"x", 1}}), std::runtime_error);
+    // Ноль в знаменателе вложенного деления тоже не сворачивается в inf
+    auto nested = normalize(make_expression<Real>("(x / (y - y)) * 2"), MathPolicy::Fast);
+    EXPECT_THROW(nested.eval({{"x", 1}, {"y", 2}}), std::runtime_error);
+    EXPECT_THROW(normalize(make_expression<Real>("3 / (x / 0)"), MathPolicy::Fast).eval({{"x", 1}}),
+                 std::runtime_error);
+}
+
+TEST(NormalizeTest, ExactPolicyKeepsEveryResult) {
+    auto exact = [](const char *text) { return normalize(make_expression<Real>(text)).to_string(); };
+    EXPECT_EQ(exact("2 + 3 + x"), "(5.000000+x)");
+    EXPECT_EQ(exact("x + 0.1 + 0.2"), "((x+0.100000)+0.200000)");
+    EXPECT_EQ(exact("2 * x * 3"), "(3.000000*(2.000000*x))");
+    EXPECT_EQ(exact("x / 3"), "(x/3.000000)");
+    EXPECT_EQ(exact("x / 4"), "(0.250000*x)");
+    EXPECT_EQ(exact("y * sin(x) / (0 - 2)"), "(-0.500000*(y*sin(x)))");
+    EXPECT_EQ(normalize(Expression<Real>("a") + Expression<Real>(-1) * Expression<Real>("b")).to_string(), "(a-b)");
+
+    // Сокращение меняет результат там, где слагаемое не конечно или не определено
+    auto difference = normalize(make_expression<Real>("x - x"));
+    EXPECT_EQ(difference.to_string(), "(x-x)");
+    EXPECT_TRUE(std::isnan(difference.eval({{"x", std::numeric_limits<Real>::infinity()}})));
+    auto logs = normalize(make_expression<Real>("ln(x) - ln(x)"));
+    EXPECT_EQ(logs.to_string(), "(ln(x)-ln(x))");
+    EXPECT_THROW(logs.eval({{"x", -1}}), std::runtime_error);
+}
+
+TEST(StrengthReduceTest, ExactPolicyKeepsResultsBitwise) {
+    auto expr = make_expression<Real>("x ^ 2 + y ^ (0 - 1) + x ^ 3 + x / 4 + y / 3 + exp(ln(x))");
+    auto reduced = strength_reduce(expr);
+    EXPECT_EQ(reduced.to_string(),
+              "((((((x*x)+(y^-1.000000))+(x^3.000000))+(x*0.250000))+(y/3.000000))+exp(ln(x)))");
+    std::map<std::string, Real> vars = {{"x", 1.7}, {"y", 0.3}};
+    EXPECT_EQ(reduced.eval(vars), expr.eval(vars));
+
+    // pow(0, -1) = inf, а 1/0 бросает: x^-1 -> 1/x только при Fast
+    auto inverse = make_expression<Real>("x ^ (0 - 1)");
+    EXPECT_EQ(strength_reduce(inverse).eval({{"x", 0}}), std::numeric_limits<Real>::infinity());
+    auto fast = strength_reduce(inverse, StrengthReduceOptions{MathPolicy::Fast});
+    EXPECT_EQ(fast.to_string(), "(1.000000/x)");
+    EXPECT_THROW(fast.eval({{"x", 0}}), std::runtime_error);
+}
+
+TEST(StrengthReduceTest, FastPolicyLowersPowersAndCompositions) {
+    StrengthReduceOptions fast{MathPolicy::Fast};
+    auto expr = make_expression<Real>("x ^ 5 + x ^ 0.5 + y ^ (0 - 2.5) + exp(ln(x)) + ln(exp(y)) + x / 3");
+    auto reduced = strength_reduce(expr, fast);
+    std::map<std::string, Real> vars = {{"x", 1.7}, {"y", 0.3}};
+    EXPECT_NEAR(reduced.eval(vars), expr.eval(vars), 1e-12);
+    EXPECT_EQ(reduced.to_string().find('^'), std::string::npos);
+    EXPECT_EQ(reduced.to_string().find("exp"), std::string::npos);
+    EXPECT_NE(reduced.to_string().find("sqrt(x)"), std::string::npos);
+
+    // x^5 = (x^2)^2 * x: три умножения на общих узлах
+    CompiledExpression<Real> power(strength_reduce(make_expression<Real>("x ^ 5"), fast));
+    EXPECT_EQ(power.size(), 4u);
+
+    fast.reciprocal_division = false;
+    EXPECT_EQ(strength_reduce(make_expression<Real>("x / 3"), fast).to_string(), "(x/3.000000)");
+
+    auto sqrt_expr = make_expression<Real>("sqrt(x * y)");
+    EXPECT_NEAR(sqrt_expr.diff("x").eval(vars), 0.5 * 0.3 / std::sqrt(1.7L * 0.3L), 1e-15);
+    EXPECT_NEAR(CompiledExpression<Real>(sqrt_expr).taylor(vars, "x", 3)[2], -0.125 * 0.09 / std::pow(0.51L, 1.5L),
+                1e-15);
+}
+
+TEST(SpecializeTest, FoldsBoundVariables) {
+    auto expr = make_expression<Real>("a * x ^ 2 + sin(b * a) * x + exp(b) / a - ln(b)");
+    std::map<std::string, Real> job = {{"a", 1.5}, {"b", 2}};
+    auto special = expr.specialize(job);
+    EXPECT_LT(count_nodes(special.getRoot()), count_nodes(expr.getRoot()));
+
+    std::set<std::string> names;
+    collect_variables(special.getRoot(), names);
+    EXPECT_EQ(names, std::set<std::string>{"x"});
+
+    std::map<std::string, Real> all = {{"a", 1.5}, {"b", 2}, {"x", 0.7}};
+    EXPECT_NEAR(special.eval({{"x", 0.7}}), expr.eval(all), 1e-15);
+
+    CompiledExpression<Real> compiled(expr);
+    auto tape = compiled.specialize(job);
+    EXPECT_EQ(tape.variables(), std::vector<std::string>{"x"});
+    EXPECT_LT(tape.size(), compiled.size());
+    EXPECT_NEAR(tape.eval({{"x", 0.7}}), compiled.eval(all), 1e-15);
+    EXPECT_NEAR(tape.gradient({{"x", 0.7}})[0], compiled.gradient(all)[2], 1e-15);
+
+    // Ошибка вычисления не сворачивается, а возникает при вычислении
+    auto bad = make_expression<Real>("x / (a - 1.5)").specialize(job);
+    EXPECT_THROW(bad.eval({{"x", 1}}), std::runtime_error);
+    // 0*u не выбрасывает u вместе с его ошибкой
+    std::map<std::string, Real> zero = {{"a", 0}};
+    auto scaled = make_expression<Real>("a * (1 / y)");
+    EXPECT_THROW(scaled.specialize(zero).eval({{"y", 0}}), std::runtime_error);
+    EXPECT_THROW(CompiledExpression<Real>(scaled).specialize(zero).eval({{"y", 0}}), std::runtime_error);
+    EXPECT_EQ(scaled.specialize(zero).eval({{"y", 2}}), 0);
+}
+
+TEST(PassManagerTest, LevelsPreserveValueAndReportPasses) {
+    auto expr = make_expression<Real>("((x + 1) ^ 2 + 2 * x * 3) * sin((x + 1) ^ 2 + 2 * x * 3) + exp(ln(y)) / 4");
+    std::map<std::string, Real> vars = {{"x", 0.6}, {"y", 2.5}};
+    EXPECT_TRUE(PassManager<Real>::for_level(0).getPasses().empty());
+
+    for (int level = 1; level <= 3; ++level)
+    {
+        std::vector<PassStats> stats;
+        auto manager = PassManager<Real>::for_level(level);
+        auto optimized = manager.run(expr, &stats);
+        ASSERT_EQ(stats.size(), manager.getPasses().size());
+        EXPECT_EQ(stats.front().nodes_before, count_nodes(expr.getRoot()));
+        EXPECT_EQ(stats.back().nodes_after, count_nodes(optimized.getRoot()));
+        EXPECT_LT(stats.back().nodes_after, stats.front().nodes_before);
+        EXPECT_NEAR(optimized.eval(vars), expr.eval(vars), 1e-12);
+    }
+
+    PassManager<Real> custom;
+    custom.add("normalize");
+    custom.add("cse");
+    std::vector<PassStats> stats;
+    custom.run(expr, &stats);
+    EXPECT_NE(format_pass_stats(stats).find("cse: "), std::string::npos);
+    EXPECT_THROW(custom.add("unroll"), std::runtime_error);
+    EXPECT_THROW(PassManager<Real>::for_level(4), std::runtime_error);
+}
+
+TEST(PassManagerTest, LevelsKeepResultsAtEdgePoints) {
+    // Итог вычисления: значение или исключение
+    auto outcome = [](const Expression<Real> &e, const std::map<std::string, Real> &vars) -> std::optional<Real>
+    {
+        try
+        {
+            return e.eval(vars);
+        }
+        catch (const std::runtime_error &)
+        {
+            return std::nullopt;
+        }
+    };
+    // -O1 и -O2: тот же результат до бита, включая знак нуля; -O3: то же округление не обязательно
+    auto same = [](Real a, Real b, bool exact)
+    {
+        if (std::isnan(a) || std::isnan(b))
+            return std::isnan(a) && std::isnan(b);
+        if (exact || !std::isfinite(a) || !std::isfinite(b))
+            return a == b && std::signbit(a) == std::signbit(b);
+        return std::fabs(a - b) <= 1e-12 * std::max<Real>(1, std::fabs(a));
+    };
+
+    const char *formulas[] = {"x ^ (0 - 1) + 1", "ln(x ^ 4)", "ln(x ^ 3) + ln(y)", "exp(ln(x)) + ln(x) + ln(y)",
+                              "(x / (y - y)) * 2", "x / x + y * 0", "x * x ^ (0 - 1)", "x ^ 0.5 * x ^ 0.5",
+                              "(x ^ 0.5) ^ 2", "(x + y + 1) ^ 3 - x ^ 2 / y", "sqrt(x) * sqrt(x) - x ^ (0 - 2)",
+                              "x - x", "ln(x) - ln(x)", "x / 3", "x + 0.1 + 0.2", "x * y - y * x", "2 * x / 3 + y / 4"};
+    const Real inf = std::numeric_limits<Real>::infinity();
+    const Real points[] = {0, -0.0L, -1, 2.5, 7, 0.1L, inf, -inf, std::numeric_limits<Real>::quiet_NaN()};
+    for (const char *text : formulas)
+    {
+        auto expr = make_expression<Real>(text);
+        for (int level = 1; level <= 3; ++level)
+        {
+            auto optimized = PassManager<Real>::for_level(level).run(expr);
+            for (Real x : points)
+                for (Real y : points)
+                {
+                    std::map<std::string, Real> vars = {{"x", x}, {"y", y}};
+                    auto before = outcome(expr, vars);
+                    auto after = outcome(optimized, vars);
+                    // -O3 (MathPolicy::Fast) может отличаться только там, где исходное не конечно
+                    if (level == 3 && !(before && std::isfinite(*before)))
+                        continue;
+                    ASSERT_EQ(before.has_value(), after.has_value())
+                        << text << " -O" << level << " x=" << x << " y=" << y << " -> " << optimized;
+                    if (before)
+                    {
+                        EXPECT_TRUE(same(*before, *after, level < 3))
+                            << text << " -O" << level << " x=" << x << " y=" << y << ": " << *before << " vs "
+                            << *after << " in " << optimized;
+                    }
+                }
+        }
+    }
+}
+
+TEST(RewriteTest, AppliesRulesWithPatternVariables) {
+    RuleSet<Real> rules;
+    rules.add("ln(a*b) -> ln(a)+ln(b)");
+    rules.add("sin(a)^2 + cos(a)^2 -> 1");
+    rules.add("exp(ln(a)) -> a");
+
+    size_t rewrites = 0;
+    auto expr = make_expression<Real>("ln(x*exp(ln(y))) * (sin(x+y)^2 + cos(x+y)^2)");
+    auto result = rules.apply(expr, &rewrites);
+    EXPECT_EQ(result.to_string(), "((ln(x)+ln(y))*1.000000)");
+    EXPECT_EQ(rewrites, 3u);
+
+    // Повторная переменная шаблона должна совпасть с одним и тем же поддеревом
+    auto other = make_expression<Real>("sin(x)^2 + cos(y)^2");
+    EXPECT_EQ(rules.apply(other, &rewrites).to_string(), other.to_string());
+    EXPECT_EQ(rewrites, 0u);
+
+    EXPECT_THROW(rules.add("ln(a) + b"), std::runtime_error);
+    EXPECT_THROW(rules.add("ln(a) -> b"), std::runtime_error);
+    EXPECT_THROW(rules.add("a*1 -> a"), std::runtime_error);
+}
+
+TEST(RewriteTest, ManyRulesShareDiscriminationTree) {
+    RuleSet<Real> rules;
+    for (int k = 2; k <= 1000; ++k)
+        rules.add("ln(a^" + std::to_string(k) + ") -> " + std::to_string(k) + "*ln(a)");
+    EXPECT_EQ(rules.size(), 999u);
+
+    auto expr = make_expression<Real>("ln(x^500) + ln(sin(y)^7) - ln(x^0.5)");
+    auto result = rules.apply(expr);
+    EXPECT_EQ(result.to_string(), "(((500.000000*ln(x))+(7.000000*ln(sin(y))))-ln((x^0.500000)))");
+}
+
+TEST(FormulaCacheTest, NormalisesKeysAndCountsHits) {
+    FormulaCache<Real> cache;
+    auto first = cache.get("Sin( X ) * y + 1");
+    auto second = cache.get("sin( x )  *  Y + 1");
+    ASSERT_TRUE(first && second);
+    EXPECT_EQ(first->get(), second->get());
+    EXPECT_EQ(FormulaCache<Real>::normalize_key(" 2  *  Foo_1 (( x )) "), "2 * foo_1 (( x ))");
+    EXPECT_EQ(FormulaCache<Real>::normalize_key("a b"), "a b");
+    // Пробел рядом с числом значим, регистр в числе не меняется
+    EXPECT_EQ(FormulaCache<Real>::normalize_key("1e -5"), "1e -5");
+    EXPECT_EQ(FormulaCache<Real>::normalize_key("2I+X"), "2I+x");
+    EXPECT_NEAR((*first)->compiled.eval({{"x", 0.5}, {"y", 2}}), 2 * std::sin(0.5L) + 1, 1e-15);
+
+    // Ошибки те же, что у try_parse: разбирается текст, а не ключ
+    for (const char *text : {"x + ", "  x   +  ", "1e -5"})
+    {
+        auto bad = cache.get(text);
+        auto direct = try_parse<Real>(text);
+        ASSERT_FALSE(bad);
+        ASSERT_FALSE(direct);
+        EXPECT_EQ(bad.error().kind, direct.error().kind) << text;
+        EXPECT_EQ(bad.error().offset, direct.error().offset) << text;
+    }
+    EXPECT_EQ(cache.get("  x   +  ").error().offset, 9u);
+
+    auto stats = cache.stats();
+    EXPECT_EQ(stats.hits, 1u);
+    EXPECT_EQ(stats.misses, 5u);
+    EXPECT_EQ(stats.entries, 1u);
+    EXPECT_GT(stats.bytes, 0u);
+}
+
+TEST(FormulaCacheTest, EvictsLeastRecentlyUsedWithinBudget) {
+    FormulaCache<Real> probe;
+    size_t entry = (*probe.get("x + 1"))->bytes + 5;
+    FormulaCache<Real> cache(3 * entry);
+
+    cache.get("x + 1");
+    cache.get("x + 2");
+    cache.get("x + 3");
+    cache.get("x + 1"); // x + 2 теперь самая старая
+    cache.get("x + 4");
+    auto stats = cache.stats();
+    EXPECT_EQ(stats.entries, 3u);
+    EXPECT_EQ(stats.evictions, 1u);
+    EXPECT_LE(stats.bytes, cache.getBudget());
+
+    cache.get("x + 1");
+    cache.get("x + 2");
+    stats = cache.stats();
+    EXPECT_EQ(stats.hits, 2u);
+    EXPECT_EQ(stats.misses, 5u);
+
+    // Формулы одновременно из нескольких потоков
+    FormulaCache<Real> shared(4 * entry);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&shared, t]
+                             {
+                                 for (int k = 0; k < 500; ++k)
+                                 {
+                                     int c = (k + t) % 6;
+                                     auto f = shared.get("x + " + std::to_string(c));
+                                     ASSERT_TRUE(f);
+                                     EXPECT_EQ((*f)->compiled.eval({{"x", 1}}), 1 + c);
+                                 }
+                             });
+    for (auto &thread : threads)
+        thread.join();
+    stats = shared.stats();
+    EXPECT_EQ(stats.hits + stats.misses, 2000u);
+    EXPECT_LE(stats.entries, 4u);
+    EXPECT_LE(stats.bytes, shared.getBudget());
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();